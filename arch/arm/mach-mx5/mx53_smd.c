@@ -1158,6 +1158,11 @@ static void __init fixup_mxc_board(struct machine_desc *desc, struct tag *tags,
 	int left_mem = 0;
 	int gpu_mem = SZ_128M;
 	int fb_mem = SZ_32M;
+#ifdef CONFIG_MXC_VPU_POOL_SIZE
+	int vpu_mem = CONFIG_MXC_VPU_POOL_SIZE * SZ_1M;
+#else
+	int vpu_mem = 0;
+#endif
 	char *str;
 
 	mxc_set_cpu_type(MXC_CPU_MX53);
@@ -1190,10 +1195,23 @@ static void __init fixup_mxc_board(struct machine_desc *desc, struct tag *tags,
 				gpu_mem = memparse(str, &str);
 			}
 
+			str = t->u.cmdline.cmdline;
+			str = strstr(str, "vpu_memory=");
+			if (str != NULL) {
+				str += 11;
+				vpu_mem = memparse(str, &str);
+			}
+
 			break;
 		}
 	}
 
+	/* the vpu buffer pool is taken from the top of memory */
+	vpu_mem = ALIGN(vpu_mem, SZ_1M);
+	if (vpu_mem < 0 || vpu_mem >= total_mem)
+		vpu_mem = 0;
+	total_mem -= vpu_mem;
+
 	if (gpu_data.enable_mmu)
 		gpu_mem = 0;
 
@@ -1208,6 +1226,13 @@ static void __init fixup_mxc_board(struct machine_desc *desc, struct tag *tags,
 		}
 		mem_tag->u.mem.size = left_mem;
 
+		/*reserve memory for vpu*/
+		if (vpu_mem) {
+			mxc_vpu_data.pool_base =
+				mem_tag->u.mem.start + total_mem;
+			mxc_vpu_data.pool_size = vpu_mem;
+		}
+
 		/*reserve memory for gpu*/
 		if (!gpu_data.enable_mmu) {
 			gpu_device.resource[5].start =
@@ -50,6 +50,15 @@ struct vpu_mem_desc {
 #define VPU_IOC_GET_SHARE_MEM   _IO(VPU_IOC_MAGIC, 12)
 #define VPU_IOC_QUERY_BITWORK_MEM  _IO(VPU_IOC_MAGIC, 13)
 #define VPU_IOC_SET_BITWORK_MEM    _IO(VPU_IOC_MAGIC, 14)
+/*
+ * Take and give back ownership of the VPU for the calling file.  While
+ * a file owns the VPU, VPU_IOC_WAIT4INT on it only returns for
+ * interrupts raised during its ownership.  Waiters for ownership are
+ * served in FIFO order; LOCK_DEV by the owner while others wait yields.
+ * The argument of LOCK_DEV is a timeout in ms, 0 waits forever.
+ */
+#define VPU_IOC_LOCK_DEV	_IO(VPU_IOC_MAGIC, 16)
+#define VPU_IOC_UNLOCK_DEV	_IO(VPU_IOC_MAGIC, 17)
 
 #define BIT_CODE_RUN			0x000
 #define BIT_CODE_DOWN			0x004
@@ -567,6 +567,41 @@ void mxc_get_static_channels(mxc_dma_channel_t *chnl);
  */
 int __init sdma_init(void);
 
+#ifdef CONFIG_MXC_SDMA_DMAENGINE
+#include <linux/dmaengine.h>
+
+/*!
+ * Client data for the SDMA dmaengine channels. The peripheral driver's
+ * dma_request_channel() filter points chan->private at this structure.
+ * Channels serving the same device ID share one SDMA hardware channel.
+ */
+struct mxc_sdma_slave {
+	/*! ID of the peripheral the channel transfers for */
+	mxc_dma_device_t dma_id;
+	/*! Name shown in /proc/sdma/channels */
+	char *name;
+};
+
+/*!
+ * Prepares a cyclic transfer on an SDMA dmaengine channel. The buffer is
+ * split in buf_len / period_len periods, the descriptor callback runs
+ * once per elapsed period until the channel is terminated.
+ *
+ * @param chan        dmaengine channel
+ * @param buf_addr    bus address of the ring buffer
+ * @param buf_len     ring buffer length, a multiple of period_len
+ * @param period_len  period length in bytes
+ * @param direction   DMA_TO_DEVICE or DMA_FROM_DEVICE
+ * @return descriptor to submit, NULL on error
+ */
+struct dma_async_tx_descriptor *mxc_sdma_prep_cyclic(struct dma_chan *chan,
+						     dma_addr_t buf_addr,
+						     size_t buf_len,
+						     size_t period_len,
+						     enum dma_data_direction
+						     direction);
+#endif
+
 #define DEFAULT_ERR     1
 
 #endif
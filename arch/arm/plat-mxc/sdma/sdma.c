@@ -63,6 +63,18 @@ static struct semaphore sdma_synch_mutex[MAX_DMA_CHANNELS];
  */
 extern void init_sdma_pool(void);
 
+/*!
+ * SDMA buffers pool usage counters
+ */
+extern int sdma_malloc_stats(char *buf, int size);
+
+#ifdef CONFIG_MXC_SDMA_DMAENGINE
+/*!
+ * SDMA dmaengine front-end registration
+ */
+extern int sdma_dmaengine_init(struct device *dev);
+#endif
+
 /*!
  * Flags are save and restored during interrupt handler
  */
@@ -1176,6 +1188,19 @@ void mxc_dma_set_callback(int channel, dma_callback_t callback, void *arg)
 	sdma_data[channel].arg = arg;
 }
 
+/*!
+ * Returns the I.API channel control block of an opened channel. Used by
+ * the dmaengine front-end, which points the channel at its own buffer
+ * descriptors instead of going through iapi_IoCtl().
+ *
+ * @param   channel           channel number
+ * @return  channel control block
+ */
+channelControlBlock *mxc_sdma_get_ccb(int channel)
+{
+	return sdma_data[channel].cd->ccb_ptr;
+}
+
 /*!
  * Synchronization function used by I.API
  *
@@ -1319,6 +1344,8 @@ static int proc_read_channels(char *buf, char **start, off_t offset, int count,
 		log_ptr += strlen(tmp);
 	}
 
+	log_ptr += sdma_malloc_stats(log_ptr, 4096 - 1 - (log_ptr - log));
+
 	if (offset > strlen(log)) {
 		*eof = 1;
 		count = 0;
@@ -1330,10 +1357,10 @@ static int proc_read_channels(char *buf, char **start, off_t offset, int count,
 			*eof = 0;
 		}
 
-		memcpy(buf, log, count);
+		memcpy(buf, log + offset, count);
 		*start = buf;
-		kfree(log);
 	}
+	kfree(log);
 
 	return count;
 }
@@ -1495,6 +1522,11 @@ int sdma_probe(struct platform_device *pdev)
 
 	init_proc_fs();
 
+#ifdef CONFIG_MXC_SDMA_DMAENGINE
+	if (sdma_dmaengine_init(&pdev->dev) < 0)
+		printk(KERN_WARNING "Failed to register SDMA dmaengine\n");
+#endif
+
 	printk(KERN_INFO "MXC DMA API initialized\n");
 
 	clk_disable(mxc_sdma_ahb_clk);
@@ -0,0 +1,657 @@
+/*
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/*!
+ * @file plat-mxc/sdma/sdma_dmaengine.c
+ * @brief dmaengine front-end for the Smart DMA.
+ *
+ * The dmaengine channels exported here are virtual. A virtual channel is
+ * bound to an SDMA hardware channel when it is allocated; every virtual
+ * channel serving the same peripheral (mxc_dma_device_t) shares that
+ * hardware channel, so several clients cost one channel context and one
+ * interrupt source. Descriptors carry their own buffer descriptor array
+ * and are queued per hardware channel in issue order. The hardware runs
+ * one descriptor at a time, raises a single interrupt at its end (or at
+ * every period for cyclic transfers) and the channel tasklet completes it
+ * and starts the next one. Nothing on the prepare/submit/issue path
+ * sleeps or goes through the I.API channel semaphores.
+ *
+ * @ingroup SDMA
+ */
+
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+#include <linux/dmaengine.h>
+#include <linux/dmapool.h>
+#include <linux/dma-mapping.h>
+#include <mach/dma.h>
+#include <mach/hardware.h>
+
+#include "iapi.h"
+
+/*! Number of virtual channels registered with dmaengine */
+#define SDMA_VCHAN_NUM		32
+/*! Largest buffer descriptor array of one descriptor */
+#define SDMA_DESC_MAX_BD	64
+/*! Largest word aligned count of one buffer descriptor */
+#define SDMA_BD_MAX_COUNT	0xfffc
+
+extern channelControlBlock *mxc_sdma_get_ccb(int channel);
+
+struct sdma_vchan;
+
+/*!
+ * One prepared transfer. The buffer descriptors are handed to the
+ * hardware as they are; the last one (or each period) has BD_INTR set.
+ */
+struct sdma_desc {
+	struct dma_async_tx_descriptor txd;
+	struct list_head node;
+	struct sdma_vchan *vc;
+	/*! Buffer descriptor array, from sdma_bd_pool */
+	bufferDescriptor *bd;
+	dma_addr_t bd_phys;
+	int bd_num;
+	/*! Cyclic transfer: next period expected to complete */
+	int cyclic;
+	int period;
+	unsigned int period_len;
+};
+
+/*!
+ * SDMA hardware channel shared by the virtual channels of one peripheral
+ */
+struct sdma_pchan {
+	/*! Hardware channel number, from mxc_dma_request() */
+	int channel;
+	mxc_dma_device_t dma_id;
+	/*! Number of virtual channels bound to this channel */
+	int users;
+	int paused;
+	unsigned int word_size;
+	enum dma_data_direction direction;
+	channelControlBlock *ccb;
+	/*! Buffer descriptor pointers owned by I.API, restored on release */
+	bufferDescriptor *saved_base;
+	bufferDescriptor *saved_current;
+	/*! Protects the queue and the bound virtual channels' lists */
+	spinlock_t lock;
+	/*! Issued descriptors, the first one is on the hardware */
+	struct list_head queue;
+	struct sdma_desc *active;
+	struct tasklet_struct tasklet;
+};
+
+struct sdma_vchan {
+	struct dma_chan chan;
+	struct sdma_pchan *pchan;
+	/*! Submitted but not yet issued descriptors */
+	struct list_head submitted;
+	dma_cookie_t completed;
+};
+
+static struct sdma_pchan sdma_pchans[MAX_DMA_CHANNELS];
+static struct sdma_vchan sdma_vchans[SDMA_VCHAN_NUM];
+static struct dma_device sdma_dma_device;
+static struct dma_pool *sdma_bd_pool;
+
+/*!
+ * Serializes binding virtual channels to hardware channels
+ */
+static DEFINE_MUTEX(sdma_pchan_mutex);
+
+static inline struct sdma_vchan *to_sdma_vchan(struct dma_chan *chan)
+{
+	return container_of(chan, struct sdma_vchan, chan);
+}
+
+static inline struct sdma_desc *to_sdma_desc(struct dma_async_tx_descriptor
+					     *txd)
+{
+	return container_of(txd, struct sdma_desc, txd);
+}
+
+/*!
+ * Returns the dmaengine direction of an SDMA transfer type, or
+ * DMA_NONE for memory to memory transfers.
+ */
+static enum dma_data_direction sdma_transfer_direction(sdma_transferT type)
+{
+	switch (type) {
+	case emi_2_per:
+	case int_2_per:
+	case dsp_2_per:
+	case emi_2_dsp:
+	case int_2_dsp:
+		return DMA_TO_DEVICE;
+	case per_2_emi:
+	case per_2_int:
+	case per_2_dsp:
+	case dsp_2_emi:
+	case dsp_2_int:
+		return DMA_FROM_DEVICE;
+	default:
+		return DMA_NONE;
+	}
+}
+
+/*!
+ * Starts the first queued descriptor if the channel is idle.
+ * Called with pchan->lock held.
+ */
+static void sdma_pchan_start(struct sdma_pchan *pchan)
+{
+	struct sdma_desc *desc;
+
+	if (pchan->active || pchan->paused || list_empty(&pchan->queue))
+		return;
+
+	desc = list_first_entry(&pchan->queue, struct sdma_desc, node);
+	pchan->active = desc;
+
+	/* BD_WRAP returns to the base pointer, so both point at the array */
+	pchan->ccb->baseBDptr = (bufferDescriptor *)desc->bd_phys;
+	pchan->ccb->currentBDptr = (bufferDescriptor *)desc->bd_phys;
+	wmb();
+
+	mxc_dma_start(pchan->channel);
+}
+
+/*!
+ * SDMA channel callback, called from the SDMA interrupt handler
+ */
+static void sdma_pchan_irq(void *arg)
+{
+	struct sdma_pchan *pchan = arg;
+
+	tasklet_schedule(&pchan->tasklet);
+}
+
+/*!
+ * Completion tasklet. Completes the active descriptor once its last
+ * buffer descriptor has been closed, or reports and re-arms the periods
+ * of a cyclic descriptor.
+ */
+static void sdma_pchan_tasklet(unsigned long data)
+{
+	struct sdma_pchan *pchan = (struct sdma_pchan *)data;
+	struct sdma_desc *desc;
+	bufferDescriptor *bd;
+	dma_async_tx_callback callback;
+	void *param;
+	unsigned long flags;
+	int i, periods = 0, error = 0;
+
+	spin_lock_irqsave(&pchan->lock, flags);
+
+	desc = pchan->active;
+	if (!desc) {
+		spin_unlock_irqrestore(&pchan->lock, flags);
+		return;
+	}
+
+	if (desc->cyclic) {
+		bd = &desc->bd[desc->period];
+		while (!(bd->mode.status & BD_DONE)) {
+			if (bd->mode.status & BD_RROR)
+				error = 1;
+			bd->mode.count = desc->period_len;
+			bd->mode.status |= BD_DONE;
+			bd->mode.status &= ~BD_RROR;
+			periods++;
+			if (++desc->period == desc->bd_num)
+				desc->period = 0;
+			bd = &desc->bd[desc->period];
+		}
+		/* Restart the hardware in case it caught up with us */
+		if (periods && !pchan->paused)
+			mxc_dma_start(pchan->channel);
+		callback = desc->txd.callback;
+		param = desc->txd.callback_param;
+		spin_unlock_irqrestore(&pchan->lock, flags);
+
+		if (error)
+			printk(KERN_WARNING "SDMA channel %d: period error\n",
+			       pchan->channel);
+		while (callback && periods--)
+			callback(param);
+		return;
+	}
+
+	if (desc->bd[desc->bd_num - 1].mode.status & BD_DONE) {
+		spin_unlock_irqrestore(&pchan->lock, flags);
+		return;
+	}
+
+	for (i = 0; i < desc->bd_num; i++)
+		if (desc->bd[i].mode.status & BD_RROR)
+			error = 1;
+
+	list_del(&desc->node);
+	desc->vc->completed = desc->txd.cookie;
+	pchan->active = NULL;
+	sdma_pchan_start(pchan);
+
+	spin_unlock_irqrestore(&pchan->lock, flags);
+
+	if (error)
+		printk(KERN_WARNING "SDMA channel %d: transfer error\n",
+		       pchan->channel);
+
+	callback = desc->txd.callback;
+	param = desc->txd.callback_param;
+	dma_pool_free(sdma_bd_pool, desc->bd, desc->bd_phys);
+	kfree(desc);
+
+	if (callback)
+		callback(param);
+}
+
+static dma_cookie_t sdma_tx_submit(struct dma_async_tx_descriptor *txd)
+{
+	struct sdma_desc *desc = to_sdma_desc(txd);
+	struct sdma_vchan *vc = desc->vc;
+	struct dma_chan *chan = &vc->chan;
+	dma_cookie_t cookie;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vc->pchan->lock, flags);
+
+	cookie = chan->cookie + 1;
+	if (cookie < 0)
+		cookie = 1;
+	chan->cookie = cookie;
+	txd->cookie = cookie;
+	list_add_tail(&desc->node, &vc->submitted);
+
+	spin_unlock_irqrestore(&vc->pchan->lock, flags);
+
+	return cookie;
+}
+
+/*!
+ * Allocates a descriptor with room for bd_num buffer descriptors.
+ * May be called from atomic context.
+ */
+static struct sdma_desc *sdma_desc_alloc(struct sdma_vchan *vc, int bd_num,
+					 unsigned long flags)
+{
+	struct sdma_desc *desc;
+
+	desc = kzalloc(sizeof(*desc), GFP_ATOMIC);
+	if (!desc)
+		return NULL;
+
+	desc->bd = dma_pool_alloc(sdma_bd_pool, GFP_ATOMIC, &desc->bd_phys);
+	if (!desc->bd) {
+		kfree(desc);
+		return NULL;
+	}
+
+	dma_async_tx_descriptor_init(&desc->txd, &vc->chan);
+	desc->txd.tx_submit = sdma_tx_submit;
+	desc->txd.flags = flags;
+	desc->vc = vc;
+	desc->bd_num = bd_num;
+	INIT_LIST_HEAD(&desc->node);
+
+	return desc;
+}
+
+static void sdma_set_bd(struct sdma_pchan *pchan, bufferDescriptor *bd,
+			dma_addr_t addr, unsigned int count, int status)
+{
+	bd->bufferAddr = (void *)addr;
+	bd->extBufferAddr = NULL;
+	bd->mode.count = count;
+	bd->mode.command = pchan->word_size;
+	bd->mode.status = status;
+}
+
+static struct dma_async_tx_descriptor *sdma_prep_slave_sg(
+	struct dma_chan *chan, struct scatterlist *sgl, unsigned int sg_len,
+	enum dma_data_direction direction, unsigned long flags)
+{
+	struct sdma_vchan *vc = to_sdma_vchan(chan);
+	struct sdma_pchan *pchan = vc->pchan;
+	struct sdma_desc *desc;
+	struct scatterlist *sg;
+	dma_addr_t addr;
+	unsigned int len, count;
+	int i, n, bd_num = 0;
+
+	if (direction != pchan->direction)
+		return NULL;
+
+	for_each_sg(sgl, sg, sg_len, i)
+		bd_num += DIV_ROUND_UP(sg_dma_len(sg), SDMA_BD_MAX_COUNT);
+
+	if (bd_num == 0 || bd_num > SDMA_DESC_MAX_BD)
+		return NULL;
+
+	desc = sdma_desc_alloc(vc, bd_num, flags);
+	if (!desc)
+		return NULL;
+
+	n = 0;
+	for_each_sg(sgl, sg, sg_len, i) {
+		addr = sg_dma_address(sg);
+		len = sg_dma_len(sg);
+		while (len) {
+			count = min_t(unsigned int, len, SDMA_BD_MAX_COUNT);
+			sdma_set_bd(pchan, &desc->bd[n++], addr, count,
+				    BD_DONE | BD_EXTD | BD_CONT);
+			addr += count;
+			len -= count;
+		}
+	}
+
+	/* A single interrupt, at the end of the whole list */
+	desc->bd[bd_num - 1].mode.status = BD_DONE | BD_EXTD | BD_INTR;
+
+	return &desc->txd;
+}
+
+struct dma_async_tx_descriptor *mxc_sdma_prep_cyclic(struct dma_chan *chan,
+						     dma_addr_t buf_addr,
+						     size_t buf_len,
+						     size_t period_len,
+						     enum dma_data_direction
+						     direction)
+{
+	struct sdma_vchan *vc = to_sdma_vchan(chan);
+	struct sdma_pchan *pchan = vc->pchan;
+	struct sdma_desc *desc;
+	int i, periods;
+
+	if (chan->device != &sdma_dma_device || direction != pchan->direction)
+		return NULL;
+
+	if (period_len == 0 || period_len > SDMA_BD_MAX_COUNT ||
+	    buf_len % period_len)
+		return NULL;
+
+	periods = buf_len / period_len;
+	if (periods == 0 || periods > SDMA_DESC_MAX_BD)
+		return NULL;
+
+	desc = sdma_desc_alloc(vc, periods, DMA_PREP_INTERRUPT);
+	if (!desc)
+		return NULL;
+
+	desc->cyclic = 1;
+	desc->period_len = period_len;
+	for (i = 0; i < periods; i++)
+		sdma_set_bd(pchan, &desc->bd[i], buf_addr + i * period_len,
+			    period_len, BD_DONE | BD_EXTD | BD_INTR | BD_CONT);
+	desc->bd[periods - 1].mode.status |= BD_WRAP;
+
+	return &desc->txd;
+}
+EXPORT_SYMBOL(mxc_sdma_prep_cyclic);
+
+static void sdma_issue_pending(struct dma_chan *chan)
+{
+	struct sdma_vchan *vc = to_sdma_vchan(chan);
+	struct sdma_pchan *pchan = vc->pchan;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pchan->lock, flags);
+	list_splice_tail_init(&vc->submitted, &pchan->queue);
+	sdma_pchan_start(pchan);
+	spin_unlock_irqrestore(&pchan->lock, flags);
+}
+
+static enum dma_status sdma_tx_status(struct dma_chan *chan,
+				      dma_cookie_t cookie,
+				      struct dma_tx_state *txstate)
+{
+	struct sdma_vchan *vc = to_sdma_vchan(chan);
+	dma_cookie_t last_used, last_complete;
+	enum dma_status ret;
+
+	last_complete = vc->completed;
+	last_used = chan->cookie;
+
+	ret = dma_async_is_complete(cookie, last_complete, last_used);
+	dma_set_tx_state(txstate, last_complete, last_used, 0);
+
+	if (ret != DMA_SUCCESS && vc->pchan->paused)
+		ret = DMA_PAUSED;
+
+	return ret;
+}
+
+/*!
+ * Drops every descriptor of a virtual channel. The hardware channel is
+ * only stopped if it is working for this virtual channel; the next
+ * descriptor of a sibling channel is started in its place.
+ */
+static void sdma_terminate_all(struct sdma_vchan *vc)
+{
+	struct sdma_pchan *pchan = vc->pchan;
+	struct sdma_desc *desc, *tmp;
+	unsigned long flags;
+	LIST_HEAD(head);
+
+	spin_lock_irqsave(&pchan->lock, flags);
+
+	list_splice_init(&vc->submitted, &head);
+	if (pchan->active && pchan->active->vc == vc) {
+		mxc_dma_stop(pchan->channel);
+		pchan->active = NULL;
+	}
+	list_for_each_entry_safe(desc, tmp, &pchan->queue, node)
+		if (desc->vc == vc)
+			list_move_tail(&desc->node, &head);
+	vc->completed = vc->chan.cookie;
+	sdma_pchan_start(pchan);
+
+	spin_unlock_irqrestore(&pchan->lock, flags);
+
+	list_for_each_entry_safe(desc, tmp, &head, node) {
+		dma_pool_free(sdma_bd_pool, desc->bd, desc->bd_phys);
+		kfree(desc);
+	}
+}
+
+static int sdma_control(struct dma_chan *chan, enum dma_ctrl_cmd cmd,
+			unsigned long arg)
+{
+	struct sdma_vchan *vc = to_sdma_vchan(chan);
+	struct sdma_pchan *pchan = vc->pchan;
+	unsigned long flags;
+
+	switch (cmd) {
+	case DMA_TERMINATE_ALL:
+		sdma_terminate_all(vc);
+		return 0;
+	case DMA_PAUSE:
+	case DMA_RESUME:
+		/* Pausing a shared channel would stall its other clients */
+		if (pchan->users > 1)
+			return -EBUSY;
+		spin_lock_irqsave(&pchan->lock, flags);
+		if (cmd == DMA_PAUSE) {
+			pchan->paused = 1;
+			mxc_dma_stop(pchan->channel);
+		} else {
+			pchan->paused = 0;
+			if (pchan->active)
+				mxc_dma_start(pchan->channel);
+			else
+				sdma_pchan_start(pchan);
+		}
+		spin_unlock_irqrestore(&pchan->lock, flags);
+		return 0;
+	default:
+		return -ENXIO;
+	}
+}
+
+/*!
+ * Binds to the hardware channel of a peripheral, requesting and setting
+ * it up on first use. Called with sdma_pchan_mutex held.
+ */
+static struct sdma_pchan *sdma_pchan_get(struct mxc_sdma_slave *slave)
+{
+	mxc_sdma_channel_params_t *params;
+	struct sdma_pchan *pchan;
+	enum dma_data_direction direction;
+	int i, channel;
+
+	for (i = 0; i < MAX_DMA_CHANNELS; i++) {
+		pchan = &sdma_pchans[i];
+		if (pchan->users && pchan->dma_id == slave->dma_id) {
+			pchan->users++;
+			return pchan;
+		}
+	}
+
+	params = mxc_sdma_get_channel_params(slave->dma_id);
+	if (params == NULL)
+		return NULL;
+
+	direction = sdma_transfer_direction(params->chnl_params.transfer_type);
+	if (direction == DMA_NONE)
+		return NULL;
+
+	channel = mxc_dma_request(slave->dma_id,
+				  slave->name ? slave->name : "sdma-vchan");
+	if (channel < 0)
+		return NULL;
+
+	pchan = &sdma_pchans[channel];
+	pchan->channel = channel;
+	pchan->dma_id = slave->dma_id;
+	pchan->users = 1;
+	pchan->paused = 0;
+	pchan->word_size = params->chnl_params.word_size;
+	pchan->direction = direction;
+	pchan->ccb = mxc_sdma_get_ccb(channel);
+	pchan->saved_base = pchan->ccb->baseBDptr;
+	pchan->saved_current = pchan->ccb->currentBDptr;
+	pchan->active = NULL;
+	INIT_LIST_HEAD(&pchan->queue);
+	spin_lock_init(&pchan->lock);
+	tasklet_init(&pchan->tasklet, sdma_pchan_tasklet,
+		     (unsigned long)pchan);
+
+	mxc_dma_set_callback(channel, sdma_pchan_irq, pchan);
+
+	return pchan;
+}
+
+/*!
+ * Drops a reference to a hardware channel and releases it with the last
+ * one. Called with sdma_pchan_mutex held.
+ */
+static void sdma_pchan_put(struct sdma_pchan *pchan)
+{
+	if (--pchan->users)
+		return;
+
+	mxc_dma_stop(pchan->channel);
+	tasklet_kill(&pchan->tasklet);
+
+	/* Give I.API back its own buffer descriptors before closing */
+	pchan->ccb->baseBDptr = pchan->saved_base;
+	pchan->ccb->currentBDptr = pchan->saved_current;
+
+	mxc_dma_free(pchan->channel);
+}
+
+static int sdma_alloc_chan_resources(struct dma_chan *chan)
+{
+	struct sdma_vchan *vc = to_sdma_vchan(chan);
+	struct mxc_sdma_slave *slave = chan->private;
+	struct sdma_pchan *pchan;
+
+	if (!slave)
+		return -EINVAL;
+
+	mutex_lock(&sdma_pchan_mutex);
+	pchan = sdma_pchan_get(slave);
+	mutex_unlock(&sdma_pchan_mutex);
+
+	if (!pchan)
+		return -EBUSY;
+
+	vc->pchan = pchan;
+	vc->completed = chan->cookie = 1;
+	INIT_LIST_HEAD(&vc->submitted);
+
+	return 0;
+}
+
+static void sdma_free_chan_resources(struct dma_chan *chan)
+{
+	struct sdma_vchan *vc = to_sdma_vchan(chan);
+
+	if (!vc->pchan)
+		return;
+
+	sdma_terminate_all(vc);
+
+	mutex_lock(&sdma_pchan_mutex);
+	sdma_pchan_put(vc->pchan);
+	mutex_unlock(&sdma_pchan_mutex);
+
+	vc->pchan = NULL;
+}
+
+/*!
+ * Registers the SDMA virtual channels with dmaengine. Called from the
+ * SDMA probe once I.API is up.
+ *
+ * @param   dev           SDMA platform device
+ * @return  0 on success, error code on fail
+ */
+int sdma_dmaengine_init(struct device *dev)
+{
+	struct dma_device *dma = &sdma_dma_device;
+	int i;
+
+	sdma_bd_pool = dma_pool_create("sdma_bd", dev,
+				       SDMA_DESC_MAX_BD *
+				       sizeof(bufferDescriptor), 4, 0);
+	if (!sdma_bd_pool)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&dma->channels);
+	dma_cap_set(DMA_SLAVE, dma->cap_mask);
+	dma_cap_set(DMA_PRIVATE, dma->cap_mask);
+
+	for (i = 0; i < SDMA_VCHAN_NUM; i++) {
+		struct sdma_vchan *vc = &sdma_vchans[i];
+
+		vc->chan.device = dma;
+		INIT_LIST_HEAD(&vc->submitted);
+		list_add_tail(&vc->chan.device_node, &dma->channels);
+	}
+
+	dma->dev = dev;
+	dma->device_alloc_chan_resources = sdma_alloc_chan_resources;
+	dma->device_free_chan_resources = sdma_free_chan_resources;
+	dma->device_prep_slave_sg = sdma_prep_slave_sg;
+	dma->device_control = sdma_control;
+	dma->device_tx_status = sdma_tx_status;
+	dma->device_issue_pending = sdma_issue_pending;
+
+	i = dma_async_device_register(dma);
+	if (i) {
+		dma_pool_destroy(sdma_bd_pool);
+		return i;
+	}
+
+	return 0;
+}
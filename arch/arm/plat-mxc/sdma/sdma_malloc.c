@@ -22,11 +22,11 @@
 
 #include <linux/device.h>
 #include <linux/dma-mapping.h>
-#include <linux/dmapool.h>
 #include <linux/init.h>
 #include <linux/types.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/genalloc.h>
 #include <linux/iram_alloc.h>
 #include <asm/dma.h>
@@ -43,43 +43,104 @@
 
 #ifdef CONFIG_SDMA_IRAM
 #define IRAM_SDMA_SIZE	SZ_4K
+#define IRAM_SDMA_ORDER	6
 #endif
 
 /*!
- * Defines SDMA non-cacheable buffers pool
+ * SDMA non-cacheable memory is taken from the system in chunks of
+ * SDMA_CHUNK_SIZE bytes as the pool runs out, up to sdma_max_chunks of
+ * them ("sdma_chunks=" on the command line). Translating an address is a
+ * range check against each chunk, so it costs the same whatever the
+ * number of allocations.
  */
-static struct dma_pool *pool;
-static struct gen_pool *sdma_iram_pool;
+#define SDMA_CHUNK_SIZE		SZ_16K
+#define SDMA_MAX_CHUNKS		64
+#define SDMA_CHUNK_PAGES	(SDMA_CHUNK_SIZE >> PAGE_SHIFT)
 
 /*!
- * SDMA memory conversion hashing structure
+ * Size classes are powers of two from 32 bytes to a page. Every page of
+ * a chunk is carved into blocks of a single class, which is how
+ * sdma_free() finds the size of a block.
  */
-typedef struct {
-	struct list_head node;
+#define SDMA_MIN_SHIFT		5
+#define SDMA_NR_CLASSES		(PAGE_SHIFT - SDMA_MIN_SHIFT + 1)
+#define SDMA_MAX_SIZE		PAGE_SIZE
+
+/*!
+ * Chunk of SDMA non-cacheable memory
+ */
+typedef struct sdma_chunk {
+	/*! Next older chunk */
+	struct sdma_chunk *next;
 	/*! Virtual address */
 	void *virt;
 	/*! Physical address */
 	unsigned long phys;
-	int size;
-	bool in_iram;
-} virt_phys_struct;
+	/*! Number of pages handed to size classes */
+	int used_pages;
+	/*! Size class of each page */
+	unsigned char page_class[SDMA_CHUNK_PAGES];
+} sdma_chunk_struct;
 
-static struct list_head alloc_list;
+/*!
+ * Free block, linked through the block itself
+ */
+typedef struct sdma_free_block {
+	struct sdma_free_block *next;
+} sdma_free_block;
+
+/*!
+ * Size class free list and counters
+ */
+typedef struct {
+	sdma_free_block *free;
+	int pages;
+	int in_use;
+	unsigned long allocs;
+	unsigned long frees;
+} sdma_class_struct;
+
+/*! Chunk list, newest first; chunks are never removed */
+static sdma_chunk_struct *sdma_chunks;
+static int sdma_nr_chunks;
+static int sdma_max_chunks = SDMA_MAX_CHUNKS;
+static sdma_class_struct sdma_classes[SDMA_NR_CLASSES];
+static unsigned long sdma_alloc_failed;
 
 /*!
- * Defines the size of each buffer in SDMA pool.
- * The size must be at least 512 bytes, because
- * sdma channel control blocks array size is 512 bytes
+ * Protects the chunks, the free lists and the counters
  */
-#define SDMA_POOL_SIZE 1024
+static DEFINE_SPINLOCK(sdma_pool_lock);
 
 #ifdef CONFIG_SDMA_IRAM
+static struct gen_pool *sdma_iram_pool;
 static unsigned long iram_paddr;
 static void *iram_vaddr;
+/*! Size of the IRAM allocation starting at each granule */
+static unsigned short iram_size[IRAM_SDMA_SIZE >> IRAM_SDMA_ORDER];
+static int iram_used;
+static unsigned long iram_fallbacks;
 #define iram_phys_to_virt(p) (iram_vaddr + ((p) - iram_paddr))
 #define iram_virt_to_phys(v) (iram_paddr + ((v) - iram_vaddr))
+#define iram_has_virt(v) \
+	((void *)(v) >= iram_vaddr && (void *)(v) < iram_vaddr + IRAM_SDMA_SIZE)
+#define iram_has_phys(p) \
+	((p) >= iram_paddr && (p) < iram_paddr + IRAM_SDMA_SIZE)
 #endif
 
+/*!
+ * Returns the chunk holding a virtual address, or NULL
+ */
+static inline sdma_chunk_struct *sdma_chunk_of_virt(void *buf)
+{
+	sdma_chunk_struct *c;
+
+	for (c = sdma_chunks; c; c = c->next)
+		if (buf >= c->virt && buf < c->virt + SDMA_CHUNK_SIZE)
+			return c;
+	return NULL;
+}
+
 /*!
  * Virtual to physical address conversion functio
  *
@@ -89,16 +150,18 @@ static void *iram_vaddr;
  */
 unsigned long sdma_virt_to_phys(void *buf)
 {
-	u32 offset = (u32) buf & (~PAGE_MASK);
-	virt_phys_struct *p;
+	sdma_chunk_struct *c;
 
 	DPRINTK("searching for vaddr 0x%p\n", buf);
 
-	list_for_each_entry(p, &alloc_list, node) {
-		if (((u32)p->virt & PAGE_MASK) == ((u32) buf & PAGE_MASK)) {
-			return (p->phys & PAGE_MASK) | offset;
-		}
-	}
+#ifdef CONFIG_SDMA_IRAM
+	if (iram_has_virt(buf))
+		return iram_virt_to_phys(buf);
+#endif
+
+	c = sdma_chunk_of_virt(buf);
+	if (c)
+		return c->phys + (buf - c->virt);
 
 	if (virt_addr_valid(buf)) {
 		return virt_to_phys(buf);
@@ -118,22 +181,121 @@ unsigned long sdma_virt_to_phys(void *buf)
  */
 void *sdma_phys_to_virt(unsigned long buf)
 {
-	u32 offset = buf & (~PAGE_MASK);
-	virt_phys_struct *p;
+	sdma_chunk_struct *c;
 
 	DPRINTK("searching for paddr 0x%p\n", buf);
 
-	list_for_each_entry(p, &alloc_list, node) {
-		if ((p->phys & PAGE_MASK) == (buf & PAGE_MASK)) {
-			return (void *)(((u32)p->virt & PAGE_MASK) | offset);
-		}
-	}
+#ifdef CONFIG_SDMA_IRAM
+	if (iram_has_phys(buf))
+		return iram_phys_to_virt(buf);
+#endif
+
+	for (c = sdma_chunks; c; c = c->next)
+		if (buf >= c->phys && buf < c->phys + SDMA_CHUNK_SIZE)
+			return c->virt + (buf - c->phys);
 
 	printk(KERN_WARNING
 	       "SDMA malloc: could not translate phys address 0x%lx\n", buf);
 	return 0;
 }
 
+/*!
+ * Returns the size class of an allocation size
+ */
+static inline int sdma_size_class(size_t size)
+{
+	if (size <= (1 << SDMA_MIN_SHIFT))
+		return 0;
+	return fls(size - 1) - SDMA_MIN_SHIFT;
+}
+
+/*!
+ * Takes a block from a size class, carving a new page from the chunks
+ * if the class is empty. Called with sdma_pool_lock held.
+ */
+static void *sdma_class_alloc(int cls)
+{
+	sdma_class_struct *sc = &sdma_classes[cls];
+	sdma_free_block *b;
+	sdma_chunk_struct *c;
+	size_t bsize = 1 << (cls + SDMA_MIN_SHIFT);
+	void *page;
+	int i;
+
+	if (sc->free == NULL) {
+		c = sdma_chunks;
+		if (c == NULL || c->used_pages == SDMA_CHUNK_PAGES)
+			return NULL;
+
+		c->page_class[c->used_pages] = cls;
+		page = c->virt + (c->used_pages << PAGE_SHIFT);
+		c->used_pages++;
+		sc->pages++;
+
+		for (i = PAGE_SIZE - bsize; i >= 0; i -= bsize) {
+			b = page + i;
+			b->next = sc->free;
+			sc->free = b;
+		}
+	}
+
+	b = sc->free;
+	sc->free = b->next;
+	sc->in_use++;
+	sc->allocs++;
+
+	return b;
+}
+
+/*!
+ * Adds a chunk to the pool. It is only called once the newest chunk has
+ * no page left, and chunks are never given back.
+ */
+static int sdma_pool_grow(void)
+{
+	sdma_chunk_struct *c;
+	unsigned long flags;
+	dma_addr_t dma_addr;
+	int full;
+
+	if (sdma_nr_chunks >= sdma_max_chunks)
+		goto limit;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (c == NULL)
+		return -ENOMEM;
+	c->virt = dma_alloc_coherent(NULL, SDMA_CHUNK_SIZE, &dma_addr,
+				     GFP_KERNEL);
+	if (c->virt == NULL) {
+		kfree(c);
+		return -ENOMEM;
+	}
+	c->phys = dma_addr;
+
+	spin_lock_irqsave(&sdma_pool_lock, flags);
+	full = sdma_nr_chunks >= sdma_max_chunks;
+	if (!full) {
+		c->next = sdma_chunks;
+		/* Translations walk the chunks without the lock */
+		smp_wmb();
+		sdma_chunks = c;
+		sdma_nr_chunks++;
+	}
+	spin_unlock_irqrestore(&sdma_pool_lock, flags);
+
+	if (!full)
+		return 0;
+	dma_free_coherent(NULL, SDMA_CHUNK_SIZE, c->virt, dma_addr);
+	kfree(c);
+
+limit:
+	if (printk_ratelimit())
+		printk(KERN_ERR "SDMA malloc: pool limit of %d chunks "
+		       "(%d KiB) reached, boot with sdma_chunks= to raise it\n",
+		       sdma_max_chunks, sdma_max_chunks * SDMA_CHUNK_SIZE / SZ_1K);
+	return -ENOMEM;
+}
+
 /*!
  * Allocates uncacheable buffer
  *
@@ -142,25 +304,33 @@ void *sdma_phys_to_virt(unsigned long buf)
  */
 void *sdma_malloc(size_t size)
 {
+	unsigned long flags;
 	void *buf;
-	dma_addr_t dma_addr;
-	virt_phys_struct *p;
+	int cls;
 
-	if (size > SDMA_POOL_SIZE) {
+	if (size > SDMA_MAX_SIZE) {
 		printk(KERN_WARNING
-		       "size in sdma_malloc is more than %d bytes\n",
-		       SDMA_POOL_SIZE);
+		       "size in sdma_malloc is more than %lu bytes\n",
+		       SDMA_MAX_SIZE);
 		return 0;
 	}
 
-	buf = dma_pool_alloc(pool, GFP_KERNEL, &dma_addr);
-	if (buf == 0)
-		return 0;
+	cls = sdma_size_class(size);
+
+	spin_lock_irqsave(&sdma_pool_lock, flags);
+	buf = sdma_class_alloc(cls);
+	spin_unlock_irqrestore(&sdma_pool_lock, flags);
 
-	p = kzalloc(sizeof(*p), GFP_KERNEL);
-	p->virt = buf;
-	p->phys = dma_addr;
-	list_add_tail(&p->node, &alloc_list);
+	if (buf == NULL && sdma_pool_grow() == 0) {
+		spin_lock_irqsave(&sdma_pool_lock, flags);
+		buf = sdma_class_alloc(cls);
+		spin_unlock_irqrestore(&sdma_pool_lock, flags);
+	}
+
+	if (buf == NULL) {
+		sdma_alloc_failed++;
+		return 0;
+	}
 
 	DPRINTK("allocated vaddr 0x%p\n", buf);
 	return buf;
@@ -173,59 +343,130 @@ void *sdma_malloc(size_t size)
  */
 void sdma_free(void *buf)
 {
-	virt_phys_struct *p;
-
-	list_for_each_entry(p, &alloc_list, node) {
-		if (p->virt == buf) {
-			if (p->in_iram)
-				gen_pool_free(sdma_iram_pool, p->phys, p->size);
-			else
-				dma_pool_free(pool, p->virt, p->phys);
-			list_del(&p->node);
-			kfree(p);
-			return;
-		}
+	sdma_chunk_struct *c;
+	sdma_class_struct *sc;
+	sdma_free_block *b = buf;
+	unsigned long flags;
+
+#ifdef CONFIG_SDMA_IRAM
+	if (iram_has_virt(buf)) {
+		unsigned long phys = iram_virt_to_phys(buf);
+		int g = (phys - iram_paddr) >> IRAM_SDMA_ORDER;
+
+		gen_pool_free(sdma_iram_pool, phys, iram_size[g]);
+		spin_lock_irqsave(&sdma_pool_lock, flags);
+		iram_used -= iram_size[g];
+		iram_size[g] = 0;
+		spin_unlock_irqrestore(&sdma_pool_lock, flags);
+		return;
+	}
+#endif
+
+	c = sdma_chunk_of_virt(buf);
+	if (c == NULL) {
+		printk(KERN_WARNING "SDMA malloc: freeing unknown 0x%p\n", buf);
+		return;
 	}
+
+	spin_lock_irqsave(&sdma_pool_lock, flags);
+	sc = &sdma_classes[c->page_class[(buf - c->virt) >> PAGE_SHIFT]];
+	b->next = sc->free;
+	sc->free = b;
+	sc->in_use--;
+	sc->frees++;
+	spin_unlock_irqrestore(&sdma_pool_lock, flags);
 }
 
 #ifdef CONFIG_SDMA_IRAM
 /*!
- * Allocates uncacheable buffer from IRAM
+ * Allocates uncacheable buffer from IRAM. Channel control blocks and
+ * the buffer descriptors of the IRAM channels come from here; once IRAM
+ * is exhausted they are placed in external memory instead.
  */
 void *sdma_iram_malloc(size_t size)
 {
-	virt_phys_struct *p = kzalloc(sizeof(*p), GFP_KERNEL);
+	unsigned long flags;
 	unsigned long buf;
 
 	buf = gen_pool_alloc(sdma_iram_pool, size);
 	if (!buf) {
-		kfree(p);
-		return NULL;
+		spin_lock_irqsave(&sdma_pool_lock, flags);
+		iram_fallbacks++;
+		spin_unlock_irqrestore(&sdma_pool_lock, flags);
+		return sdma_malloc(size);
 	}
 
-	p->virt = iram_vaddr + (buf - iram_paddr);
-	p->phys = buf;
-	p->size = size;
-	p->in_iram = true;
-	list_add_tail(&p->node, &alloc_list);
-	return p->virt;
+	spin_lock_irqsave(&sdma_pool_lock, flags);
+	iram_size[(buf - iram_paddr) >> IRAM_SDMA_ORDER] = size;
+	iram_used += size;
+	spin_unlock_irqrestore(&sdma_pool_lock, flags);
+
+	return iram_phys_to_virt(buf);
 }
 #endif				/*CONFIG_SDMA_IRAM */
 
+/*!
+ * Prints the pool usage counters, for /proc/sdma/channels
+ *
+ * @param   buf    output buffer
+ * @param   size   size of the output buffer
+ * @return  number of characters written
+ */
+int sdma_malloc_stats(char *buf, int size)
+{
+	sdma_class_struct *sc;
+	unsigned long flags;
+	int i, n;
+
+	spin_lock_irqsave(&sdma_pool_lock, flags);
+
+	n = snprintf(buf, size, "Pool: %d of %d chunks, %lu failed\n",
+		     sdma_nr_chunks, sdma_max_chunks, sdma_alloc_failed);
+	for (i = 0; i < SDMA_NR_CLASSES && n < size; i++) {
+		sc = &sdma_classes[i];
+		if (sc->pages == 0)
+			continue;
+		n += snprintf(buf + n, size - n,
+			      "  %4d bytes: %d in use, %d pages, "
+			      "%lu allocs, %lu frees\n",
+			      1 << (i + SDMA_MIN_SHIFT), sc->in_use, sc->pages,
+			      sc->allocs, sc->frees);
+	}
+#ifdef CONFIG_SDMA_IRAM
+	if (n < size)
+		n += snprintf(buf + n, size - n,
+			      "IRAM: %d of %d bytes, %lu fallbacks\n",
+			      iram_used, IRAM_SDMA_SIZE, iram_fallbacks);
+#endif
+
+	spin_unlock_irqrestore(&sdma_pool_lock, flags);
+
+	return min(n, size);
+}
+
+static int __init sdma_chunks_setup(char *p)
+{
+	int n = simple_strtol(p, NULL, 0);
+
+	if (n > 0)
+		sdma_max_chunks = n;
+	return 0;
+}
+early_param("sdma_chunks", sdma_chunks_setup);
+
 /*!
  * SDMA buffers pool initialization function
  */
 void __init init_sdma_pool(void)
 {
-	pool = dma_pool_create("SDMA", NULL, SDMA_POOL_SIZE, 0, 0);
+	if (sdma_pool_grow() < 0)
+		printk(KERN_ERR "SDMA malloc: no memory for the pool\n");
 
 #ifdef CONFIG_SDMA_IRAM
-	iram_vaddr = iram_alloc(SZ_4K, &iram_paddr);
-	sdma_iram_pool = gen_pool_create(6, -1);
-	gen_pool_add(sdma_iram_pool, iram_paddr, SZ_4K, -1);
+	iram_vaddr = iram_alloc(IRAM_SDMA_SIZE, &iram_paddr);
+	sdma_iram_pool = gen_pool_create(IRAM_SDMA_ORDER, -1);
+	gen_pool_add(sdma_iram_pool, iram_paddr, IRAM_SDMA_SIZE, -1);
 #endif
-
-	INIT_LIST_HEAD(&alloc_list);
 }
 
 MODULE_AUTHOR("Freescale Semiconductor, Inc.");
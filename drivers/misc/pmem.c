@@ -26,10 +26,13 @@
 #include <linux/sched.h>
 #include <linux/io.h>
 #include <linux/uaccess.h>
+#include <linux/moduleparam.h>
+#include <linux/dma-mapping.h>
 #include <asm/cacheflush.h>
 
 #define PMEM_MAX_DEVICES 10
-#define PMEM_MAX_ORDER 128
+#define PMEM_MAX_ORDER BITS_PER_LONG
+#define PMEM_MAX_PAGES ((1UL << 24) - 1)
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
 #define PMEM_DEBUG 1
@@ -49,6 +52,13 @@
  */
 #define PMEM_FLAGS_SUBMAP (0x1 << 3)
 #define PMEM_FLAGS_UNSUBMAP (0x1 << 4)
+/* the physical address of the allocation has been handed out, so it can
+ * never be moved by compaction */
+#define PMEM_FLAGS_PHYS (0x1 << 5)
+
+/* move idle allocations to make room when an allocation fails */
+static int pmem_compact_enable;
+module_param_named(compact, pmem_compact_enable, int, S_IRUGO | S_IWUSR);
 
 
 struct pmem_data {
@@ -75,14 +85,25 @@ struct pmem_data {
 	struct list_head region_list;
 	/* a linked list of data so we can access them for debugging */
 	struct list_head list;
+	/* PMEM_MAP_ATTR_* used for the user mapping */
+	unsigned int map_attr;
 #if PMEM_DEBUG
 	int ref;
 #endif
 };
 
+/*
+ * One entry per PMEM_MIN_ALLOC page, only meaningful at the start of a block.
+ * An allocation is a run of blocks of decreasing order, so that its tail
+ * beyond the requested size goes back to the free lists; the first entry of
+ * an allocation records the number of pages in it.
+ */
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
 	unsigned order:7;		/* size of the region in pmem space */
+	unsigned pages:24;		/* first block: pages in the allocation */
+	int next;			/* free block: free list links */
+	int prev;
 };
 
 struct pmem_region_node {
@@ -117,6 +138,14 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* first free block of each order, or -1 */
+	int free_head[PMEM_MAX_ORDER];
+	/* statistics, protected by bitmap_sem */
+	unsigned long free_blocks[PMEM_MAX_ORDER];
+	unsigned long free_pages;
+	unsigned long alloc_fails;
+	unsigned long compactions;
+	unsigned long compact_moves;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -155,11 +184,9 @@ static int id_count;
 
 #define PMEM_IS_FREE(id, index) (!(pmem[id].bitmap[index].allocated))
 #define PMEM_ORDER(id, index) pmem[id].bitmap[index].order
-#define PMEM_BUDDY_INDEX(id, index) (index ^ (1 << PMEM_ORDER(id, index)))
-#define PMEM_NEXT_INDEX(id, index) (index + (1 << PMEM_ORDER(id, index)))
 #define PMEM_OFFSET(index) (index * PMEM_MIN_ALLOC)
 #define PMEM_START_ADDR(id, index) (PMEM_OFFSET(index) + pmem[id].base)
-#define PMEM_LEN(id, index) ((1 << PMEM_ORDER(id, index)) * PMEM_MIN_ALLOC)
+#define PMEM_LEN(id, index) (pmem[id].bitmap[index].pages * PMEM_MIN_ALLOC)
 #define PMEM_END_ADDR(id, index) (PMEM_START_ADDR(id, index) + \
 	PMEM_LEN(id, index))
 #define PMEM_START_VADDR(id, index) (PMEM_OFFSET(id, index) + pmem[id].vbase)
@@ -233,33 +260,80 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+/* caller should hold the write lock on pmem_sem! */
+static void pmem_free_list_add(int id, int index, int order)
+{
+	int next = pmem[id].free_head[order];
+
+	PMEM_ORDER(id, index) = order;
+	pmem[id].bitmap[index].allocated = 0;
+	pmem[id].bitmap[index].prev = -1;
+	pmem[id].bitmap[index].next = next;
+	if (next >= 0)
+		pmem[id].bitmap[next].prev = index;
+	pmem[id].free_head[order] = index;
+	pmem[id].free_blocks[order]++;
+	pmem[id].free_pages += 1UL << order;
+}
+
+/* caller should hold the write lock on pmem_sem! */
+static void pmem_free_list_del(int id, int index)
+{
+	int order = PMEM_ORDER(id, index);
+	int next = pmem[id].bitmap[index].next;
+	int prev = pmem[id].bitmap[index].prev;
+
+	if (prev >= 0)
+		pmem[id].bitmap[prev].next = next;
+	else
+		pmem[id].free_head[order] = next;
+	if (next >= 0)
+		pmem[id].bitmap[next].prev = prev;
+	pmem[id].free_blocks[order]--;
+	pmem[id].free_pages -= 1UL << order;
+}
+
+static void pmem_free_block(int id, int index, int order)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int buddy;
+
+	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
+	 * if the buddy is also free merge them
+	 * repeat until the buddy is not free or end of the bitmap is reached
+	 */
+	while (order + 1 < PMEM_MAX_ORDER) {
+		buddy = index ^ (1 << order);
+		if (buddy + (1UL << order) > pmem[id].num_entries ||
+		    !PMEM_IS_FREE(id, buddy) || PMEM_ORDER(id, buddy) != order)
+			break;
+		pmem_free_list_del(id, buddy);
+		index = min(buddy, index);
+		order++;
+	}
+	pmem_free_list_add(id, index, order);
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
-	int buddy, curr = index;
+	unsigned long pages;
 	DLOG("index %d\n", index);
 
 	if (pmem[id].no_allocator) {
 		pmem[id].allocated = 0;
 		return 0;
 	}
-	/* clean up the bitmap, merging any buddies */
-	pmem[id].bitmap[curr].allocated = 0;
-	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
-	 * repeat until the buddy is not free or end of the bitmap is reached
-	 */
-	do {
-		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
-			break;
-		}
-	} while (curr < pmem[id].num_entries);
+	/* give back each block of the allocation, merging any buddies */
+	pages = pmem[id].bitmap[index].pages;
+	pmem[id].bitmap[index].pages = 0;
+	while (pages) {
+		int order = PMEM_ORDER(id, index);
+
+		pmem_free_block(id, index, order);
+		index += 1 << order;
+		pages -= 1UL << order;
+	}
 
 	return 0;
 }
@@ -347,6 +421,7 @@ static int pmem_open(struct inode *inode, struct file *file)
 		return -1;
 	}
 	data->flags = 0;
+	data->map_attr = PMEM_MAP_ATTR_DEFAULT;
 	data->index = -1;
 	data->task = NULL;
 	data->vma = NULL;
@@ -379,14 +454,71 @@ static unsigned long pmem_order(unsigned long len)
 	return i;
 }
 
+/*
+ * pmem_find_block - return a free block of at least 'order', or -1
+ *
+ * Normally the first block on the smallest non-empty free list does. With
+ * 'lowest' set, the free lists are searched for the block at the lowest
+ * address instead, which compaction uses to move allocations down.
+ */
+static int pmem_find_block(int id, int order, int lowest)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int best = -1;
+	int curr;
+
+	for (; order < PMEM_MAX_ORDER; order++) {
+		curr = pmem[id].free_head[order];
+		if (curr < 0)
+			continue;
+		if (!lowest)
+			return curr;
+		for (; curr >= 0; curr = pmem[id].bitmap[curr].next)
+			if (best < 0 || curr < best)
+				best = curr;
+	}
+	return best;
+}
+
+/*
+ * pmem_carve - allocate 'pages' pages from the start of the free block at
+ * 'index' and give the rest of the block back
+ *
+ * The block is split in halves until the pages fit exactly: a half that is
+ * needed entirely becomes part of the allocation, a half that is not needed
+ * at all goes back on the free lists.
+ */
+static void pmem_carve(int id, int index, unsigned long pages)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int order = PMEM_ORDER(id, index);
+	int curr = index;
+
+	pmem_free_list_del(id, index);
+	while (pages < (1UL << order)) {
+		order--;
+		if (pages > (1UL << order)) {
+			PMEM_ORDER(id, curr) = order;
+			pmem[id].bitmap[curr].allocated = 1;
+			pages -= 1UL << order;
+			curr += 1 << order;
+		} else {
+			pmem_free_list_add(id, curr + (1 << order), order);
+		}
+	}
+	PMEM_ORDER(id, curr) = order;
+	pmem[id].bitmap[curr].allocated = 1;
+}
+
+static int pmem_compact(int id);
+
 static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
-	int best_fit = -1;
+	unsigned long pages = (len + PMEM_MIN_ALLOC - 1) / PMEM_MIN_ALLOC;
 	unsigned long order = pmem_order(len);
+	int index;
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
@@ -396,54 +528,123 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (!pages || pages > PMEM_MAX_PAGES || order >= PMEM_MAX_ORDER)
 		return -1;
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * if you find a free slot of the correct order use it
-	 * otherwise, use the best fit (smallest with size > order) slot
-	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
-	}
+	index = pmem_find_block(id, order, 0);
+	if (index < 0 && pmem_compact_enable && pmem[id].free_pages >= pages &&
+	    pmem_compact(id))
+		index = pmem_find_block(id, order, 0);
 
-	/* if best_fit < 0, there are no suitable slots,
+	/* if index < 0, there are no suitable slots,
 	 * return an error
 	 */
-	if (best_fit < 0) {
+	if (index < 0) {
+		pmem[id].alloc_fails++;
 		printk("pmem: no space left to allocate!\n");
 		return -1;
 	}
 
-	/* now partition the best fit:
-	 * split the slot into 2 buddies of order - 1
-	 * repeat until the slot is of the correct order
-	 */
-	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
-		int buddy;
-		PMEM_ORDER(id, best_fit) -= 1;
-		buddy = PMEM_BUDDY_INDEX(id, best_fit);
-		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+	pmem_carve(id, index, pages);
+	pmem[id].bitmap[index].pages = pages;
+	return index;
+}
+
+/*
+ * pmem_can_move - may compaction move this allocation?
+ *
+ * Only if nothing but the pmem file itself knows where it lives: it was never
+ * mapped, its physical address was never handed out, no kernel user holds
+ * it and no other file is connected to it.
+ */
+static int pmem_can_move(int id, struct pmem_data *data)
+{
+	/* caller holds data->sem, data_list_sem and the write lock on
+	 * bitmap_sem */
+	struct pmem_data *other;
+
+	if (data->index < 0 || data->flags)
+		return 0;
+#if PMEM_DEBUG
+	if (data->ref)
+		return 0;
+#endif
+	list_for_each_entry(other, &pmem[id].data_list, list)
+		if (other != data && other->index == data->index)
+			return 0;
+	return 1;
+}
+
+static int pmem_move(int id, struct pmem_data *data)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	unsigned long pages = pmem[id].bitmap[data->index].pages;
+	unsigned long len = pages * PMEM_MIN_ALLOC;
+	int index;
+
+	index = pmem_find_block(id, pmem_order(len), 1);
+	if (index < 0 || index > data->index)
+		return 0;
+
+	pmem_carve(id, index, pages);
+	pmem[id].bitmap[index].pages = pages;
+	memcpy((void *)pmem[id].vbase + PMEM_OFFSET(index),
+	       (void *)pmem[id].vbase + PMEM_OFFSET(data->index), len);
+	if (pmem[id].cached) {
+		void *start = (void *)pmem[id].vbase + PMEM_OFFSET(index);
+		dmac_flush_range(start, start + len);
 	}
-	pmem[id].bitmap[best_fit].allocated = 1;
-	return best_fit;
+	pmem_free(id, data->index);
+	data->index = index;
+	return 1;
+}
+
+/*
+ * pmem_compact - move idle allocations to the lowest free blocks, so that
+ * the space they leave can merge into larger free blocks
+ *
+ * The caller holds its own data->sem and the bitmap_sem, so every other lock
+ * is only tried: a busy file is simply left where it is.
+ */
+static int pmem_compact(int id)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_data *data;
+	int moved = 0;
+
+	if (down_trylock(&pmem[id].data_list_sem))
+		return 0;
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		if (!down_write_trylock(&data->sem))
+			continue;
+		if (pmem_can_move(id, data))
+			moved += pmem_move(id, data);
+		up_write(&data->sem);
+	}
+	up(&pmem[id].data_list_sem);
+
+	pmem[id].compactions++;
+	pmem[id].compact_moves += moved;
+	DLOG("compacted, moved %d\n", moved);
+	return moved;
 }
 
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
+	struct pmem_data *data = (struct pmem_data *)file->private_data;
+
+	switch (data->map_attr) {
+	case PMEM_MAP_ATTR_CACHED:
+		return vma_prot;
+#ifdef pgprot_writecombine
+	case PMEM_MAP_ATTR_WRITECOMBINE:
+		return pgprot_writecombine(vma_prot);
+#endif
+	case PMEM_MAP_ATTR_UNCACHED:
+		return pgprot_noncached(vma_prot);
+	}
 
 #ifdef pgprot_writecombine
 	if (pmem[id].cached == 0 || file->f_flags & O_SYNC)
@@ -729,16 +930,15 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 	}
 	id = get_id(file);
 
-	down_read(&data->sem);
+	down_write(&data->sem);
+	data->flags |= PMEM_FLAGS_PHYS;
 	*start = pmem_start_addr(id, data);
 	*len = pmem_len(id, data);
 	*vstart = (unsigned long)pmem_start_vaddr(id, data);
-	up_read(&data->sem);
 #if PMEM_DEBUG
-	down_write(&data->sem);
 	data->ref++;
-	up_write(&data->sem);
 #endif
+	up_write(&data->sem);
 	return 0;
 }
 
@@ -827,6 +1027,75 @@ end:
 	up_read(&data->sem);
 }
 
+static int pmem_set_map_attr(struct file *file, unsigned long attr)
+{
+	struct pmem_data *data = (struct pmem_data *)file->private_data;
+	int id = get_id(file);
+	int ret = 0;
+
+	if (attr > PMEM_MAP_ATTR_UNCACHED)
+		return -EINVAL;
+	/* the cache can only be maintained through a cached kernel alias */
+	if (attr == PMEM_MAP_ATTR_CACHED && !pmem[id].cached)
+		return -EINVAL;
+
+	down_write(&data->sem);
+	if (data->flags & (PMEM_FLAGS_MASTERMAP | PMEM_FLAGS_SUBMAP))
+		ret = -EBUSY;
+	else
+		data->map_attr = attr;
+	up_write(&data->sem);
+	return ret;
+}
+
+/*
+ * pmem_cache_maint - clean and/or invalidate part of an allocation
+ *
+ * Works on the kernel's cached alias of the region, which covers the same
+ * physical lines as a cached user mapping.
+ */
+static int pmem_cache_maint(struct file *file, struct pmem_region *region,
+			    unsigned int cmd)
+{
+	struct pmem_data *data = (struct pmem_data *)file->private_data;
+	int id = get_id(file);
+	unsigned long paddr;
+	void *vaddr;
+	int ret = 0;
+
+	if (!has_allocation(file))
+		return -EINVAL;
+	if (!pmem[id].cached)
+		return 0;
+
+	down_read(&data->sem);
+	if (region->offset > pmem_len(id, data) ||
+	    region->len > pmem_len(id, data) - region->offset) {
+		ret = -EINVAL;
+		goto out;
+	}
+	vaddr = pmem_start_vaddr(id, data) + region->offset;
+	paddr = pmem_start_addr(id, data) + region->offset;
+
+	switch (cmd) {
+	case PMEM_CACHE_CLEAN:
+		dmac_map_area(vaddr, region->len, DMA_TO_DEVICE);
+		outer_clean_range(paddr, paddr + region->len);
+		break;
+	case PMEM_CACHE_INV:
+		outer_inv_range(paddr, paddr + region->len);
+		dmac_unmap_area(vaddr, region->len, DMA_FROM_DEVICE);
+		break;
+	case PMEM_CACHE_CLEAN_INV:
+		dmac_flush_range(vaddr, vaddr + region->len);
+		outer_flush_range(paddr, paddr + region->len);
+		break;
+	}
+out:
+	up_read(&data->sem);
+	return ret;
+}
+
 static int pmem_connect(unsigned long connect, struct file *file)
 {
 	struct pmem_data *data = (struct pmem_data *)file->private_data;
@@ -851,13 +1120,17 @@ static int pmem_connect(unsigned long connect, struct file *file)
 	}
 	src_data = (struct pmem_data *)src_file->private_data;
 
+	/* compaction moves allocations with the bitmap_sem held */
+	down_read(&pmem[get_id(file)].bitmap_sem);
 	if (has_allocation(file) && (data->index != src_data->index)) {
+		up_read(&pmem[get_id(file)].bitmap_sem);
 		printk("pmem: file is already mapped but doesn't match this"
 		       " src_file!\n");
 		ret = -EINVAL;
 		goto err_bad_file;
 	}
 	data->index = src_data->index;
+	up_read(&pmem[get_id(file)].bitmap_sem);
 	data->flags |= PMEM_FLAGS_CONNECTED;
 	data->master_fd = connect;
 	data->master_file = src_file;
@@ -1067,8 +1340,11 @@ static void pmem_get_size(struct pmem_region *region, struct file *file)
 		region->len = 0;
 		return;
 	} else {
+		down_write(&data->sem);
+		data->flags |= PMEM_FLAGS_PHYS;
 		region->offset = pmem_start_addr(id, data);
 		region->len = pmem_len(id, data);
+		up_write(&data->sem);
 	}
 	DLOG("offset %lx len %lx\n", region->offset, region->len);
 }
@@ -1089,8 +1365,11 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				region.len = 0;
 			} else {
 				data = (struct pmem_data *)file->private_data;
+				down_write(&data->sem);
+				data->flags |= PMEM_FLAGS_PHYS;
 				region.offset = pmem_start_addr(id, data);
 				region.len = pmem_len(id, data);
+				up_write(&data->sem);
 			}
 			printk(KERN_INFO
 				"pmem: request for physical address of pmem region "
@@ -1147,7 +1426,12 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			if (has_allocation(file))
 				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
-			data->index = pmem_allocate(id, arg);
+			down_write(&data->sem);
+			down_write(&pmem[id].bitmap_sem);
+			if (data->index == -1)
+				data->index = pmem_allocate(id, arg);
+			up_write(&pmem[id].bitmap_sem);
+			up_write(&data->sem);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1164,6 +1448,18 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			flush_pmem_file(file, region.offset, region.len);
 			break;
 		}
+	case PMEM_SET_MAP_ATTR:
+		return pmem_set_map_attr(file, arg);
+	case PMEM_CACHE_CLEAN:
+	case PMEM_CACHE_INV:
+	case PMEM_CACHE_CLEAN_INV:
+		{
+			struct pmem_region region;
+			if (copy_from_user(&region, (void __user *)arg,
+					   sizeof(struct pmem_region)))
+				return -EFAULT;
+			return pmem_cache_maint(file, &region, cmd);
+		}
 	default:
 		if (pmem[id].ioctl)
 			return pmem[id].ioctl(file, cmd, arg);
@@ -1213,6 +1509,33 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 	}
 	up(&pmem[id].data_list_sem);
 
+	if (!pmem[id].no_allocator) {
+		unsigned long largest = 0;
+		int order;
+
+		down_read(&pmem[id].bitmap_sem);
+		n += scnprintf(buffer + n, debug_bufmax - n,
+			       "free blocks (order:count):");
+		for (order = 0; order < PMEM_MAX_ORDER; order++) {
+			if (!pmem[id].free_blocks[order])
+				continue;
+			largest = 1UL << order;
+			n += scnprintf(buffer + n, debug_bufmax - n, " %d:%lu",
+				       order, pmem[id].free_blocks[order]);
+		}
+		n += scnprintf(buffer + n, debug_bufmax - n,
+			       "\nfree pages %lu of %lu, largest free block %lu"
+			       " pages, fragmentation %lu%%\n"
+			       "allocation failures %lu, compactions %lu, "
+			       "moved %lu\n",
+			       pmem[id].free_pages, pmem[id].num_entries,
+			       largest, pmem[id].free_pages ?
+			       100 - largest * 100 / pmem[id].free_pages : 0,
+			       pmem[id].alloc_fails, pmem[id].compactions,
+			       pmem[id].compact_moves);
+		up_read(&pmem[id].bitmap_sem);
+	}
+
 	n++;
 	buffer[n] = 0;
 	return simple_read_from_buffer(buf, count, ppos, buffer, n);
@@ -1263,10 +1586,12 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
 
+	for (i = 0; i < PMEM_MAX_ORDER; i++)
+		pmem[id].free_head[i] = -1;
 	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
-		if ((pmem[id].num_entries) &  1<<i) {
-			PMEM_ORDER(id, index) = i;
-			index = PMEM_NEXT_INDEX(id, index);
+		if ((pmem[id].num_entries) & (1UL << i)) {
+			pmem_free_list_add(id, index, i);
+			index += 1 << i;
 		}
 	}
 
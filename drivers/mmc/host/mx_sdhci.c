@@ -105,7 +105,6 @@ static unsigned int debug_quirks = SDHCI_QUIRK_ONLY_PIO;
 static unsigned int debug_quirks;
 #endif
 static unsigned int mxc_wml_value = 512;
-static unsigned int *adma_des_table;
 
 #ifndef MXC_SDHCI_NUM
 #define MXC_SDHCI_NUM	4
@@ -481,6 +480,131 @@ static void sdhci_transfer_pio(struct sdhci_host *host)
 	DBG("PIO transfer complete.\n");
 }
 
+/*****************************************************************************\
+ *                                                                           *
+ * ADMA2 functions                                                           *
+ *                                                                           *
+\*****************************************************************************/
+
+static char *sdhci_kmap_atomic(struct scatterlist *sg, unsigned long *flags)
+{
+	local_irq_save(*flags);
+	return kmap_atomic(sg_page(sg), KM_BIO_SRC_IRQ) + sg->offset;
+}
+
+static void sdhci_kunmap_atomic(void *buffer, unsigned long *flags)
+{
+	kunmap_atomic(buffer, KM_BIO_SRC_IRQ);
+	local_irq_restore(*flags);
+}
+
+static u32 *sdhci_set_adma_desc(u32 *desc, dma_addr_t addr, int len)
+{
+	/* A length of 0 means 64KiB */
+	desc[0] = ((u32)(len & 0xFFFF) << 16) | FSL_ADMA_DES_ATTR_TRAN |
+	    FSL_ADMA_DES_ATTR_VALID;
+	desc[1] = addr;
+
+	return desc + 2;
+}
+
+/*
+ * Split a scatterlist entry into the part the engine can move in place
+ * and the unaligned bytes around it.  The eSDHC DMA works on 32-bit
+ * words, so the head up to the first word boundary and the tail after
+ * the last full word go through the bounce slots.
+ */
+static void sdhci_adma_split(struct scatterlist *sg, int *head, int *len,
+			     int *tail)
+{
+	dma_addr_t addr = sg_dma_address(sg);
+	int size = sg_dma_len(sg);
+
+	*head = min_t(int, (4 - (addr & 0x3)) & 0x3, size);
+	size -= *head;
+	*tail = size & 0x3;
+	*len = size - *tail;
+}
+
+static void sdhci_adma_table_pre(struct sdhci_host *host,
+				 struct mmc_data *data)
+{
+	int dir = (data->flags & MMC_DATA_READ) ? DMA_FROM_DEVICE :
+	    DMA_TO_DEVICE;
+	struct scatterlist *sg;
+	u32 *desc = host->adma_desc;
+	u8 *align = host->align_buffer;
+	dma_addr_t align_addr = host->align_addr;
+	unsigned long flags;
+	char *buffer;
+	int i, head, len, tail;
+
+	host->sg_count = dma_map_sg(mmc_dev(host->mmc), data->sg,
+				    data->sg_len, dir);
+	BUG_ON(host->sg_count != data->sg_len);
+
+	for_each_sg(data->sg, sg, host->sg_count, i) {
+		sdhci_adma_split(sg, &head, &len, &tail);
+
+		if ((head || tail) && dir == DMA_TO_DEVICE) {
+			buffer = sdhci_kmap_atomic(sg, &flags);
+			memcpy(align, buffer, head);
+			memcpy(align + 4, buffer + head + len, tail);
+			sdhci_kunmap_atomic(buffer, &flags);
+		}
+
+		if (head)
+			desc = sdhci_set_adma_desc(desc, align_addr, head);
+		if (len)
+			desc = sdhci_set_adma_desc(desc,
+					sg_dma_address(sg) + head, len);
+		if (tail)
+			desc = sdhci_set_adma_desc(desc, align_addr + 4, tail);
+
+		align += 8;
+		align_addr += 8;
+	}
+
+	/* Mark the last descriptor as the end of the chain */
+	desc[-2] |= FSL_ADMA_DES_ATTR_END;
+
+	/* The table is coherent, make sure it is out before the engine
+	 * is started.
+	 */
+	wmb();
+}
+
+static void sdhci_adma_table_post(struct sdhci_host *host,
+				  struct mmc_data *data)
+{
+	int dir = (data->flags & MMC_DATA_READ) ? DMA_FROM_DEVICE :
+	    DMA_TO_DEVICE;
+	struct scatterlist *sg;
+	u8 *align = host->align_buffer;
+	unsigned long flags;
+	char *buffer;
+	int i, head, len, tail;
+
+	dma_unmap_sg(mmc_dev(host->mmc), data->sg, data->sg_len, dir);
+
+	if (dir != DMA_FROM_DEVICE)
+		return;
+
+	/* Hand the bounced bytes of a read back to their buffers */
+	for_each_sg(data->sg, sg, host->sg_count, i) {
+		sdhci_adma_split(sg, &head, &len, &tail);
+
+		if (head || tail) {
+			buffer = sdhci_kmap_atomic(sg, &flags);
+			memcpy(buffer, align, head);
+			memcpy(buffer + head + len, align + 4, tail);
+			sdhci_kunmap_atomic(buffer, &flags);
+		}
+
+		align += 8;
+	}
+}
+
 static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 {
 	u32 count;
@@ -546,7 +670,12 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 	if (host->flags & SDHCI_USE_DMA)
 		host->flags |= SDHCI_REQ_USE_DMA;
 
+	/*
+	 * ADMA bounces the unaligned bytes itself, only the simple DMA
+	 * needs the PIO fallbacks below.
+	 */
 	if (unlikely((host->flags & SDHCI_REQ_USE_DMA) &&
+		     !(host->flags & SDHCI_USE_ADMA) &&
 		     (host->chip->quirks & SDHCI_QUIRK_32BIT_DMA_SIZE) &&
 		     ((data->blksz * data->blocks) & 0x3))) {
 		DBG("Reverting to PIO because of transfer size (%d)\n",
@@ -559,6 +688,7 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 	 * translation to device address space.
 	 */
 	if (unlikely((host->flags & SDHCI_REQ_USE_DMA) &&
+		     !(host->flags & SDHCI_USE_ADMA) &&
 		     (host->chip->quirks & SDHCI_QUIRK_32BIT_DMA_ADDR) &&
 		     (data->sg->offset & 0x3))) {
 		DBG("Reverting to PIO because of bad alignment\n");
@@ -590,58 +720,34 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 	}
 
 	if (host->flags & SDHCI_REQ_USE_DMA) {
-		int i;
-		struct scatterlist *tsg;
+		u32 ctrl;
 
 		host->dma_size = data->blocks * data->blksz;
-		count =
-		    dma_map_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
-			       (data->
-				flags & MMC_DATA_READ) ? DMA_FROM_DEVICE :
-			       DMA_TO_DEVICE);
-		BUG_ON(count != data->sg_len);
 		DBG("Configure the sg DMA, %s, len is 0x%x, count is %d\n",
 		    (data->flags & MMC_DATA_READ)
 		    ? "DMA_FROM_DEIVCE" : "DMA_TO_DEVICE", host->dma_size,
-		    count);
-
-		/* Make sure the ADMA mode is selected. */
-		i = readl(host->ioaddr + SDHCI_HOST_CONTROL);
-		i |= SDHCI_CTRL_ADMA;
-		writel(i, host->ioaddr + SDHCI_HOST_CONTROL);
-
-		tsg = data->sg;
-		/* ADMA mode is used, create the descriptor table */
-		for (i = 0; i < count; i++) {
-			if (tsg->dma_address & 0xFFF) {
-				DBG(KERN_ERR "ADMA addr isn't 4K aligned.\n");
-				DBG(KERN_ERR "0x%x\n", tsg->dma_address);
-				DBG(KERN_ERR "Changed to Single DMA mode.\n");
-				goto Single_DMA;
-			}
-			adma_des_table[2 * i] = tsg->length << 12;
-			adma_des_table[2 * i] |= FSL_ADMA_DES_ATTR_SET;
-			adma_des_table[2 * i] |= FSL_ADMA_DES_ATTR_VALID;
-			adma_des_table[2 * i + 1] = tsg->dma_address;
-			adma_des_table[2 * i + 1] |= FSL_ADMA_DES_ATTR_TRAN;
-			adma_des_table[2 * i + 1] |= FSL_ADMA_DES_ATTR_VALID;
-			if (count == (i + 1))
-				adma_des_table[2 * i + 1] |=
-				    FSL_ADMA_DES_ATTR_END;
-			tsg++;
+		    data->sg_len);
+
+		ctrl = readl(host->ioaddr + SDHCI_HOST_CONTROL);
+		ctrl &= ~SDHCI_CTRL_DMAS_MASK;
+		if (host->flags & SDHCI_USE_ADMA) {
+			/* ADMA2, any scatterlist the block layer hands us */
+			sdhci_adma_table_pre(host, data);
+			ctrl |= SDHCI_CTRL_ADMA2;
+			writel(ctrl, host->ioaddr + SDHCI_HOST_CONTROL);
+			writel(host->adma_addr,
+			       host->ioaddr + SDHCI_ADMA_ADDRESS);
+		} else {
+			/* Single DMA mode, max_hw_segs is 1 */
+			count = dma_map_sg(mmc_dev(host->mmc), data->sg,
+					   data->sg_len,
+					   (data->flags & MMC_DATA_READ) ?
+					   DMA_FROM_DEVICE : DMA_TO_DEVICE);
+			BUG_ON(count != data->sg_len);
+			writel(ctrl, host->ioaddr + SDHCI_HOST_CONTROL);
+			writel(sg_dma_address(data->sg),
+			       host->ioaddr + SDHCI_DMA_ADDRESS);
 		}
-
-		/* Write the physical address to ADMA address reg */
-		writel(virt_to_phys(adma_des_table),
-		       host->ioaddr + SDHCI_ADMA_ADDRESS);
-	      Single_DMA:
-		/* Rollback to the Single DMA mode */
-		i = readl(host->ioaddr + SDHCI_HOST_CONTROL);
-		i &= ~SDHCI_CTRL_ADMA;
-		writel(i, host->ioaddr + SDHCI_HOST_CONTROL);
-		/* Single DMA mode is used */
-		writel(sg_dma_address(data->sg),
-		       host->ioaddr + SDHCI_DMA_ADDRESS);
 	} else if ((host->flags & SDHCI_USE_EXTERNAL_DMA) &&
 		   (data->blocks * data->blksz >= mxc_wml_value)) {
 		host->dma_size = data->blocks * data->blksz;
@@ -693,9 +799,13 @@ static void sdhci_finish_data(struct sdhci_host *host)
 	host->data = NULL;
 
 	if (host->flags & SDHCI_REQ_USE_DMA) {
-		dma_unmap_sg(&(host->chip->pdev)->dev, data->sg, data->sg_len,
-			     (data->flags & MMC_DATA_READ) ? DMA_FROM_DEVICE :
-			     DMA_TO_DEVICE);
+		if (host->flags & SDHCI_USE_ADMA)
+			sdhci_adma_table_post(host, data);
+		else
+			dma_unmap_sg(mmc_dev(host->mmc), data->sg,
+				     data->sg_len,
+				     (data->flags & MMC_DATA_READ) ?
+				     DMA_FROM_DEVICE : DMA_TO_DEVICE);
 	}
 	if ((host->flags & SDHCI_USE_EXTERNAL_DMA) &&
 	    (host->dma_size >= mxc_wml_value) && (data != NULL)) {
@@ -1202,7 +1312,10 @@ static void sdhci_set_ios(struct mmc_host *mmc, struct mmc_ios *ios)
 		tmp &= ~SDHCI_CTRL_8BITBUS;
 	}
 
-	if (host->flags & SDHCI_USE_DMA)
+	if (host->flags & SDHCI_USE_ADMA) {
+		tmp &= ~SDHCI_CTRL_DMAS_MASK;
+		tmp |= SDHCI_CTRL_ADMA2;
+	} else if (host->flags & SDHCI_USE_DMA)
 		tmp |= SDHCI_CTRL_ADMA;
 
 	writel(tmp, host->ioaddr + SDHCI_HOST_CONTROL);
@@ -1555,6 +1668,13 @@ static void sdhci_data_irq(struct sdhci_host *host, u32 intmask)
 		host->data->error = -ETIMEDOUT;
 	else if (intmask & (SDHCI_INT_DATA_CRC | SDHCI_INT_DATA_END_BIT))
 		host->data->error = -EILSEQ;
+	else if (intmask & SDHCI_INT_ADMA_ERROR) {
+		printk(KERN_ERR "%s: ADMA error 0x%08x at 0x%08x\n",
+		       mmc_hostname(host->mmc),
+		       readl(host->ioaddr + SDHCI_ADMA_ERROR),
+		       readl(host->ioaddr + SDHCI_ADMA_ADDRESS));
+		host->data->error = -EIO;
+	}
 
 	if (host->data->error)
 		sdhci_finish_data(host);
@@ -1935,6 +2055,18 @@ static int sdhci_resume(struct platform_device *pdev)
  *                                                                           *
 \*****************************************************************************/
 
+static void sdhci_free_adma(struct sdhci_host *host)
+{
+	if (host->adma_desc)
+		dma_free_coherent(mmc_dev(host->mmc), SDHCI_ADMA_DESC_SZ,
+				  host->adma_desc, host->adma_addr);
+	if (host->align_buffer)
+		dma_free_coherent(mmc_dev(host->mmc), SDHCI_ADMA_ALIGN_SZ,
+				  host->align_buffer, host->align_addr);
+	host->adma_desc = NULL;
+	host->align_buffer = NULL;
+}
+
 static int __devinit sdhci_probe_slot(struct platform_device
 				      *pdev, int slot)
 {
@@ -2065,6 +2197,16 @@ static int __devinit sdhci_probe_slot(struct platform_device
 
 	caps = readl(host->ioaddr + SDHCI_CAPABILITIES);
 
+	/*
+	 * The eSDHC has no ADMA1 engine and reports its ADMA2 engine in
+	 * bit 20, where the SD Host Controller Spec puts ADMA1.  Move it
+	 * to the ADMA2 bit, as upstream sdhci-esdhc-imx does.
+	 */
+	if (caps & SDHCI_CAN_DO_ADMA1) {
+		caps &= ~SDHCI_CAN_DO_ADMA1;
+		caps |= SDHCI_CAN_DO_ADMA2;
+	}
+
 	if (chip->quirks & SDHCI_QUIRK_FORCE_DMA)
 		host->flags |= SDHCI_USE_DMA;
 	else if (!(caps & SDHCI_CAN_DO_DMA))
@@ -2116,13 +2258,24 @@ static int __devinit sdhci_probe_slot(struct platform_device
 	spin_lock_init(&host->lock);
 
 	/*
-	 * Maximum number of segments. Hardware cannot do scatter lists.
+	 * The ADMA2 engine takes any scatterlist, the simple DMA can only
+	 * do a single segment.
 	 */
-	if (host->flags & SDHCI_USE_DMA)
+	if ((host->flags & SDHCI_USE_DMA) &&
+	    (chip->quirks & SDHCI_QUIRK_INTERNAL_ADVANCED_DMA) &&
+	    (caps & SDHCI_CAN_DO_ADMA2))
+		host->flags |= SDHCI_USE_ADMA;
+
+	if (host->flags & SDHCI_USE_ADMA) {
+		mmc->max_hw_segs = SDHCI_ADMA_MAX_SEGS;
+		mmc->max_phys_segs = SDHCI_ADMA_MAX_SEGS;
+	} else if (host->flags & SDHCI_USE_DMA) {
 		mmc->max_hw_segs = 1;
-	else
+		mmc->max_phys_segs = 16;
+	} else {
 		mmc->max_hw_segs = 16;
-	mmc->max_phys_segs = 16;
+		mmc->max_phys_segs = 16;
+	}
 
 	/*
 	 * Maximum number of sectors in one transfer. Limited by DMA boundary
@@ -2138,6 +2291,8 @@ static int __devinit sdhci_probe_slot(struct platform_device
 	 * of bytes.
 	 */
 	mmc->max_seg_size = mmc->max_req_size;
+	if (host->flags & SDHCI_USE_ADMA)
+		mmc->max_seg_size = SDHCI_ADMA_MAX_LEN;
 
 	/*
 	 * Maximum block size. This varies from controller to controller and
@@ -2159,12 +2314,19 @@ static int __devinit sdhci_probe_slot(struct platform_device
 
 	/*
 	 * Apply a continous physical memory used for storing the ADMA
-	 * descriptor table.
+	 * descriptor table and the bounce slots, per host so that the
+	 * slots can run at the same time.
 	 */
-	if (host->flags & SDHCI_USE_DMA) {
-		adma_des_table = kcalloc((2 * (mmc->max_phys_segs) + 1),
-					 sizeof(unsigned int), GFP_DMA);
-		if (adma_des_table == NULL) {
+	if (host->flags & SDHCI_USE_ADMA) {
+		host->adma_desc = dma_alloc_coherent(mmc_dev(mmc),
+						     SDHCI_ADMA_DESC_SZ,
+						     &host->adma_addr,
+						     GFP_KERNEL);
+		host->align_buffer = dma_alloc_coherent(mmc_dev(mmc),
+							SDHCI_ADMA_ALIGN_SZ,
+							&host->align_addr,
+							GFP_KERNEL);
+		if (!host->adma_desc || !host->align_buffer) {
 			printk(KERN_ERR "Cannot allocate ADMA memory\n");
 			ret = -ENOMEM;
 			goto out3;
@@ -2242,8 +2404,7 @@ static int __devinit sdhci_probe_slot(struct platform_device
 	tasklet_kill(&host->card_tasklet);
 	destroy_workqueue(host->workqueue);
       out3:
-	if (host->flags & SDHCI_USE_DMA)
-		kfree(adma_des_table);
+	sdhci_free_adma(host);
 	release_mem_region(host->res->start,
 			   host->res->end - host->res->start + 1);
       out2:
@@ -2291,8 +2452,7 @@ static void sdhci_remove_slot(struct platform_device *pdev, int slot)
 	flush_workqueue(host->workqueue);
 	destroy_workqueue(host->workqueue);
 
-	if (host->flags & SDHCI_USE_DMA)
-		kfree(adma_des_table);
+	sdhci_free_adma(host);
 	release_mem_region(host->res->start,
 			   host->res->end - host->res->start + 1);
 	clk_disable(host->clk);
@@ -78,6 +78,8 @@
 #define   SDHCI_CTRL_ADMA64	0x18
 #define  SDHCI_CTRL_D3CD 	0x00000008
 #define  SDHCI_CTRL_ADMA 	0x00000100
+#define  SDHCI_CTRL_ADMA2 	0x00000200
+#define  SDHCI_CTRL_DMAS_MASK 	0x00000300
 /* wake up control */
 #define  SDHCI_CTRL_WECINS 	0x04000000
 
@@ -214,6 +216,16 @@ enum {
 	FSL_ADMA_DES_ATTR_LINK = 0x30,
 };
 
+/*
+ * ADMA2 table sizing.  Each scatterlist entry needs at most three
+ * descriptors (bounced head, aligned middle, bounced tail) and two
+ * 4-byte bounce slots.  A descriptor moves at most 64KiB.
+ */
+#define SDHCI_ADMA_MAX_SEGS	128
+#define SDHCI_ADMA_MAX_LEN	65536
+#define SDHCI_ADMA_DESC_SZ	(SDHCI_ADMA_MAX_SEGS * 3 * 8)
+#define SDHCI_ADMA_ALIGN_SZ	(SDHCI_ADMA_MAX_SEGS * 8)
+
 #define SDHCI_VENDOR_SPEC	0xC0
 
 #define SDHCI_HOST_VERSION	0xFC
@@ -252,6 +264,7 @@ struct sdhci_host {
 #define SDHCI_USE_DMA		(1<<0)	/* Host is DMA capable */
 #define SDHCI_REQ_USE_DMA	(1<<1)	/* Use DMA for this req. */
 #define SDHCI_USE_EXTERNAL_DMA	(1<<2)	/* Use the External DMA */
+#define SDHCI_USE_ADMA		(1<<3)	/* Use the ADMA2 engine */
 #define SDHCI_CD_PRESENT 	(1<<8)	/* CD present */
 #define SDHCI_WP_ENABLED	(1<<9)	/* Write protect */
 #define SDHCI_CD_TIMEOUT 	(1<<10)	/* cd timer is expired */
@@ -276,6 +289,12 @@ struct sdhci_host {
 	unsigned int dma_len;	/* Length of the s-g list */
 	unsigned int dma_dir;	/* DMA transfer direction */
 
+	u32 *adma_desc;		/* ADMA2 descriptor table */
+	dma_addr_t adma_addr;	/* Bus address of the table */
+	u8 *align_buffer;	/* Bounce slots for unaligned head/tail */
+	dma_addr_t align_addr;	/* Bus address of the bounce slots */
+	int sg_count;		/* Mapped entries of the ADMA request */
+
 	struct scatterlist *cur_sg;	/* We're working on this */
 	int num_sg;		/* Entries left */
 	int offset;		/* Offset into current sg */
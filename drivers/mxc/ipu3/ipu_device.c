@@ -81,8 +81,10 @@ static irqreturn_t mxc_ipu_generic_handler(int irq, void *dev_id)
 
 static int mxc_ipu_open(struct inode *inode, struct file *file)
 {
-	int ret = 0;
-	return ret;
+	file->private_data = ipu_task_ctx_alloc();
+	if (!file->private_data)
+		return -ENOMEM;
+	return 0;
 }
 static int mxc_ipu_ioctl(struct inode *inode, struct file *file,
 		unsigned int cmd, unsigned long arg)
@@ -441,6 +443,26 @@ static int mxc_ipu_ioctl(struct inode *inode, struct file *file,
 			ipu_set_csc_coefficients(csc.channel, param);
 		}
 		break;
+	case IPU_QUEUE_TASK:
+		{
+			ipu_task task;
+			if (copy_from_user(&task, (ipu_task *) arg,
+					   sizeof(ipu_task)))
+				return -EFAULT;
+			ret = ipu_task_queue(file->private_data, &task);
+		}
+		break;
+	case IPU_DEQUEUE_TASK:
+		{
+			ipu_task_result res;
+			ret = ipu_task_dequeue(file->private_data, &res,
+					       file->f_flags & O_NONBLOCK);
+			if (ret == 0 &&
+			    copy_to_user((ipu_task_result *) arg, &res,
+					 sizeof(ipu_task_result)))
+				return -EFAULT;
+		}
+		break;
 	default:
 		break;
 	}
@@ -461,8 +483,14 @@ static int mxc_ipu_mmap(struct file *file, struct vm_area_struct *vma)
 	return 0;
 }
 
+static unsigned int mxc_ipu_poll(struct file *file, poll_table *wait)
+{
+	return ipu_task_poll(file->private_data, file, wait);
+}
+
 static int mxc_ipu_release(struct inode *inode, struct file *file)
 {
+	ipu_task_ctx_free(file->private_data);
 	return 0;
 }
 
@@ -470,6 +498,7 @@ static struct file_operations mxc_ipu_fops = {
 	.owner = THIS_MODULE,
 	.open = mxc_ipu_open,
 	.mmap = mxc_ipu_mmap,
+	.poll = mxc_ipu_poll,
 	.release = mxc_ipu_release,
 	.ioctl = mxc_ipu_ioctl,
 };
@@ -502,8 +531,16 @@ int register_ipu_device()
 	}
 	spin_lock_init(&event_lock);
 
+	ret = ipu_task_init();
+	if (ret) {
+		printk(KERN_ERR "Unable to create the Mxc Ipu task queue\n");
+		goto err3;
+	}
+
 	return ret;
 
+err3:
+	device_destroy(mxc_ipu_class, MKDEV(mxc_ipu_major, 0));
 err2:
 	class_destroy(mxc_ipu_class);
 err1:
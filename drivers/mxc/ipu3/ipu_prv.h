@@ -50,6 +50,18 @@ enum ipu_dmfc_type {
 };
 
 int register_ipu_device(void);
+
+/* Asynchronous conversion task queue, ipu_task.c */
+struct ipu_task_ctx;
+struct poll_table_struct;
+int ipu_task_init(void);
+struct ipu_task_ctx *ipu_task_ctx_alloc(void);
+void ipu_task_ctx_free(struct ipu_task_ctx *ctx);
+int ipu_task_queue(struct ipu_task_ctx *ctx, ipu_task *task);
+int ipu_task_dequeue(struct ipu_task_ctx *ctx, ipu_task_result *res,
+		     bool nonblock);
+unsigned int ipu_task_poll(struct ipu_task_ctx *ctx, struct file *file,
+			   struct poll_table_struct *wait);
 ipu_color_space_t format_to_colorspace(uint32_t fmt);
 bool ipu_pixel_format_has_alpha(uint32_t fmt);
 void ipu_get_clk(bool stop_dvfs);
@@ -0,0 +1,550 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+/*
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/*!
+ * @file ipu_task.c
+ *
+ * @brief Asynchronous queue of memory to memory conversion tasks (resize,
+ * color space conversion, crop and rotation) for the IPU device.
+ *
+ * Tasks queued by all users of /dev/mxc_ipu are run back to back by one
+ * worker on the IC post-processor, followed by the PP rotator for 90
+ * degree rotations.  Outputs too large for a single IC pass are split in
+ * stripes with ipu_calc_stripes_sizes().  Finished tasks are returned
+ * per open file, which becomes readable for poll().
+ *
+ * @ingroup IPU
+ */
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/dma-mapping.h>
+#include <linux/ipu.h>
+
+#include "ipu_prv.h"
+
+/* IC limits for one pass, see _calc_resize_coeffs() */
+#define IPU_TASK_MAX_IN		4096
+#define IPU_TASK_MAX_OUT	1024
+
+/* Tasks an open file may have queued or not yet dequeued */
+#define IPU_TASK_MAX_PENDING	16
+
+#define IPU_TASK_TIMEOUT	(HZ / 2)
+
+struct ipu_task_ctx {
+	struct list_head done;
+	wait_queue_head_t waitq;
+	int pending;		/* queued or running */
+	int outstanding;	/* queued and not dequeued yet */
+};
+
+struct ipu_task_entry {
+	struct list_head list;
+	struct ipu_task_ctx *ctx;
+	ipu_task task;
+	int status;
+};
+
+static LIST_HEAD(ipu_task_list);
+static DEFINE_SPINLOCK(ipu_task_lock);
+static struct workqueue_struct *ipu_task_wq;
+static struct work_struct ipu_task_work;
+static DECLARE_COMPLETION(ipu_task_eof);
+
+/* IC output of a task going through the rotator, worker use only */
+static void *ipu_task_tmp_vaddr;
+static dma_addr_t ipu_task_tmp_paddr;
+static size_t ipu_task_tmp_size;
+
+static bool ipu_task_fmt_is_planar(uint32_t fmt)
+{
+	switch (fmt) {
+	case IPU_PIX_FMT_YUV420P2:
+	case IPU_PIX_FMT_YUV420P:
+	case IPU_PIX_FMT_YVU420P:
+	case IPU_PIX_FMT_YUV422P:
+	case IPU_PIX_FMT_YVU422P:
+	case IPU_PIX_FMT_NV12:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static size_t ipu_task_frame_size(uint32_t fmt, uint32_t stride,
+				  uint32_t height)
+{
+	switch (fmt) {
+	case IPU_PIX_FMT_YUV420P2:
+	case IPU_PIX_FMT_YUV420P:
+	case IPU_PIX_FMT_YVU420P:
+	case IPU_PIX_FMT_NV12:
+		return stride * height * 3 / 2;
+	case IPU_PIX_FMT_YUV422P:
+	case IPU_PIX_FMT_YVU422P:
+		return stride * height * 2;
+	default:
+		return stride * height;
+	}
+}
+
+static int ipu_task_check_frame(ipu_task_frame *f)
+{
+	uint32_t line = f->width * bytes_per_pixel(f->pixel_fmt);
+
+	if (!f->paddr || !f->width || !f->height)
+		return -EINVAL;
+
+	if (!f->stride)
+		f->stride = line;
+	if (f->stride < line)
+		return -EINVAL;
+
+	if (!f->crop_w || !f->crop_h) {
+		f->crop_x = f->crop_y = 0;
+		f->crop_w = f->width;
+		f->crop_h = f->height;
+	}
+	if (f->crop_x >= f->width || f->crop_w > f->width - f->crop_x ||
+	    f->crop_y >= f->height || f->crop_h > f->height - f->crop_y)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int ipu_task_get_tmp(size_t size)
+{
+	size = PAGE_ALIGN(size);
+	if (size <= ipu_task_tmp_size)
+		return 0;
+
+	if (ipu_task_tmp_vaddr)
+		dma_free_coherent(NULL, ipu_task_tmp_size, ipu_task_tmp_vaddr,
+				  ipu_task_tmp_paddr);
+	ipu_task_tmp_size = 0;
+
+	ipu_task_tmp_vaddr = dma_alloc_coherent(NULL, size,
+						&ipu_task_tmp_paddr,
+						GFP_DMA | GFP_KERNEL);
+	if (!ipu_task_tmp_vaddr)
+		return -ENOMEM;
+	ipu_task_tmp_size = size;
+
+	return 0;
+}
+
+/*
+ * Split an input/output size into the stripes the IC produces in one
+ * pass each.  Only outputs up to two stripes wide are supported.
+ */
+static int ipu_task_split(uint32_t in_size, uint32_t out_size,
+			  uint32_t in_fmt, uint32_t out_fmt,
+			  struct stripe_param *s, int *n)
+{
+	memset(s, 0, 2 * sizeof(*s));
+
+	if (in_size > IPU_TASK_MAX_IN)
+		return -EINVAL;
+
+	if (out_size <= IPU_TASK_MAX_OUT) {
+		s[0].input_width = in_size;
+		s[0].output_width = out_size;
+		*n = 1;
+		return 0;
+	}
+
+	if (out_size > 2 * IPU_TASK_MAX_OUT)
+		return -EINVAL;
+	if (ipu_calc_stripes_sizes(in_size, out_size, IPU_TASK_MAX_OUT,
+				   ((unsigned long long)1) << 32, 1,
+				   in_fmt, out_fmt, &s[0], &s[1]) & 1)
+		return -EINVAL;
+	*n = 2;
+
+	return 0;
+}
+
+/*
+ * Point a channel buffer at the w x h window at (x, y) of frame f.
+ * Planar formats also need their U/V offsets moved to the window.
+ */
+static int ipu_task_init_buffer(ipu_channel_t channel, ipu_buffer_t type,
+				ipu_task_frame *f, uint32_t x, uint32_t y,
+				uint32_t w, uint32_t h, ipu_rotate_mode_t rot)
+{
+	dma_addr_t addr = f->paddr + y * f->stride +
+			  x * bytes_per_pixel(f->pixel_fmt);
+	int ret;
+
+	ret = ipu_init_channel_buffer(channel, type, f->pixel_fmt, w, h,
+				      f->stride, rot, addr, 0, 0, 0, 0);
+	if (ret || !ipu_task_fmt_is_planar(f->pixel_fmt))
+		return ret;
+
+	return ipu_update_channel_offset(channel, type, f->pixel_fmt,
+					 f->width, f->height, f->stride,
+					 0, 0, y, x);
+}
+
+static irqreturn_t ipu_task_eof_handler(int irq, void *dev_id)
+{
+	complete(dev_id);
+	return IRQ_HANDLED;
+}
+
+/* Run one frame through an initialized channel and wait for it */
+static int ipu_task_run_channel(ipu_channel_t channel, uint32_t irq)
+{
+	int ret;
+
+	INIT_COMPLETION(ipu_task_eof);
+	ipu_clear_irq(irq);
+	ret = ipu_request_irq(irq, ipu_task_eof_handler, 0, "ipu_task",
+			      &ipu_task_eof);
+	if (ret)
+		return ret;
+
+	ipu_enable_channel(channel);
+	ipu_select_buffer(channel, IPU_OUTPUT_BUFFER, 0);
+	ipu_select_buffer(channel, IPU_INPUT_BUFFER, 0);
+
+	if (!wait_for_completion_timeout(&ipu_task_eof, IPU_TASK_TIMEOUT)) {
+		dev_err(g_ipu_dev, "ipu task timeout on channel %d\n",
+			IPU_CHAN_ID(channel));
+		ret = -ETIMEDOUT;
+	}
+
+	ipu_free_irq(irq, &ipu_task_eof);
+	ipu_disable_channel(channel, true);
+
+	return ret;
+}
+
+/* One IC post-processor pass: stripe h x v of the input to out at (x, y) */
+static int ipu_task_pp(ipu_task *t, ipu_task_frame *out,
+		       ipu_rotate_mode_t rot, struct stripe_param *h,
+		       struct stripe_param *v, uint32_t x, uint32_t y)
+{
+	ipu_channel_params_t params;
+	int ret;
+
+	memset(&params, 0, sizeof(params));
+	params.mem_pp_mem.in_width = h->input_width;
+	params.mem_pp_mem.in_height = v->input_width;
+	params.mem_pp_mem.in_pixel_fmt = t->input.pixel_fmt;
+	params.mem_pp_mem.out_width = h->output_width;
+	params.mem_pp_mem.out_height = v->output_width;
+	params.mem_pp_mem.out_pixel_fmt = out->pixel_fmt;
+	/* 0 unless split, stripes must share the computed ratio */
+	params.mem_pp_mem.outh_resize_ratio = h->irr;
+	params.mem_pp_mem.outv_resize_ratio = v->irr;
+
+	ret = ipu_init_channel(MEM_PP_MEM, &params);
+	if (ret)
+		return ret;
+
+	ret = ipu_task_init_buffer(MEM_PP_MEM, IPU_INPUT_BUFFER, &t->input,
+				   t->input.crop_x + h->input_column,
+				   t->input.crop_y + v->input_column,
+				   h->input_width, v->input_width,
+				   IPU_ROTATE_NONE);
+	if (!ret)
+		ret = ipu_task_init_buffer(MEM_PP_MEM, IPU_OUTPUT_BUFFER, out,
+					   x, y, h->output_width,
+					   v->output_width, rot);
+	if (!ret)
+		ret = ipu_task_run_channel(MEM_PP_MEM, IPU_IRQ_PP_OUT_EOF);
+
+	ipu_uninit_channel(MEM_PP_MEM);
+
+	return ret;
+}
+
+/* Rotate the IC output in tmp into the output window of the task */
+static int ipu_task_rotate(ipu_task *t, ipu_task_frame *tmp)
+{
+	ipu_task_frame *out = &t->output;
+	int ret;
+
+	ret = ipu_init_channel(MEM_ROT_PP_MEM, NULL);
+	if (ret)
+		return ret;
+
+	ret = ipu_task_init_buffer(MEM_ROT_PP_MEM, IPU_INPUT_BUFFER, tmp,
+				   0, 0, tmp->width, tmp->height, t->rotate);
+	if (!ret)
+		ret = ipu_task_init_buffer(MEM_ROT_PP_MEM, IPU_OUTPUT_BUFFER,
+					   out, out->crop_x, out->crop_y,
+					   out->crop_w, out->crop_h,
+					   IPU_ROTATE_NONE);
+	if (!ret)
+		ret = ipu_task_run_channel(MEM_ROT_PP_MEM,
+					   IPU_IRQ_PP_ROT_OUT_EOF);
+
+	ipu_uninit_channel(MEM_ROT_PP_MEM);
+
+	return ret;
+}
+
+static int ipu_task_run(ipu_task *t)
+{
+	struct stripe_param hs[2], vs[2];
+	ipu_task_frame tmp, *out;
+	ipu_rotate_mode_t rot;
+	uint32_t out_w, out_h, x, y;
+	int nh, nv, i, j, ret;
+
+	if (t->rotate > IPU_ROTATE_90_LEFT)
+		return -EINVAL;
+	ret = ipu_task_check_frame(&t->input);
+	if (!ret)
+		ret = ipu_task_check_frame(&t->output);
+	if (ret)
+		return ret;
+
+	if (ipu_can_rotate_in_place(t->rotate)) {
+		out = &t->output;
+		rot = t->rotate;
+		out_w = out->crop_w;
+		out_h = out->crop_h;
+	} else {
+		/* The IC writes the picture unrotated, the rotator turns it */
+		if (t->rotate >= IPU_ROTATE_90_RIGHT) {
+			out_w = t->output.crop_h;
+			out_h = t->output.crop_w;
+		} else {
+			out_w = t->output.crop_w;
+			out_h = t->output.crop_h;
+		}
+		memset(&tmp, 0, sizeof(tmp));
+		tmp.pixel_fmt = t->output.pixel_fmt;
+		tmp.width = tmp.crop_w = out_w;
+		tmp.height = tmp.crop_h = out_h;
+		tmp.stride = out_w * bytes_per_pixel(tmp.pixel_fmt);
+		ret = ipu_task_get_tmp(ipu_task_frame_size(tmp.pixel_fmt,
+							   tmp.stride, out_h));
+		if (ret)
+			return ret;
+		tmp.paddr = ipu_task_tmp_paddr;
+		out = &tmp;
+		rot = IPU_ROTATE_NONE;
+	}
+
+	ret = ipu_task_split(t->input.crop_w, out_w, t->input.pixel_fmt,
+			     out->pixel_fmt, hs, &nh);
+	if (!ret)
+		ret = ipu_task_split(t->input.crop_h, out_h, t->input.pixel_fmt,
+				     out->pixel_fmt, vs, &nv);
+	if (ret)
+		return ret;
+
+	for (j = 0; j < nv; j++) {
+		for (i = 0; i < nh; i++) {
+			/* A flipped picture has its stripes swapped too */
+			x = hs[i].output_column;
+			if (rot & IPU_ROTATE_HORIZ_FLIP)
+				x = out_w - x - hs[i].output_width;
+			y = vs[j].output_column;
+			if (rot & IPU_ROTATE_VERT_FLIP)
+				y = out_h - y - vs[j].output_width;
+
+			ret = ipu_task_pp(t, out, rot, &hs[i], &vs[j],
+					  out->crop_x + x, out->crop_y + y);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (out == &tmp)
+		ret = ipu_task_rotate(t, &tmp);
+
+	return ret;
+}
+
+static void ipu_task_worker(struct work_struct *work)
+{
+	struct ipu_task_entry *e;
+
+	for (;;) {
+		spin_lock(&ipu_task_lock);
+		if (list_empty(&ipu_task_list)) {
+			spin_unlock(&ipu_task_lock);
+			break;
+		}
+		e = list_first_entry(&ipu_task_list, struct ipu_task_entry,
+				     list);
+		list_del(&e->list);
+		spin_unlock(&ipu_task_lock);
+
+		e->status = ipu_task_run(&e->task);
+
+		/* Wake under the lock, ipu_task_ctx_free() may be waiting */
+		spin_lock(&ipu_task_lock);
+		list_add_tail(&e->list, &e->ctx->done);
+		e->ctx->pending--;
+		wake_up(&e->ctx->waitq);
+		spin_unlock(&ipu_task_lock);
+	}
+}
+
+/*!
+ * Queue a conversion task.  The task runs after every task queued
+ * before it; its result is picked up with ipu_task_dequeue().
+ *
+ * @param	ctx	Task context of the open file.
+ * @param	task	Task to run, copied.
+ *
+ * @return	0 on success, -EBUSY if the file has too many tasks.
+ */
+int ipu_task_queue(struct ipu_task_ctx *ctx, ipu_task *task)
+{
+	struct ipu_task_entry *e;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return -ENOMEM;
+	e->ctx = ctx;
+	e->task = *task;
+
+	spin_lock(&ipu_task_lock);
+	if (ctx->outstanding >= IPU_TASK_MAX_PENDING) {
+		spin_unlock(&ipu_task_lock);
+		kfree(e);
+		return -EBUSY;
+	}
+	ctx->outstanding++;
+	ctx->pending++;
+	list_add_tail(&e->list, &ipu_task_list);
+	spin_unlock(&ipu_task_lock);
+
+	queue_work(ipu_task_wq, &ipu_task_work);
+
+	return 0;
+}
+
+/*!
+ * Return the oldest finished task of an open file.
+ *
+ * @param	ctx		Task context of the open file.
+ * @param	res		Filled with the task id and status.
+ * @param	nonblock	Don't wait for a running task.
+ *
+ * @return	0 on success, -EAGAIN if no task is finished (or none
+ *		is queued when blocking).
+ */
+int ipu_task_dequeue(struct ipu_task_ctx *ctx, ipu_task_result *res,
+		     bool nonblock)
+{
+	struct ipu_task_entry *e = NULL;
+	int ret;
+
+	if (!nonblock) {
+		ret = wait_event_interruptible(ctx->waitq,
+					       !list_empty(&ctx->done) ||
+					       !ctx->pending);
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&ipu_task_lock);
+	if (!list_empty(&ctx->done)) {
+		e = list_first_entry(&ctx->done, struct ipu_task_entry, list);
+		list_del(&e->list);
+		ctx->outstanding--;
+	}
+	spin_unlock(&ipu_task_lock);
+
+	if (!e)
+		return -EAGAIN;
+
+	res->id = e->task.id;
+	res->status = e->status;
+	kfree(e);
+
+	return 0;
+}
+
+unsigned int ipu_task_poll(struct ipu_task_ctx *ctx, struct file *file,
+			   struct poll_table_struct *wait)
+{
+	unsigned int mask = 0;
+
+	poll_wait(file, &ctx->waitq, wait);
+
+	spin_lock(&ipu_task_lock);
+	if (!list_empty(&ctx->done))
+		mask |= POLLIN | POLLRDNORM;
+	if (ctx->outstanding < IPU_TASK_MAX_PENDING)
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock(&ipu_task_lock);
+
+	return mask;
+}
+
+struct ipu_task_ctx *ipu_task_ctx_alloc(void)
+{
+	struct ipu_task_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return NULL;
+	INIT_LIST_HEAD(&ctx->done);
+	init_waitqueue_head(&ctx->waitq);
+
+	return ctx;
+}
+
+void ipu_task_ctx_free(struct ipu_task_ctx *ctx)
+{
+	struct ipu_task_entry *e, *n;
+
+	/* Drop the tasks not started yet and wait for the running one */
+	spin_lock(&ipu_task_lock);
+	list_for_each_entry_safe(e, n, &ipu_task_list, list) {
+		if (e->ctx == ctx) {
+			list_move_tail(&e->list, &ctx->done);
+			ctx->pending--;
+		}
+	}
+	spin_unlock(&ipu_task_lock);
+
+	wait_event(ctx->waitq, !ctx->pending);
+
+	spin_lock(&ipu_task_lock);
+	list_for_each_entry_safe(e, n, &ctx->done, list) {
+		list_del(&e->list);
+		kfree(e);
+	}
+	spin_unlock(&ipu_task_lock);
+
+	kfree(ctx);
+}
+
+int ipu_task_init(void)
+{
+	ipu_task_wq = create_singlethread_workqueue("ipu_task");
+	if (!ipu_task_wq)
+		return -ENOMEM;
+	INIT_WORK(&ipu_task_work, ipu_task_worker);
+
+	return 0;
+}
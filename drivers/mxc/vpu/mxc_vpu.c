@@ -39,6 +39,10 @@
 #include <linux/workqueue.h>
 #include <linux/sched.h>
 #include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/genalloc.h>
 #include <asm/sizes.h>
 #include <mach/clock.h>
 #include <mach/hardware.h>
@@ -64,9 +68,60 @@ struct iram_setting {
 	u32 end;
 };
 
+/* Per open file (codec session) state */
+struct vpu_file_ctx {
+	struct list_head list;		/* on vpu_ctx_list */
+	struct list_head wait_list;	/* on vpu_run_queue */
+	wait_queue_head_t wq;
+	int codec_done;
+
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+
+	/* statistics */
+	u32 frames;
+	u32 timeouts;
+	u64 busy_ns;
+	ktime_t lock_stamp;
+};
+
 static DEFINE_SPINLOCK(vpu_lock);
 static LIST_HEAD(head);
 
+/* All sessions, the sessions waiting for the VPU and the owner of it */
+static LIST_HEAD(vpu_ctx_list);
+static LIST_HEAD(vpu_run_queue);
+static struct vpu_file_ctx *vpu_owner;
+static u32 vpu_unowned_irqs;
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *vpu_debugfs_dir;
+#endif
+
+/*
+ * Buffer pool: memory the board code kept from the kernel at boot
+ * (mxc_vpu_platform_data pool_base/pool_size), handed out by gen_pool
+ * keyed by physical address.  Freed pool buffers are kept on
+ * vpu_pool_cache (most recent first) so the next session asking for the
+ * same frame size gets them back without searching the pool.
+ */
+static DEFINE_SPINLOCK(vpu_pool_lock);
+static struct gen_pool *vpu_pool;
+static unsigned long vpu_pool_phys;
+static unsigned long vpu_pool_size;
+static void __iomem *vpu_pool_virt;
+static LIST_HEAD(vpu_pool_cache);
+
+static struct {
+	u32 pool_allocs;	/* served from the pool */
+	u32 cache_hits;		/* served from vpu_pool_cache */
+	u32 cache_flushes;	/* cache given back to satisfy a request */
+	u32 pool_misses;	/* pool exhausted, fell back */
+	u32 failures;		/* no memory at all */
+	size_t used;
+	size_t cached;
+} vpu_pool_stats;
+
 static int vpu_inited;
 
 static int vpu_major;
@@ -147,18 +202,185 @@ static u32 dis_flag_regsave[4];
 		WRITE_REG(dis_flag_regsave[i], BIT_FRM_DIS_FLG_REG(i));	\
 } while (0)
 
+/*
+ * Size class of a pool buffer.  Frame buffers are rounded up to 64KB so
+ * that the small differences in stride/padding between sessions still
+ * hit the cache.
+ */
+static inline size_t vpu_pool_class(size_t size)
+{
+	if (size > SZ_64K)
+		return ALIGN(size, SZ_64K);
+	return PAGE_ALIGN(size);
+}
+
+static inline int vpu_pool_owns(unsigned long phy_addr)
+{
+	return phy_addr >= vpu_pool_phys &&
+	       phy_addr < vpu_pool_phys + vpu_pool_size;
+}
+
+/* Give every cached buffer back to the pool; vpu_pool_lock held */
+static void vpu_pool_flush_cache(void)
+{
+	struct memalloc_record *rec, *n;
+
+	list_for_each_entry_safe(rec, n, &vpu_pool_cache, list) {
+		list_del(&rec->list);
+		gen_pool_free(vpu_pool, rec->mem.phy_addr,
+			      vpu_pool_class(rec->mem.size));
+		kfree(rec);
+	}
+	vpu_pool_stats.cached = 0;
+}
+
+/*!
+ * Take a buffer from the pool, preferring a cached one of the same class.
+ * @return status  0 success.
+ */
+static int vpu_pool_alloc(struct vpu_mem_desc *mem)
+{
+	size_t size = vpu_pool_class(mem->size);
+	struct memalloc_record *rec, *found = NULL;
+	unsigned long phys;
+
+	if (!vpu_pool)
+		return -1;
+
+	spin_lock(&vpu_pool_lock);
+	list_for_each_entry(rec, &vpu_pool_cache, list) {
+		if (vpu_pool_class(rec->mem.size) == size) {
+			list_del(&rec->list);
+			found = rec;
+			break;
+		}
+	}
+	if (found) {
+		phys = found->mem.phy_addr;
+		vpu_pool_stats.cached -= size;
+		vpu_pool_stats.cache_hits++;
+	} else {
+		phys = gen_pool_alloc(vpu_pool, size);
+		if (!phys && !list_empty(&vpu_pool_cache)) {
+			vpu_pool_flush_cache();
+			vpu_pool_stats.cache_flushes++;
+			phys = gen_pool_alloc(vpu_pool, size);
+		}
+		if (!phys) {
+			vpu_pool_stats.pool_misses++;
+			spin_unlock(&vpu_pool_lock);
+			return -1;
+		}
+		vpu_pool_stats.pool_allocs++;
+	}
+	vpu_pool_stats.used += size;
+	spin_unlock(&vpu_pool_lock);
+
+	kfree(found);
+
+	mem->phy_addr = phys;
+	mem->cpu_addr = (unsigned long)vpu_pool_virt + (phys - vpu_pool_phys);
+	/* Don't leak a previous session's frames */
+	memset_io(vpu_pool_virt + (phys - vpu_pool_phys), 0, size);
+
+	return 0;
+}
+
+/*!
+ * Return a buffer to the pool cache.
+ * @return status  0 success, -1 if the buffer does not belong to the pool.
+ */
+static int vpu_pool_free(struct vpu_mem_desc *mem)
+{
+	size_t size = vpu_pool_class(mem->size);
+	struct memalloc_record *rec;
+
+	if (!vpu_pool || !vpu_pool_owns(mem->phy_addr))
+		return -1;
+
+	rec = kzalloc(sizeof(*rec), GFP_ATOMIC);
+
+	spin_lock(&vpu_pool_lock);
+	vpu_pool_stats.used -= size;
+	if (rec) {
+		rec->mem = *mem;
+		list_add(&rec->list, &vpu_pool_cache);
+		vpu_pool_stats.cached += size;
+	} else
+		gen_pool_free(vpu_pool, mem->phy_addr, size);
+	spin_unlock(&vpu_pool_lock);
+
+	return 0;
+}
+
+static void vpu_pool_init(void)
+{
+	if (!vpu_plat || !vpu_plat->pool_size)
+		return;
+
+	vpu_pool_virt = ioremap(vpu_plat->pool_base, vpu_plat->pool_size);
+	if (!vpu_pool_virt) {
+		printk(KERN_WARNING "VPU: failed to map the buffer pool\n");
+		return;
+	}
+	vpu_pool_phys = vpu_plat->pool_base;
+	vpu_pool_size = vpu_plat->pool_size;
+
+	vpu_pool = gen_pool_create(PAGE_SHIFT, -1);
+	if (!vpu_pool || gen_pool_add(vpu_pool, vpu_plat->pool_base,
+				      vpu_plat->pool_size, -1)) {
+		if (vpu_pool)
+			gen_pool_destroy(vpu_pool);
+		vpu_pool = NULL;
+		vpu_pool_size = 0;
+		iounmap(vpu_pool_virt);
+		printk(KERN_WARNING "VPU: no memory for the buffer pool\n");
+		return;
+	}
+}
+
+static void vpu_pool_destroy(void)
+{
+	if (!vpu_pool)
+		return;
+
+	spin_lock(&vpu_pool_lock);
+	vpu_pool_flush_cache();
+	spin_unlock(&vpu_pool_lock);
+
+	if (vpu_pool_stats.used) {
+		printk(KERN_ERR "VPU: %zuKB of the buffer pool still in use\n",
+		       vpu_pool_stats.used / SZ_1K);
+		return;
+	}
+
+	gen_pool_destroy(vpu_pool);
+	vpu_pool = NULL;
+	iounmap(vpu_pool_virt);
+	vpu_pool_size = 0;
+}
+
 /*!
  * Private function to alloc dma buffer
  * @return status  0 success.
  */
 static int vpu_alloc_dma_buffer(struct vpu_mem_desc *mem)
 {
+	if (vpu_pool_alloc(mem) == 0) {
+		pr_debug("[ALLOC] pool alloc cpu_addr = 0x%x\n",
+			 mem->cpu_addr);
+		return 0;
+	}
+
 	mem->cpu_addr = (unsigned long)
 	    dma_alloc_coherent(NULL, PAGE_ALIGN(mem->size),
 			       (dma_addr_t *) (&mem->phy_addr),
 			       GFP_DMA | GFP_KERNEL);
 	pr_debug("[ALLOC] mem alloc cpu_addr = 0x%x\n", mem->cpu_addr);
 	if ((void *)(mem->cpu_addr) == NULL) {
+		spin_lock(&vpu_pool_lock);
+		vpu_pool_stats.failures++;
+		spin_unlock(&vpu_pool_lock);
 		printk(KERN_ERR "Physical memory allocation error!\n");
 		return -1;
 	}
@@ -170,7 +392,7 @@ static int vpu_alloc_dma_buffer(struct vpu_mem_desc *mem)
  */
 static void vpu_free_dma_buffer(struct vpu_mem_desc *mem)
 {
-	if (mem->cpu_addr != 0) {
+	if (mem->cpu_addr != 0 && vpu_pool_free(mem) != 0) {
 		dma_free_coherent(0, PAGE_ALIGN(mem->size),
 				  (void *)mem->cpu_addr, mem->phy_addr);
 	}
@@ -204,11 +426,25 @@ static inline void vpu_worker_callback(struct work_struct *w)
 	struct vpu_priv *dev = container_of(w, struct vpu_priv,
 				work);
 
+	struct vpu_file_ctx *ctx;
+
 	if (dev->async_queue)
 		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
 
-	codec_done = 1;
-	wake_up_interruptible(&vpu_queue);
+	/* The interrupt belongs to whoever owns the VPU; sessions that
+	 * never lock it share the global flag as before */
+	spin_lock(&vpu_lock);
+	ctx = vpu_owner;
+	if (ctx) {
+		ctx->frames++;
+		ctx->codec_done = 1;
+		wake_up_interruptible(&ctx->wq);
+	} else {
+		vpu_unowned_irqs++;
+		codec_done = 1;
+		wake_up_interruptible(&vpu_queue);
+	}
+	spin_unlock(&vpu_lock);
 
 	/*
 	 * Clock is gated on when dec/enc started, gate it off when
@@ -232,6 +468,78 @@ static irqreturn_t vpu_irq_handler(int irq, void *dev_id)
 	return IRQ_HANDLED;
 }
 
+/*!
+ * Private function to hand the VPU to a session, vpu_lock held
+ */
+static void vpu_grant(struct vpu_file_ctx *ctx)
+{
+	vpu_owner = ctx;
+	ctx->codec_done = 0;
+	ctx->lock_stamp = ktime_get();
+	wake_up_interruptible(&ctx->wq);
+}
+
+/*!
+ * Private function to take the VPU back from a session and pass it on
+ * to the first waiter, vpu_lock held
+ */
+static void vpu_ungrant(struct vpu_file_ctx *ctx)
+{
+	struct vpu_file_ctx *next;
+
+	if (vpu_owner != ctx)
+		return;
+
+	ctx->busy_ns += ktime_to_ns(ktime_sub(ktime_get(), ctx->lock_stamp));
+	vpu_owner = NULL;
+
+	if (!list_empty(&vpu_run_queue)) {
+		next = list_first_entry(&vpu_run_queue, struct vpu_file_ctx,
+					wait_list);
+		list_del_init(&next->wait_list);
+		vpu_grant(next);
+	}
+}
+
+/*!
+ * Private function to wait for ownership of the VPU
+ * @return status  0 success.
+ */
+static int vpu_lock_dev(struct vpu_file_ctx *ctx, u_long timeout)
+{
+	long ret;
+
+	spin_lock(&vpu_lock);
+	if (vpu_owner == ctx) {
+		if (list_empty(&vpu_run_queue)) {
+			spin_unlock(&vpu_lock);
+			return 0;
+		}
+		/* Others are waiting, go to the back of the queue */
+		vpu_ungrant(ctx);
+	} else if (!vpu_owner && list_empty(&vpu_run_queue)) {
+		vpu_grant(ctx);
+		spin_unlock(&vpu_lock);
+		return 0;
+	}
+	list_add_tail(&ctx->wait_list, &vpu_run_queue);
+	spin_unlock(&vpu_lock);
+
+	ret = wait_event_interruptible_timeout(ctx->wq, vpu_owner == ctx,
+			timeout ? msecs_to_jiffies(timeout) :
+			MAX_SCHEDULE_TIMEOUT);
+
+	spin_lock(&vpu_lock);
+	if (vpu_owner == ctx) {
+		spin_unlock(&vpu_lock);
+		return 0;
+	}
+	list_del_init(&ctx->wait_list);
+	spin_unlock(&vpu_lock);
+
+	return ret ? -ERESTARTSYS : -ETIME;
+}
+
 /*!
  * @brief open function for vpu file operation
  *
@@ -239,9 +547,21 @@ static irqreturn_t vpu_irq_handler(int irq, void *dev_id)
  */
 static int vpu_open(struct inode *inode, struct file *filp)
 {
+	struct vpu_file_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&ctx->wait_list);
+	init_waitqueue_head(&ctx->wq);
+	ctx->pid = current->tgid;
+	get_task_comm(ctx->comm, current);
+
 	spin_lock(&vpu_lock);
 	open_count++;
-	filp->private_data = (void *)(&vpu_data);
+	list_add_tail(&ctx->list, &vpu_ctx_list);
+	filp->private_data = ctx;
 	spin_unlock(&vpu_lock);
 	return 0;
 }
@@ -299,7 +619,7 @@ static int vpu_ioctl(struct inode *inode, struct file *filp, u_int cmd,
 		}
 	case VPU_IOC_PHYMEM_FREE:
 		{
-			struct memalloc_record *rec, *n;
+			struct memalloc_record *rec, *n, *found = NULL;
 			struct vpu_mem_desc vpu_mem;
 
 			ret = copy_from_user(&vpu_mem,
@@ -310,39 +630,63 @@ static int vpu_ioctl(struct inode *inode, struct file *filp, u_int cmd,
 
 			pr_debug("[FREE] mem freed cpu_addr = 0x%x\n",
 				 vpu_mem.cpu_addr);
-			if ((void *)vpu_mem.cpu_addr != NULL) {
-				vpu_free_dma_buffer(&vpu_mem);
-			}
 
 			spin_lock(&vpu_lock);
 			list_for_each_entry_safe(rec, n, &head, list) {
 				if (rec->mem.cpu_addr == vpu_mem.cpu_addr) {
 					/* delete from list */
 					list_del(&rec->list);
-					kfree(rec);
+					found = rec;
 					break;
 				}
 			}
 			spin_unlock(&vpu_lock);
 
+			/*
+			 * Free what was recorded at allocation time so a bogus
+			 * size or address from user space can't corrupt the pool.
+			 */
+			if (found) {
+				vpu_free_dma_buffer(&found->mem);
+				kfree(found);
+			}
+
 			break;
 		}
 	case VPU_IOC_WAIT4INT:
 		{
+			struct vpu_file_ctx *ctx = filp->private_data;
 			u_long timeout = (u_long) arg;
+			int *done = &codec_done;
+			wait_queue_head_t *wq = &vpu_queue;
+
+			if (vpu_owner == ctx) {
+				done = &ctx->codec_done;
+				wq = &ctx->wq;
+			}
+
 			if (!wait_event_interruptible_timeout
-			    (vpu_queue, codec_done != 0,
+			    (*wq, *done != 0,
 			     msecs_to_jiffies(timeout))) {
 				printk(KERN_WARNING "VPU blocking: timeout.\n");
+				ctx->timeouts++;
 				ret = -ETIME;
 			} else if (signal_pending(current)) {
 				printk(KERN_WARNING
 				       "VPU interrupt received.\n");
 				ret = -ERESTARTSYS;
 			} else
-				codec_done = 0;
+				*done = 0;
 			break;
 		}
+	case VPU_IOC_LOCK_DEV:
+		ret = vpu_lock_dev(filp->private_data, arg);
+		break;
+	case VPU_IOC_UNLOCK_DEV:
+		spin_lock(&vpu_lock);
+		vpu_ungrant(filp->private_data);
+		spin_unlock(&vpu_lock);
+		break;
 	case VPU_IOC_IRAM_SETTING:
 		{
 			ret = copy_to_user((void __user *)arg, &iram,
@@ -499,7 +843,14 @@ static int vpu_ioctl(struct inode *inode, struct file *filp, u_int cmd,
  */
 static int vpu_release(struct inode *inode, struct file *filp)
 {
+	struct vpu_file_ctx *ctx = filp->private_data;
+
 	spin_lock(&vpu_lock);
+	vpu_ungrant(ctx);
+	list_del(&ctx->wait_list);
+	list_del(&ctx->list);
+	kfree(ctx);
+
 	if (open_count > 0 && !(--open_count)) {
 		vpu_free_buffers();
 
@@ -520,8 +871,7 @@ static int vpu_release(struct inode *inode, struct file *filp)
  */
 static int vpu_fasync(int fd, struct file *filp, int mode)
 {
-	struct vpu_priv *dev = (struct vpu_priv *)filp->private_data;
-	return fasync_helper(fd, filp, mode, &dev->async_queue);
+	return fasync_helper(fd, filp, mode, &vpu_data.async_queue);
 }
 
 /*!
@@ -595,6 +945,103 @@ static int vpu_mmap(struct file *fp, struct vm_area_struct *vm)
 		return vpu_map_hwregs(fp, vm);
 }
 
+#ifdef CONFIG_DEBUG_FS
+/*!
+ * @brief debugfs view of the codec sessions
+ */
+static int vpu_sessions_show(struct seq_file *s, void *unused)
+{
+	struct vpu_file_ctx *ctx;
+	ktime_t now = ktime_get();
+	u64 busy;
+
+	seq_printf(s, "%-6s %-16s %10s %14s %8s %s\n", "pid", "comm",
+		   "frames", "busy_us", "timeouts", "state");
+
+	spin_lock(&vpu_lock);
+	list_for_each_entry(ctx, &vpu_ctx_list, list) {
+		busy = ctx->busy_ns;
+		if (vpu_owner == ctx)
+			busy += ktime_to_ns(ktime_sub(now, ctx->lock_stamp));
+		seq_printf(s, "%-6d %-16s %10u %14llu %8u %s\n",
+			   ctx->pid, ctx->comm, ctx->frames,
+			   (unsigned long long)div_u64(busy, NSEC_PER_USEC),
+			   ctx->timeouts,
+			   vpu_owner == ctx ? "running" :
+			   !list_empty(&ctx->wait_list) ? "waiting" : "idle");
+	}
+	seq_printf(s, "interrupts without owner: %u\n", vpu_unowned_irqs);
+	spin_unlock(&vpu_lock);
+
+	return 0;
+}
+
+static int vpu_sessions_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vpu_sessions_show, inode->i_private);
+}
+
+static const struct file_operations vpu_sessions_fops = {
+	.owner = THIS_MODULE,
+	.open = vpu_sessions_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int vpu_mempool_show(struct seq_file *s, void *unused)
+{
+	spin_lock(&vpu_pool_lock);
+	seq_printf(s, "pool:          %luKB at 0x%08lx\n",
+		   vpu_pool_size / SZ_1K, vpu_pool_phys);
+	seq_printf(s, "in use:        %zuKB\n", vpu_pool_stats.used / SZ_1K);
+	seq_printf(s, "cached:        %zuKB\n", vpu_pool_stats.cached / SZ_1K);
+	seq_printf(s, "pool allocs:   %u\n", vpu_pool_stats.pool_allocs);
+	seq_printf(s, "cache hits:    %u\n", vpu_pool_stats.cache_hits);
+	seq_printf(s, "cache flushes: %u\n", vpu_pool_stats.cache_flushes);
+	seq_printf(s, "pool misses:   %u\n", vpu_pool_stats.pool_misses);
+	seq_printf(s, "failures:      %u\n", vpu_pool_stats.failures);
+	spin_unlock(&vpu_pool_lock);
+
+	return 0;
+}
+
+static int vpu_mempool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vpu_mempool_show, inode->i_private);
+}
+
+static const struct file_operations vpu_mempool_fops = {
+	.owner = THIS_MODULE,
+	.open = vpu_mempool_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void vpu_debugfs_init(void)
+{
+	vpu_debugfs_dir = debugfs_create_dir("mxc_vpu", NULL);
+	if (IS_ERR_OR_NULL(vpu_debugfs_dir)) {
+		vpu_debugfs_dir = NULL;
+		return;
+	}
+	debugfs_create_file("sessions", S_IRUGO, vpu_debugfs_dir, NULL,
+			    &vpu_sessions_fops);
+	debugfs_create_file("mempool", S_IRUGO, vpu_debugfs_dir, NULL,
+			    &vpu_mempool_fops);
+}
+
+static void vpu_debugfs_remove(void)
+{
+	debugfs_remove_recursive(vpu_debugfs_dir);
+	vpu_debugfs_dir = NULL;
+}
+#else
+static inline void vpu_debugfs_init(void) {}
+static inline void vpu_debugfs_remove(void) {}
+#endif
+
 struct file_operations vpu_fops = {
 	.owner = THIS_MODULE,
 	.open = vpu_open,
@@ -679,10 +1126,14 @@ static int vpu_dev_probe(struct platform_device *pdev)
 	vpu_data.workqueue = create_workqueue("vpu_wq");
 	INIT_WORK(&vpu_data.work, vpu_worker_callback);
 
+	vpu_pool_init();
+
 	bitwork_mem.size = MAX_BITWORK_SIZE;
 	if (vpu_alloc_dma_buffer(&bitwork_mem) == -1)
 		goto err_out_class;
 
+	vpu_debugfs_init();
+
 	printk(KERN_INFO "VPU initialized\n");
 	goto out;
 
@@ -699,6 +1150,7 @@ static int vpu_dev_probe(struct platform_device *pdev)
 
 static int vpu_dev_remove(struct platform_device *pdev)
 {
+	vpu_debugfs_remove();
 	free_irq(vpu_irq, &vpu_data);
 	cancel_work_sync(&vpu_data.work);
 	flush_workqueue(vpu_data.workqueue);
@@ -708,6 +1160,8 @@ static int vpu_dev_remove(struct platform_device *pdev)
 	if (vpu_plat && vpu_plat->iram_enable && vpu_plat->iram_size)
 		iram_free(iram.start,  vpu_plat->iram_size);
 
+	vpu_pool_destroy();
+
 	return 0;
 }
 
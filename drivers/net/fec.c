@@ -39,6 +39,8 @@
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
 #include <linux/bitops.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
 #include <linux/io.h>
 #include <linux/irq.h>
 #include <linux/clk.h>
@@ -85,24 +87,31 @@
 #endif
 #endif /* CONFIG_M5272 */
 
-/* The number of Tx and Rx buffers.  These are allocated from the page
- * pool.  The code may assume these are power of two, so it it best
- * to keep them that size.
- * We don't need to allocate pages for the transmitter.  We just use
- * the skbuffer directly.
+/* The number of Tx and Rx buffers.  Each Rx descriptor owns an skb
+ * which is handed to the stack as is, the transmitter uses the skbuffer
+ * directly.  The ring sizes can be changed through ethtool -G and are
+ * kept a power of two, the descriptor memory is sized for the maximum.
  */
-#define FEC_ENET_RX_PAGES	8
 #define FEC_ENET_RX_FRSIZE	2048
-#define FEC_ENET_RX_FRPPG	(PAGE_SIZE / FEC_ENET_RX_FRSIZE)
-#define RX_RING_SIZE		(FEC_ENET_RX_FRPPG * FEC_ENET_RX_PAGES)
 #define FEC_ENET_TX_FRSIZE	2048
-#define FEC_ENET_TX_FRPPG	(PAGE_SIZE / FEC_ENET_TX_FRSIZE)
-#define TX_RING_SIZE		16	/* Must be power of two */
-#define TX_RING_MOD_MASK	15	/*   for this to work */
+#define FEC_RX_RING_DEFAULT	64
+#define FEC_TX_RING_DEFAULT	64
+#define FEC_RX_RING_MIN		8
+#define FEC_TX_RING_MIN		32	/* > MAX_SKB_FRAGS + 1 */
+#define FEC_RX_RING_MAX		256
+#define FEC_TX_RING_MAX		256
+#define FEC_BD_MEM_SIZE	\
+	PAGE_ALIGN((FEC_RX_RING_MAX + FEC_TX_RING_MAX) * sizeof(struct bufdesc))
 
-#if (((RX_RING_SIZE + TX_RING_SIZE) * 8) > PAGE_SIZE)
-#error "FEC: descriptor ring size constants too large"
-#endif
+/*
+ * Frames up to this size are copied into a new skb and the ring buffer
+ * is recycled; larger ones are passed up in the ring buffer itself.
+ */
+#define FEC_COPYBREAK_DEFAULT	256
+
+static int copybreak = FEC_COPYBREAK_DEFAULT;
+module_param(copybreak, int, 0644);
+MODULE_PARM_DESC(copybreak, "Maximum size of received frames that are copied");
 
 /* Interrupt events/masks. */
 #define FEC_ENET_HBERR	((uint)0x80000000)	/* Heartbeat error */
@@ -125,6 +134,20 @@
 #define FEC_DEFAULT_IMASK (FEC_ENET_TXF | FEC_ENET_RXF | FEC_ENET_MII)
 #endif
 
+/* Frame events handled by the NAPI poll routine rather than the ISR */
+#define FEC_NAPI_IMASK	(FEC_ENET_TXF | FEC_ENET_RXF)
+
+#define FEC_NAPI_WEIGHT		64
+#define FEC_MAX_HOLDOFF_USECS	1000
+
+/*
+ * Number of RX descriptors handled per NAPI poll.  The frame interrupts
+ * stay masked until a poll finds less than this much work.
+ */
+static int napi_weight = FEC_NAPI_WEIGHT;
+module_param(napi_weight, int, 0444);
+MODULE_PARM_DESC(napi_weight, "FEC NAPI poll weight");
+
 /* The FEC stores dest/src/type, data, and checksum for receive packets.
  */
 #define PKT_MAXBUF_SIZE		1518
@@ -162,11 +185,14 @@ struct fec_enet_private {
 	struct clk *clk;
 
 	/* The saved address of a sent-in-place packet/buffer, for skfree(). */
-	unsigned char *tx_bounce[TX_RING_SIZE];
-	struct	sk_buff* tx_skbuff[TX_RING_SIZE];
-	struct	sk_buff* rx_skbuff[RX_RING_SIZE];
-	ushort	skb_cur;
-	ushort	skb_dirty;
+	unsigned char *tx_bounce[FEC_TX_RING_MAX];
+	struct	sk_buff* tx_skbuff[FEC_TX_RING_MAX];
+	struct	sk_buff* rx_skbuff[FEC_RX_RING_MAX];
+	/* Transmit descriptors handed to the controller, not reclaimed */
+	uint	tx_pending;
+	/* Ring sizes in use, powers of two */
+	uint	rx_ring_size;
+	uint	tx_ring_size;
 
 	/* CPM dual port RAM relative addresses */
 	dma_addr_t	bd_dma;
@@ -178,10 +204,15 @@ struct fec_enet_private {
 	/* The ring entries to be free()ed */
 	struct bufdesc	*dirty_tx;
 
-	uint	tx_full;
 	/* hold while accessing the HW like ringbuffer for tx/rx but not MAC */
 	spinlock_t hw_lock;
 
+	struct	napi_struct napi;
+	/* Interrupt hold-off after a poll completes, see fec_enet_poll() */
+	struct	hrtimer holdoff_timer;
+	uint	rx_coalesce_usecs;
+	uint	tx_coalesce_usecs;
+
 	struct  platform_device *pdev;
 
 	int	opened;
@@ -209,10 +240,12 @@ static struct mii_bus *fec_mii_bus;
 
 static irqreturn_t fec_enet_interrupt(int irq, void * dev_id);
 static void fec_enet_tx(struct net_device *dev);
-static void fec_enet_rx(struct net_device *dev);
+static int fec_enet_rx(struct net_device *dev, int budget);
 static int fec_enet_close(struct net_device *dev);
 static void fec_restart(struct net_device *dev, int duplex);
 static void fec_stop(struct net_device *dev);
+static void fec_enet_free_buffers(struct net_device *dev);
+static int fec_enet_alloc_buffers(struct net_device *dev);
 
 /* FEC MII MMFR bits definition */
 #define FEC_MMFR_ST		(1 << 30)
@@ -241,14 +274,67 @@ static void *swap_buffer(void *bufaddr, int len)
 }
 #endif
 
+/*
+ * Map one transmit buffer into a descriptor.  Buffers that do not meet
+ * the controller's alignment are copied into the slot's bounce buffer,
+ * everything else is mapped in place.  NETIF_F_HIGHDMA is not set, so
+ * the stack never hands us fragments without a kernel mapping.
+ */
+static void
+fec_enet_tx_map(struct net_device *dev, struct bufdesc *bdp,
+		void *bufaddr, unsigned int len)
+{
+	struct fec_enet_private *fep = netdev_priv(dev);
+	unsigned int index = bdp - fep->tx_bd_base;
+
+	bdp->cbd_datlen = len;
+
+	/*
+	 * On some FEC implementations data must be aligned on
+	 * 4-byte boundaries. Use bounce buffers to copy data
+	 * and get it aligned. Ugh.
+	 */
+	if (((unsigned long) bufaddr) & FEC_ALIGNMENT) {
+		memcpy(fep->tx_bounce[index], bufaddr, len);
+		bufaddr = fep->tx_bounce[index];
+	}
+
+#ifdef CONFIG_ARCH_MXS
+	swap_buffer(bufaddr, len);
+#endif
+	bdp->cbd_bufaddr = dma_map_single(&dev->dev, bufaddr, len,
+			DMA_TO_DEVICE);
+}
+
+static void
+fec_enet_tx_unmap(struct net_device *dev, struct bufdesc *bdp)
+{
+	if (!bdp->cbd_bufaddr)
+		return;
+
+	dma_unmap_single(&dev->dev, bdp->cbd_bufaddr, bdp->cbd_datlen,
+			DMA_TO_DEVICE);
+	bdp->cbd_bufaddr = 0;
+}
+
+/*
+ * A frame takes one descriptor for the linear part and one per page
+ * fragment.  The ring is stopped while it could not take another
+ * maximally fragmented frame.
+ */
+#define FEC_TX_DESC_MAX		(MAX_SKB_FRAGS + 1)
+
 static int
 fec_enet_start_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct fec_enet_private *fep = netdev_priv(dev);
-	struct bufdesc *bdp;
-	void *bufaddr;
+	struct bufdesc *bdp, *bdp_first, *bdp_last;
+	unsigned int nr_frags = skb_shinfo(skb)->nr_frags;
+	unsigned int i;
+	skb_frag_t *frag;
 	unsigned short	status;
-	unsigned long	estatus;
+	unsigned long	estatus = 0;
+	unsigned short	ptp = 0;
 	unsigned long flags;
 
 	if (!fep->link) {
@@ -257,89 +343,90 @@ fec_enet_start_xmit(struct sk_buff *skb, struct net_device *dev)
 		return NETDEV_TX_BUSY;
 	}
 
-	spin_lock_irqsave(&fep->hw_lock, flags);
-	/* Fill in a Tx ring entry */
-	bdp = fep->cur_tx;
+	/* No checksum engine, finish what the stack left to us. */
+	if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb)) {
+		dev_kfree_skb_any(skb);
+		dev->stats.tx_dropped++;
+		return NETDEV_TX_OK;
+	}
 
-	status = bdp->cbd_sc;
+	if (fep->ptimer_present) {
+		if (fec_ptp_do_txstamp(fep->ptp_priv, skb)) {
+			estatus = BD_ENET_TX_TS;
+			ptp = BD_ENET_TX_PTP;
+		}
+	}
+
+	spin_lock_irqsave(&fep->hw_lock, flags);
 
-	if (status & BD_ENET_TX_READY) {
+	if (fep->tx_ring_size - fep->tx_pending < nr_frags + 1) {
 		/* Ooops.  All transmit buffers are full.  Bail out.
-		 * This should not happen, since dev->tbusy should be set.
+		 * This should not happen, since the queue is stopped
+		 * before the ring runs out.
 		 */
 		printk("%s: tx queue full!.\n", dev->name);
+		netif_stop_queue(dev);
 		spin_unlock_irqrestore(&fep->hw_lock, flags);
 		return NETDEV_TX_BUSY;
 	}
 
-	/* Clear all of the status flags */
-	status &= ~BD_ENET_TX_STATS;
-
-	/* Set buffer length and buffer pointer */
-	bufaddr = skb->data;
-	bdp->cbd_datlen = skb->len;
-
-	/*
-	 * On some FEC implementations data must be aligned on
-	 * 4-byte boundaries. Use bounce buffers to copy data
-	 * and get it aligned. Ugh.
+	/* Fill in a Tx ring entry per buffer.  The first descriptor is
+	 * handed to the controller last so it never sees half a chain.
 	 */
-	if (((unsigned long) bufaddr) & FEC_ALIGNMENT) {
-		unsigned int index;
-		index = bdp - fep->tx_bd_base;
-		memcpy(fep->tx_bounce[index], (void *)skb->data, skb->len);
-		bufaddr = fep->tx_bounce[index];
-	}
+	bdp_first = bdp = fep->cur_tx;
+	for (i = 0; i <= nr_frags; i++) {
+		if (i == 0) {
+			fec_enet_tx_map(dev, bdp, skb->data, skb_headlen(skb));
+		} else {
+			frag = &skb_shinfo(skb)->frags[i - 1];
+			fec_enet_tx_map(dev, bdp, page_address(frag->page) +
+					frag->page_offset, frag->size);
+		}
 
-	if (fep->ptimer_present) {
-		if (fec_ptp_do_txstamp(skb)) {
-			estatus = BD_ENET_TX_TS;
-			status |= BD_ENET_TX_PTP;
-		} else
-			estatus = 0;
 #ifdef CONFIG_ENHANCED_BD
-		bdp->cbd_esc = (estatus | BD_ENET_TX_INT);
-		bdp->cbd_bdu = 0;
+		if (fep->ptimer_present) {
+			bdp->cbd_esc = (estatus | BD_ENET_TX_INT);
+			bdp->cbd_bdu = 0;
+		}
 #endif
-	}
+		/* Clear all of the status flags */
+		status = bdp->cbd_sc & BD_ENET_TX_WRAP;
+		status |= ptp;
+		if (i == nr_frags)
+			/* Interrupt when done, it's the last BD of the
+			 * frame, and put the CRC on the end.
+			 */
+			status |= (BD_ENET_TX_INTR | BD_ENET_TX_LAST
+					| BD_ENET_TX_TC);
+		if (i)
+			status |= BD_ENET_TX_READY;
+		bdp->cbd_sc = status;
 
-#ifdef CONFIG_ARCH_MXS
-	swap_buffer(bufaddr, skb->len);
-#endif
-	/* Save skb pointer */
-	fep->tx_skbuff[fep->skb_cur] = skb;
+		bdp_last = bdp;
+		/* If this was the last BD in the ring, start at the
+		 * beginning again.
+		 */
+		if (status & BD_ENET_TX_WRAP)
+			bdp = fep->tx_bd_base;
+		else
+			bdp++;
+	}
 
+	/* Save skb pointer with the descriptor that completes the frame */
+	fep->tx_skbuff[bdp_last - fep->tx_bd_base] = skb;
+	fep->tx_pending += nr_frags + 1;
+	fep->cur_tx = bdp;
 	dev->stats.tx_bytes += skb->len;
-	fep->skb_cur = (fep->skb_cur+1) & TX_RING_MOD_MASK;
-
-	/* Push the data cache so the CPM does not get stale memory
-	 * data.
-	 */
-	bdp->cbd_bufaddr = dma_map_single(&dev->dev, bufaddr,
-			FEC_ENET_TX_FRSIZE, DMA_TO_DEVICE);
 
-	/* Send it on its way.  Tell FEC it's ready, interrupt when done,
-	 * it's the last BD of the frame, and to put the CRC on the end.
-	 */
-	status |= (BD_ENET_TX_READY | BD_ENET_TX_INTR
-			| BD_ENET_TX_LAST | BD_ENET_TX_TC);
-	bdp->cbd_sc = status;
+	/* Send it on its way. */
+	wmb();
+	bdp_first->cbd_sc |= BD_ENET_TX_READY;
 
 	/* Trigger transmission start */
 	writel(0, fep->hwp + FEC_X_DES_ACTIVE);
 
-	/* If this was the last BD in the ring, start at the beginning again. */
-	if (status & BD_ENET_TX_WRAP)
-		bdp = fep->tx_bd_base;
-	else
-		bdp++;
-
-	if (bdp == fep->dirty_tx) {
-		fep->tx_full = 1;
+	if (fep->tx_ring_size - fep->tx_pending < FEC_TX_DESC_MAX)
 		netif_stop_queue(dev);
-	}
-
-	fep->cur_tx = bdp;
 
 	spin_unlock_irqrestore(&fep->hw_lock, flags);
 
@@ -368,20 +455,20 @@ fec_enet_interrupt(int irq, void * dev_id)
 
 	do {
 		int_events = readl(fep->hwp + FEC_IEVENT);
-		writel(int_events, fep->hwp + FEC_IEVENT);
-
-		if (int_events & FEC_ENET_RXF) {
-			ret = IRQ_HANDLED;
-			fec_enet_rx(dev);
-		}
+		int_events &= readl(fep->hwp + FEC_IMASK);
+		writel(int_events & ~FEC_NAPI_IMASK, fep->hwp + FEC_IEVENT);
 
-		/* Transmit OK, or non-fatal error. Update the buffer
-		 * descriptors. FEC handles all errors, we just discover
-		 * them as part of the transmit process.
+		/* Frame received or transmitted.  Mask the frame interrupts
+		 * and leave the ring work to fec_enet_poll(), which also acks
+		 * the events.  If a poll is already pending the events stay
+		 * set and fire again once it unmasks them.
 		 */
-		if (int_events & FEC_ENET_TXF) {
+		if (int_events & FEC_NAPI_IMASK) {
 			ret = IRQ_HANDLED;
-			fec_enet_tx(dev);
+			writel(FEC_DEFAULT_IMASK & ~FEC_NAPI_IMASK,
+					fep->hwp + FEC_IMASK);
+			if (napi_schedule_prep(&fep->napi))
+				__napi_schedule(&fep->napi);
 		}
 
 		if (int_events & FEC_ENET_TS_TIMER) {
@@ -399,7 +486,62 @@ fec_enet_interrupt(int irq, void * dev_id)
 	return ret;
 }
 
+static enum hrtimer_restart fec_enet_holdoff_timer(struct hrtimer *timer)
+{
+	struct fec_enet_private *fep =
+		container_of(timer, struct fec_enet_private, holdoff_timer);
+
+	writel(FEC_DEFAULT_IMASK, fep->hwp + FEC_IMASK);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * NAPI poll routine.  Runs with the frame interrupts masked, reclaims
+ * finished transmit descriptors and passes up to @budget received frames
+ * to the stack.  Once the ring is drained the interrupts are unmasked,
+ * either at once or after the configured coalescing hold-off.
+ */
+static int fec_enet_poll(struct napi_struct *napi, int budget)
+{
+	struct fec_enet_private *fep =
+		container_of(napi, struct fec_enet_private, napi);
+	struct net_device *dev = fep->netdev;
+	int work_done;
+	uint usecs;
+
+	/* Ack before looking at the rings so nothing arriving from here on
+	 * is lost when the interrupts are unmasked again.
+	 */
+	writel(FEC_NAPI_IMASK, fep->hwp + FEC_IEVENT);
+
+	/* Transmit OK, or non-fatal error. Update the buffer
+	 * descriptors. FEC handles all errors, we just discover
+	 * them as part of the transmit process.
+	 */
+	fec_enet_tx(dev);
+	work_done = fec_enet_rx(dev, budget);
+
+	if (work_done < budget) {
+		napi_complete(napi);
+
+		usecs = work_done ? fep->rx_coalesce_usecs :
+				fep->tx_coalesce_usecs;
+		if (usecs)
+			hrtimer_start(&fep->holdoff_timer,
+				ns_to_ktime(usecs * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+		else
+			writel(FEC_DEFAULT_IMASK, fep->hwp + FEC_IMASK);
+	}
+
+	return work_done;
+}
 
+/*
+ * Reclaim finished transmit descriptors.  Called from the NAPI poll, so
+ * completions are collected in one pass per poll and the queue is only
+ * woken once there is room for a maximally fragmented frame again.
+ */
 static void
 fec_enet_tx(struct net_device *dev)
 {
@@ -407,21 +549,33 @@ fec_enet_tx(struct net_device *dev)
 	struct  fec_ptp_private *fpp;
 	struct bufdesc *bdp;
 	unsigned short status;
+#if defined(CONFIG_ENHANCED_BD)
+	unsigned long estatus;
+#endif
 	struct	sk_buff	*skb;
+	unsigned int index;
 
 	fep = netdev_priv(dev);
 	fpp = fep->ptp_priv;
 	spin_lock(&fep->hw_lock);
 	bdp = fep->dirty_tx;
 
-	while (((status = bdp->cbd_sc) & BD_ENET_TX_READY) == 0) {
-		if (bdp == fep->cur_tx && fep->tx_full == 0)
+	while (fep->tx_pending) {
+		status = bdp->cbd_sc;
+		if (status & BD_ENET_TX_READY)
 			break;
 
-		dma_unmap_single(&dev->dev, bdp->cbd_bufaddr, FEC_ENET_TX_FRSIZE, DMA_TO_DEVICE);
-		bdp->cbd_bufaddr = 0;
+		fec_enet_tx_unmap(dev, bdp);
+		fep->tx_pending--;
+
+		index = bdp - fep->tx_bd_base;
+		skb = fep->tx_skbuff[index];
+		/* Only the last descriptor of a frame carries the skb
+		 * and the transmit status.
+		 */
+		if (!skb)
+			goto next;
 
-		skb = fep->tx_skbuff[fep->skb_dirty];
 		/* Check for errors. */
 		if (status & (BD_ENET_TX_HB | BD_ENET_TX_LC |
 				   BD_ENET_TX_RL | BD_ENET_TX_UN |
@@ -441,9 +595,6 @@ fec_enet_tx(struct net_device *dev)
 			dev->stats.tx_packets++;
 		}
 
-		if (status & BD_ENET_TX_READY)
-			printk("HEY! Enet xmit interrupt and TX_READY.\n");
-
 		/* Deferred means some collisions occurred during transmit,
 		 * but we eventually sent the packet OK.
 		 */
@@ -456,7 +607,8 @@ fec_enet_tx(struct net_device *dev)
 			if (estatus & BD_ENET_TX_TS)
 				fec_ptp_store_txstamp(fpp, skb, bdp);
 		}
-#elif defined(CONFIG_IN_BAND)
+#else
+		/* Out-of-band as well, for SO_TIMESTAMPING */
 		if (fep->ptimer_present) {
 			if (status & BD_ENET_TX_PTP)
 				fec_ptp_store_txstamp(fpp, skb, bdp);
@@ -465,48 +617,75 @@ fec_enet_tx(struct net_device *dev)
 
 		/* Free the sk buffer associated with this last transmit */
 		dev_kfree_skb_any(skb);
-		fep->tx_skbuff[fep->skb_dirty] = NULL;
-		fep->skb_dirty = (fep->skb_dirty + 1) & TX_RING_MOD_MASK;
-
+		fep->tx_skbuff[index] = NULL;
+next:
 		/* Update pointer to next buffer descriptor to be transmitted */
 		if (status & BD_ENET_TX_WRAP)
 			bdp = fep->tx_bd_base;
 		else
 			bdp++;
-
-		/* Since we have freed up a buffer, the ring is no longer full
-		 */
-		if (fep->tx_full) {
-			fep->tx_full = 0;
-			if (netif_queue_stopped(dev))
-				netif_wake_queue(dev);
-		}
 	}
 	fep->dirty_tx = bdp;
+
+	if (netif_queue_stopped(dev) && fep->link &&
+	    fep->tx_ring_size - fep->tx_pending >= FEC_TX_DESC_MAX)
+		netif_wake_queue(dev);
+
 	spin_unlock(&fep->hw_lock);
 }
 
 
+/*
+ * Allocate a receive skb whose data is aligned the way the controller
+ * wants its buffer addresses.
+ */
+static struct sk_buff *fec_enet_rx_alloc(struct net_device *dev)
+{
+	struct sk_buff *skb;
+	unsigned long off;
+
+	skb = netdev_alloc_skb(dev, FEC_ENET_RX_FRSIZE + FEC_ALIGNMENT);
+	if (!skb)
+		return NULL;
+
+	off = (unsigned long)skb->data & FEC_ALIGNMENT;
+	if (off)
+		skb_reserve(skb, FEC_ALIGNMENT + 1 - off);
+
+	return skb;
+}
+
 /* During a receive, the cur_rx points to the current incoming buffer.
  * When we update through the ring, if the next incoming buffer has
  * not been given to the system, we just set the empty indicator,
  * effectively tossing the packet.
+ *
+ * At most @budget descriptors are processed; the number handled is
+ * returned to the NAPI poll routine.
  */
-static void
-fec_enet_rx(struct net_device *dev)
+static int
+fec_enet_rx(struct net_device *dev, int budget)
 {
 	struct	fec_enet_private *fep = netdev_priv(dev);
 	struct  fec_ptp_private *fpp = fep->ptp_priv;
 	struct bufdesc *bdp;
 	unsigned short status;
-	struct	sk_buff	*skb;
+	struct	sk_buff	*skb, *new_skb;
 	ushort	pkt_len;
-	__u8 *data;
+	uint	index;
+	int	pkt_received = 0;
+	struct sk_buff_head rxq;
 
 #ifdef CONFIG_M532x
 	flush_cache_all();
 #endif
 
+	/* Frames are handed to the stack only after hw_lock is dropped:
+	 * netif_receive_skb() can transmit inline (ACKs, bridging) and
+	 * fec_enet_start_xmit() takes hw_lock itself.
+	 */
+	__skb_queue_head_init(&rxq);
+
 	spin_lock(&fep->hw_lock);
 
 	/* First, grab all of the stats for the incoming packet.
@@ -514,7 +693,9 @@ fec_enet_rx(struct net_device *dev)
 	 */
 	bdp = fep->cur_rx;
 
-	while (!((status = bdp->cbd_sc) & BD_ENET_RX_EMPTY)) {
+	while (pkt_received < budget &&
+	       !((status = bdp->cbd_sc) & BD_ENET_RX_EMPTY)) {
+		pkt_received++;
 
 		/* Since we have allocated space to hold a complete frame,
 		 * the last indicator should be set.
@@ -555,37 +736,63 @@ fec_enet_rx(struct net_device *dev)
 		dev->stats.rx_packets++;
 		pkt_len = bdp->cbd_datlen;
 		dev->stats.rx_bytes += pkt_len;
-		data = (__u8*)__va(bdp->cbd_bufaddr);
+		index = bdp - fep->rx_bd_base;
+		skb = fep->rx_skbuff[index];
 
-	        dma_unmap_single(NULL, bdp->cbd_bufaddr, bdp->cbd_datlen,
-        			DMA_FROM_DEVICE);
+		dma_sync_single_for_cpu(&dev->dev, bdp->cbd_bufaddr, pkt_len,
+				DMA_FROM_DEVICE);
 #ifdef CONFIG_ARCH_MXS
-		swap_buffer(data, pkt_len);
+		swap_buffer(skb->data, pkt_len);
 #endif
-		/* This does 16 byte alignment, exactly what we need.
-		 * The packet length includes FCS, but we don't want to
+		/* The packet length includes FCS, but we don't want to
 		 * include that when passing upstream as it messes up
 		 * bridging applications.
 		 */
-		skb = dev_alloc_skb(pkt_len - 4 + NET_IP_ALIGN);
+		if (pkt_len - 4 <= copybreak) {
+			/* Small frame, copy it and keep the ring buffer */
+			new_skb = netdev_alloc_skb_ip_align(dev, pkt_len - 4);
+			if (new_skb) {
+				skb_copy_to_linear_data(new_skb, skb->data,
+						pkt_len - 4);
+				skb_put(new_skb, pkt_len - 4);
+			}
+			dma_sync_single_for_device(&dev->dev, bdp->cbd_bufaddr,
+					pkt_len, DMA_FROM_DEVICE);
+			skb = new_skb;
+		} else {
+			/* Pass the ring buffer up and refill the slot.  If
+			 * no replacement is available the frame is dropped
+			 * and the old buffer stays in the ring.
+			 */
+			new_skb = fec_enet_rx_alloc(dev);
+			if (new_skb) {
+				dma_unmap_single(&dev->dev, bdp->cbd_bufaddr,
+					FEC_ENET_RX_FRSIZE, DMA_FROM_DEVICE);
+				fep->rx_skbuff[index] = new_skb;
+				bdp->cbd_bufaddr = dma_map_single(&dev->dev,
+					new_skb->data, FEC_ENET_RX_FRSIZE,
+					DMA_FROM_DEVICE);
+				skb_put(skb, pkt_len - 4);
+			} else {
+				dma_sync_single_for_device(&dev->dev,
+					bdp->cbd_bufaddr, pkt_len,
+					DMA_FROM_DEVICE);
+				skb = NULL;
+			}
+		}
 
 		if (unlikely(!skb)) {
 			printk("%s: Memory squeeze, dropping packet.\n",
 					dev->name);
 			dev->stats.rx_dropped++;
 		} else {
-			skb_reserve(skb, NET_IP_ALIGN);
-			skb_put(skb, pkt_len - 4);	/* Make room */
-			skb_copy_to_linear_data(skb, data, pkt_len - 4);
 			/* 1588 messeage TS handle */
 			if (fep->ptimer_present)
 				fec_ptp_store_rxstamp(fpp, skb, bdp);
 			skb->protocol = eth_type_trans(skb, dev);
-			netif_rx(skb);
+			__skb_queue_tail(&rxq, skb);
 		}
 
-        	bdp->cbd_bufaddr = dma_map_single(NULL, data, bdp->cbd_datlen,
-			DMA_FROM_DEVICE);
 rx_processing_done:
 		/* Clear the status flags for this buffer */
 		status &= ~BD_ENET_RX_STATS;
@@ -613,6 +820,11 @@ rx_processing_done:
 	fep->cur_rx = bdp;
 
 	spin_unlock(&fep->hw_lock);
+
+	while ((skb = __skb_dequeue(&rxq)))
+		netif_receive_skb(skb);
+
+	return pkt_received;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -922,11 +1134,109 @@ static u32 fec_enet_get_link(struct net_device *dev)
 		return (u32)(-EINVAL);
 }
 
+/*
+ * The controller has no interrupt coalescing logic of its own.  The
+ * usecs values are the time the frame interrupts stay masked after a
+ * NAPI poll drained the rings, rx for polls that received frames and
+ * tx for those that only reclaimed transmit descriptors.
+ */
+static int fec_enet_get_coalesce(struct net_device *dev,
+				 struct ethtool_coalesce *ec)
+{
+	struct fec_enet_private *fep = netdev_priv(dev);
+
+	ec->rx_coalesce_usecs = fep->rx_coalesce_usecs;
+	ec->tx_coalesce_usecs = fep->tx_coalesce_usecs;
+	return 0;
+}
+
+static int fec_enet_set_coalesce(struct net_device *dev,
+				 struct ethtool_coalesce *ec)
+{
+	struct fec_enet_private *fep = netdev_priv(dev);
+
+	if (ec->rx_coalesce_usecs > FEC_MAX_HOLDOFF_USECS ||
+	    ec->tx_coalesce_usecs > FEC_MAX_HOLDOFF_USECS)
+		return -EINVAL;
+
+	fep->rx_coalesce_usecs = ec->rx_coalesce_usecs;
+	fep->tx_coalesce_usecs = ec->tx_coalesce_usecs;
+	return 0;
+}
+
+static void fec_enet_get_ringparam(struct net_device *dev,
+				   struct ethtool_ringparam *ring)
+{
+	struct fec_enet_private *fep = netdev_priv(dev);
+
+	ring->rx_max_pending = FEC_RX_RING_MAX;
+	ring->tx_max_pending = FEC_TX_RING_MAX;
+	ring->rx_pending = fep->rx_ring_size;
+	ring->tx_pending = fep->tx_ring_size;
+}
+
+static int fec_enet_set_ringparam(struct net_device *dev,
+				  struct ethtool_ringparam *ring)
+{
+	struct fec_enet_private *fep = netdev_priv(dev);
+	uint rx_old = fep->rx_ring_size, tx_old = fep->tx_ring_size;
+	int running = netif_running(dev);
+	int ret = 0;
+
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+		return -EINVAL;
+	if (ring->rx_pending < FEC_RX_RING_MIN ||
+	    ring->rx_pending > FEC_RX_RING_MAX ||
+	    ring->tx_pending < FEC_TX_RING_MIN ||
+	    ring->tx_pending > FEC_TX_RING_MAX)
+		return -EINVAL;
+
+	if (running) {
+		napi_disable(&fep->napi);
+		hrtimer_cancel(&fep->holdoff_timer);
+		netif_tx_disable(dev);
+		/* Whack a reset so the DMA lets go of the buffers */
+		writel(1, fep->hwp + FEC_ECNTRL);
+		udelay(10);
+		fec_enet_free_buffers(dev);
+	}
+
+	fep->rx_ring_size = roundup_pow_of_two(ring->rx_pending);
+	fep->tx_ring_size = roundup_pow_of_two(ring->tx_pending);
+
+	if (running) {
+		ret = fec_enet_alloc_buffers(dev);
+		if (ret) {
+			/* Fall back to the rings we had */
+			fep->rx_ring_size = rx_old;
+			fep->tx_ring_size = tx_old;
+			if (fec_enet_alloc_buffers(dev)) {
+				/* No rings at all: bring the interface
+				 * down the normal way so ndo_stop finds
+				 * NAPI enabled as it expects.
+				 */
+				napi_enable(&fep->napi);
+				dev_close(dev);
+				return ret;
+			}
+		}
+		fec_restart(dev, fep->full_duplex);
+		napi_enable(&fep->napi);
+		netif_wake_queue(dev);
+	}
+
+	return ret;
+}
+
 static struct ethtool_ops fec_enet_ethtool_ops = {
 	.get_settings		= fec_enet_get_settings,
 	.set_settings		= fec_enet_set_settings,
 	.get_drvinfo		= fec_enet_get_drvinfo,
 	.get_link		= fec_enet_get_link,
+	.get_coalesce		= fec_enet_get_coalesce,
+	.set_coalesce		= fec_enet_set_coalesce,
+	.get_ringparam		= fec_enet_get_ringparam,
+	.set_ringparam		= fec_enet_set_ringparam,
 };
 
 static int fec_enet_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
@@ -934,6 +1244,12 @@ static int fec_enet_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 	struct fec_enet_private *fep = netdev_priv(dev);
 	struct phy_device *phydev = fep->phy_dev;
 
+	if (cmd == SIOCSHWTSTAMP) {
+		if (!fep->ptimer_present)
+			return -EOPNOTSUPP;
+		return fec_ptp_hwtstamp_ioctl(fep->ptp_priv, rq);
+	}
+
 	if (!netif_running(dev))
 		return -EINVAL;
 
@@ -951,20 +1267,30 @@ static void fec_enet_free_buffers(struct net_device *dev)
 	struct bufdesc	*bdp;
 
 	bdp = fep->rx_bd_base;
-	for (i = 0; i < RX_RING_SIZE; i++) {
+	for (i = 0; i < fep->rx_ring_size; i++) {
 		skb = fep->rx_skbuff[i];
 
 		if (bdp->cbd_bufaddr)
 			dma_unmap_single(&dev->dev, bdp->cbd_bufaddr,
 					FEC_ENET_RX_FRSIZE, DMA_FROM_DEVICE);
+		bdp->cbd_bufaddr = 0;
 		if (skb)
 			dev_kfree_skb(skb);
+		fep->rx_skbuff[i] = NULL;
 		bdp++;
 	}
 
 	bdp = fep->tx_bd_base;
-	for (i = 0; i < TX_RING_SIZE; i++)
+	for (i = 0; i < fep->tx_ring_size; i++) {
+		fec_enet_tx_unmap(dev, bdp);
+		if (fep->tx_skbuff[i]) {
+			dev_kfree_skb_any(fep->tx_skbuff[i]);
+			fep->tx_skbuff[i] = NULL;
+		}
 		kfree(fep->tx_bounce[i]);
+		fep->tx_bounce[i] = NULL;
+		bdp++;
+	}
 }
 
 static int fec_enet_alloc_buffers(struct net_device *dev)
@@ -975,8 +1301,8 @@ static int fec_enet_alloc_buffers(struct net_device *dev)
 	struct bufdesc	*bdp;
 
 	bdp = fep->rx_bd_base;
-	for (i = 0; i < RX_RING_SIZE; i++) {
-		skb = dev_alloc_skb(FEC_ENET_RX_FRSIZE);
+	for (i = 0; i < fep->rx_ring_size; i++) {
+		skb = fec_enet_rx_alloc(dev);
 		if (!skb) {
 			fec_enet_free_buffers(dev);
 			return -ENOMEM;
@@ -997,8 +1323,12 @@ static int fec_enet_alloc_buffers(struct net_device *dev)
 	bdp->cbd_sc |= BD_SC_WRAP;
 
 	bdp = fep->tx_bd_base;
-	for (i = 0; i < TX_RING_SIZE; i++) {
+	for (i = 0; i < fep->tx_ring_size; i++) {
 		fep->tx_bounce[i] = kmalloc(FEC_ENET_TX_FRSIZE, GFP_KERNEL);
+		if (!fep->tx_bounce[i]) {
+			fec_enet_free_buffers(dev);
+			return -ENOMEM;
+		}
 
 		bdp->cbd_sc = 0;
 		bdp->cbd_bufaddr = 0;
@@ -1036,6 +1366,7 @@ fec_enet_open(struct net_device *dev)
 		return ret;
 	}
 	phy_start(fep->phy_dev);
+	napi_enable(&fep->napi);
 	fec_restart(dev, fep->phy_dev->duplex);
 	fep->opened = 1;
 	return 0;
@@ -1048,6 +1379,11 @@ fec_enet_close(struct net_device *dev)
 
 	/* Don't know what to do yet. */
 	fep->opened = 0;
+	/* Quiesce the poll and the hold-off timer first so neither can
+	 * unmask interrupts behind fec_stop()'s back.
+	 */
+	napi_disable(&fep->napi);
+	hrtimer_cancel(&fep->holdoff_timer);
 	fec_stop(dev);
 
 	if (fep->phy_dev) {
@@ -1209,7 +1545,7 @@ static int fec_enet_init(struct net_device *dev, int index)
 	int i;
 
 	/* Allocate memory for buffer descriptors. */
-	cbd_base = dma_alloc_coherent(NULL, PAGE_SIZE, &fep->bd_dma,
+	cbd_base = dma_alloc_coherent(NULL, FEC_BD_MEM_SIZE, &fep->bd_dma,
 			GFP_KERNEL);
 	if (!cbd_base) {
 		printk("FEC: allocate descriptor memory failed?\n");
@@ -1218,6 +1554,15 @@ static int fec_enet_init(struct net_device *dev, int index)
 
 	spin_lock_init(&fep->hw_lock);
 
+	if (napi_weight <= 0)
+		napi_weight = FEC_NAPI_WEIGHT;
+	netif_napi_add(dev, &fep->napi, fec_enet_poll, napi_weight);
+	hrtimer_init(&fep->holdoff_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	fep->holdoff_timer.function = fec_enet_holdoff_timer;
+
+	fep->rx_ring_size = FEC_RX_RING_DEFAULT;
+	fep->tx_ring_size = FEC_TX_RING_DEFAULT;
+
 	fep->index = index;
 	fep->hwp = (void __iomem *)dev->base_addr;
 	fep->netdev = dev;
@@ -1227,16 +1572,23 @@ static int fec_enet_init(struct net_device *dev, int index)
 
 	/* Set receive and transmit descriptor base. */
 	fep->rx_bd_base = cbd_base;
-	fep->tx_bd_base = cbd_base + RX_RING_SIZE;
+	fep->tx_bd_base = cbd_base + FEC_RX_RING_MAX;
 
 	/* The FEC Ethernet specific entries in the device structure */
 	dev->watchdog_timeo = TX_TIMEOUT;
 	dev->netdev_ops = &fec_netdev_ops;
 	dev->ethtool_ops = &fec_enet_ethtool_ops;
+#ifndef CONFIG_ARCH_MXS
+	/* Fragments are mapped as they are; the checksum is done in
+	 * fec_enet_start_xmit() as the controller has no engine for it.
+	 * MXS byte swaps buffers in place, so it keeps linear frames.
+	 */
+	dev->features |= NETIF_F_SG | NETIF_F_HW_CSUM;
+#endif
 
 	/* Initialize the receive buffer descriptors. */
 	bdp = fep->rx_bd_base;
-	for (i = 0; i < RX_RING_SIZE; i++) {
+	for (i = 0; i < fep->rx_ring_size; i++) {
 
 		/* Initialize the BD for every fragment in the page. */
 		bdp->cbd_sc = 0;
@@ -1249,7 +1601,7 @@ static int fec_enet_init(struct net_device *dev, int index)
 
 	/* ...and the same for transmit */
 	bdp = fep->tx_bd_base;
-	for (i = 0; i < TX_RING_SIZE; i++) {
+	for (i = 0; i < fep->tx_ring_size; i++) {
 
 		/* Initialize the BD for every fragment in the page. */
 		bdp->cbd_sc = 0;
@@ -1274,6 +1626,7 @@ static void
 fec_restart(struct net_device *dev, int duplex)
 {
 	struct fec_enet_private *fep = netdev_priv(dev);
+	struct bufdesc *bdp;
 	int i;
 	uint ret = 0;
 	u32 temp_mac[2];
@@ -1305,15 +1658,18 @@ fec_restart(struct net_device *dev, int duplex)
 
 	/* Set receive and transmit descriptor base. */
 	writel(fep->bd_dma, fep->hwp + FEC_R_DES_START);
-	writel((unsigned long)fep->bd_dma + sizeof(struct bufdesc) * RX_RING_SIZE,
+	writel((unsigned long)fep->bd_dma + sizeof(struct bufdesc) * FEC_RX_RING_MAX,
 			fep->hwp + FEC_X_DES_START);
 
 	fep->dirty_tx = fep->cur_tx = fep->tx_bd_base;
 	fep->cur_rx = fep->rx_bd_base;
 
-	/* Reset SKB transmit buffers. */
-	fep->skb_cur = fep->skb_dirty = 0;
-	for (i = 0; i <= TX_RING_MOD_MASK; i++) {
+	/* Reset SKB transmit buffers and the descriptors still in flight. */
+	fep->tx_pending = 0;
+	for (i = 0; i < fep->tx_ring_size; i++) {
+		bdp = fep->tx_bd_base + i;
+		fec_enet_tx_unmap(dev, bdp);
+		bdp->cbd_sc &= BD_ENET_TX_WRAP;
 		if (fep->tx_skbuff[i]) {
 			dev_kfree_skb_any(fep->tx_skbuff[i]);
 			fep->tx_skbuff[i] = NULL;
@@ -29,6 +29,8 @@
 #include <linux/spinlock.h>
 #include <linux/ip.h>
 #include <linux/udp.h>
+#include <linux/net_tstamp.h>
+#include <linux/uaccess.h>
 #include "fec.h"
 #include "fec_1588.h"
 
@@ -252,11 +254,18 @@ static void fec_set_1588cnt(struct fec_ptp_private *priv,
 }
 
 /* Set the BD to ptp */
-int fec_ptp_do_txstamp(struct sk_buff *skb)
+int fec_ptp_do_txstamp(struct fec_ptp_private *priv, struct sk_buff *skb)
 {
 	struct iphdr *iph;
 	struct udphdr *udph;
 
+	if (priv->hwts_tx_en) {
+		if (!skb_tx(skb)->hardware)
+			return 0;
+		skb_tx(skb)->in_progress = 1;
+		return 1;
+	}
+
 	if (skb->len > 44) {
 		/* Check if port is 319 for PTP Event, and check for UDP */
 		iph = ip_hdr(skb);
@@ -271,6 +280,18 @@ int fec_ptp_do_txstamp(struct sk_buff *skb)
 	return 0;
 }
 
+/*
+ * The descriptor holds the nanoseconds of the stamp, the seconds come
+ * from the counter kept by the timer interrupt.
+ */
+static void fec_ptp_skb_stamp(struct fec_ptp_private *fpp,
+			      struct bufdesc *bdp,
+			      struct skb_shared_hwtstamps *hwts)
+{
+	memset(hwts, 0, sizeof(*hwts));
+	hwts->hwtstamp = ktime_set(fpp->prtc, bdp->ts);
+}
+
 void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
 			   struct sk_buff *skb,
 			   struct bufdesc *bdp)
@@ -278,6 +299,7 @@ void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
 	int msg_type, seq_id, control;
 	struct fec_ptp_data_t tmp_tx_time;
 	struct fec_ptp_private *fpp;
+	struct skb_shared_hwtstamps hwts;
 	unsigned char *sp_id;
 	unsigned short portnum;
 
@@ -286,6 +308,15 @@ void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
 	else
 		fpp = ptp_private[0];
 
+	/* SO_TIMESTAMPING: hand the stamp back on the socket error queue */
+	if (priv->hwts_tx_en) {
+		if (skb_tx(skb)->in_progress) {
+			fec_ptp_skb_stamp(fpp, bdp, &hwts);
+			skb_tstamp_tx(skb, &hwts);
+		}
+		return;
+	}
+
 	seq_id = *((u16 *)(skb->data + FEC_PTP_SEQ_ID_OFFS));
 	control = *((u8 *)(skb->data + FEC_PTP_CTRL_OFFS));
 	sp_id = skb->data + FEC_PTP_SPORT_ID_OFFS;
@@ -350,6 +381,12 @@ void fec_ptp_store_rxstamp(struct fec_ptp_private *priv,
 	else
 		fpp = ptp_private[0];
 
+	/* Every received frame is stamped, attach it for SO_TIMESTAMPING */
+	if (priv->hwts_rx_en) {
+		fec_ptp_skb_stamp(fpp, bdp, skb_hwtstamps(skb));
+		return;
+	}
+
 	/* Check for UDP, and Check if port is 319 for PTP Event */
 	iph = (struct iphdr *)(skb->data + FEC_PTP_IP_OFFS);
 	if (iph->protocol != FEC_PACKET_TYPE_UDP)
@@ -406,6 +443,48 @@ void fec_ptp_store_rxstamp(struct fec_ptp_private *priv,
 	wake_up_interruptible(&ptp_rx_ts_wait);
 }
 
+/*
+ * SIOCSHWTSTAMP.  The timer stamps every frame in both directions, so
+ * any receive filter is answered with HWTSTAMP_FILTER_ALL.  While
+ * enabled the stamps are delivered with the skb and the private
+ * timestamp queues behind /dev/ptp are no longer filled.
+ */
+int fec_ptp_hwtstamp_ioctl(struct fec_ptp_private *priv, struct ifreq *ifr)
+{
+	struct hwtstamp_config config;
+
+	if (copy_from_user(&config, ifr->ifr_data, sizeof(config)))
+		return -EFAULT;
+
+	/* reserved for future extensions */
+	if (config.flags)
+		return -EINVAL;
+
+	switch (config.tx_type) {
+	case HWTSTAMP_TX_OFF:
+		priv->hwts_tx_en = 0;
+		break;
+	case HWTSTAMP_TX_ON:
+		priv->hwts_tx_en = 1;
+		break;
+	default:
+		return -ERANGE;
+	}
+
+	switch (config.rx_filter) {
+	case HWTSTAMP_FILTER_NONE:
+		priv->hwts_rx_en = 0;
+		break;
+	default:
+		priv->hwts_rx_en = 1;
+		config.rx_filter = HWTSTAMP_FILTER_ALL;
+		break;
+	}
+
+	return copy_to_user(ifr->ifr_data, &config, sizeof(config)) ?
+		-EFAULT : 0;
+}
+
 static uint8_t fec_get_tx_timestamp(struct fec_ptp_private *priv,
 				    struct ptp_ts_data *pts,
 				    struct ptp_time *tx_time)
@@ -168,6 +168,10 @@ struct fec_ptp_private {
 	u8	ptp_active;
 	u8	ptp_slave;
 	struct circ_buf	txstamp;
+
+	/* SIOCSHWTSTAMP state, stamps go to the skb instead of the queues */
+	u8	hwts_tx_en;
+	u8	hwts_rx_en;
 };
 
 #ifdef CONFIG_FEC_1588
@@ -180,13 +184,16 @@ extern int fec_ptp_init(struct fec_ptp_private *priv, int id);
 extern void fec_ptp_cleanup(struct fec_ptp_private *priv);
 extern int fec_ptp_start(struct fec_ptp_private *priv);
 extern void fec_ptp_stop(struct fec_ptp_private *priv);
-extern int fec_ptp_do_txstamp(struct sk_buff *skb);
+extern int fec_ptp_do_txstamp(struct fec_ptp_private *priv,
+			      struct sk_buff *skb);
 extern void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
 				  struct sk_buff *skb,
 				  struct bufdesc *bdp);
 extern void fec_ptp_store_rxstamp(struct fec_ptp_private *priv,
 				  struct sk_buff *skb,
 				  struct bufdesc *bdp);
+extern int fec_ptp_hwtstamp_ioctl(struct fec_ptp_private *priv,
+				  struct ifreq *ifr);
 #else
 static inline int fec_ptp_malloc_priv(struct fec_ptp_private **priv)
 {
@@ -202,7 +209,8 @@ static inline int fec_ptp_start(struct fec_ptp_private *priv)
 	return 1;
 }
 static inline void fec_ptp_stop(struct fec_ptp_private *priv) {}
-static inline int fec_ptp_do_txstamp(struct sk_buff *skb)
+static inline int fec_ptp_do_txstamp(struct fec_ptp_private *priv,
+				     struct sk_buff *skb)
 {
 	return 0;
 }
@@ -212,6 +220,11 @@ static inline void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
 static inline void fec_ptp_store_rxstamp(struct fec_ptp_private *priv,
 					 struct sk_buff *skb,
 					 struct bufdesc *bdp) {}
+static inline int fec_ptp_hwtstamp_ioctl(struct fec_ptp_private *priv,
+					 struct ifreq *ifr)
+{
+	return -EOPNOTSUPP;
+}
 #endif /* 1588 */
 
 #endif
@@ -44,6 +44,7 @@
 #include <linux/udp.h>
 #include <linux/io.h>
 #include <linux/uaccess.h>
+#include <linux/net_tstamp.h>
 #include <asm/irq.h>
 #include <asm/system.h>
 #include <asm/byteorder.h>
@@ -529,6 +530,54 @@ static void init_ptp_parser(struct ptp *p_ptp)
 	writel(reg32, mem_map + PTP_TSPOV);
 }
 
+/*
+ * Tx timestamp of the frame just sent: the PTP interrupt may already
+ * have moved it to the txstamp queue, otherwise it is still in the
+ * timestamp registers.
+ */
+static void fec_ptp_read_txstamp(struct fec_ptp_private *priv,
+				 struct ptp_time *ts)
+{
+	struct fec_ptp_data_t tmp;
+	struct ptp *p_ptp = ptp_dev;
+	u64 timestamp;
+
+	memset(&tmp, 0, sizeof(struct fec_ptp_data_t));
+	tmp.key = SEQ_ID_OUT_OF_BAND;
+	if (!fec_ptp_find_and_remove(&(priv->txstamp), &tmp,
+				priv, DEFAULT_PTP_TX_BUF_SZ)) {
+		ts->sec = tmp.ts_time.sec;
+		ts->nsec = tmp.ts_time.nsec;
+	} else {
+		/*read timestamp from register*/
+		timestamp = ((u64)readl(p_ptp->mem_map + PTP_TMR_TXTS_H)
+				<< 32) |
+			(readl(p_ptp->mem_map + PTP_TMR_TXTS_L));
+		convert_rtc_time(&timestamp, ts);
+	}
+}
+
+static void fec_ptp_skb_stamp(struct ptp_time *ts,
+			      struct skb_shared_hwtstamps *hwts)
+{
+	memset(hwts, 0, sizeof(*hwts));
+	hwts->hwtstamp = ktime_set(ts->sec, ts->nsec);
+}
+
+/* SO_TIMESTAMPING: hand the stamp back on the socket error queue */
+static void fec_ptp_tx_hwtstamp(struct fec_ptp_private *priv,
+				struct sk_buff *skb)
+{
+	struct skb_shared_hwtstamps hwts;
+	struct ptp_time ts;
+
+	if (!skb_tx(skb)->in_progress)
+		return;
+	fec_ptp_read_txstamp(priv, &ts);
+	fec_ptp_skb_stamp(&ts, &hwts);
+	skb_tstamp_tx(skb, &hwts);
+}
+
 /* compatible with MXS 1588 */
 #ifdef CONFIG_IN_BAND
 void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
@@ -536,34 +585,21 @@ void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
 			   struct bufdesc *bdp)
 {
 	int msg_type, seq_id, control;
-	struct fec_ptp_data_t tmp_tx_time, tmp;
-	struct fec_ptp_private *fpp = priv;
-	struct ptp *p_ptp = ptp_dev;
-	int flag;
+	struct fec_ptp_data_t tmp_tx_time;
 	unsigned char *sp_id;
 	unsigned short portnum;
-	u64 timestamp;
 
 	/* Check for PTP Event */
 	if ((bdp->cbd_sc & BD_ENET_TX_PTP) == 0)
 		return;
 
-	/* Get ts from tx ts queue */
-	memset(&tmp, 0, sizeof(struct fec_ptp_data_t));
-	tmp.key = SEQ_ID_OUT_OF_BAND;
-	flag = fec_ptp_find_and_remove(&(priv->txstamp), &tmp,
-				priv, DEFAULT_PTP_TX_BUF_SZ);
-	if (!flag) {
-		tmp_tx_time.ts_time.sec = tmp.ts_time.sec;
-		tmp_tx_time.ts_time.nsec = tmp.ts_time.nsec;
-	} else {
-		/*read timestamp from register*/
-		timestamp = ((u64)readl(p_ptp->mem_map + PTP_TMR_TXTS_H)
-				<< 32) |
-			(readl(p_ptp->mem_map + PTP_TMR_TXTS_L));
-		convert_rtc_time(&timestamp, &(tmp_tx_time.ts_time));
+	if (priv->hwts_tx_en) {
+		fec_ptp_tx_hwtstamp(priv, skb);
+		return;
 	}
 
+	fec_ptp_read_txstamp(priv, &(tmp_tx_time.ts_time));
+
 	seq_id = *((u16 *)(skb->data + FEC_PTP_SEQ_ID_OFFS));
 	control = *((u8 *)(skb->data + FEC_PTP_CTRL_OFFS));
 	sp_id = skb->data + FEC_PTP_SPORT_ID_OFFS;
@@ -609,10 +645,16 @@ void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
 	wake_up_interruptible(&ptp_tx_ts_wait);
 }
 #else
+/*
+ * Out-of-band: /dev/ptp users collect the stamps from the queues the
+ * PTP interrupt fills, only SO_TIMESTAMPING needs them per frame.
+ */
 void fec_ptp_store_txstamp(struct fec_ptp_private *priv,
 			   struct sk_buff *skb,
 			   struct bufdesc *bdp)
 {
+	if ((bdp->cbd_sc & BD_ENET_TX_PTP) && priv->hwts_tx_en)
+		fec_ptp_tx_hwtstamp(priv, skb);
 }
 #endif
 
@@ -713,6 +755,12 @@ void fec_ptp_store_rxstamp(struct fec_ptp_private *priv,
 	convert_rtc_time(&timestamp, &(tmp_rx_time.ts_time));
 	skb_pull(skb, 8);
 
+	/* SO_TIMESTAMPING: the stamp goes up with the frame */
+	if (priv->hwts_rx_en) {
+		fec_ptp_skb_stamp(&(tmp_rx_time.ts_time), skb_hwtstamps(skb));
+		return;
+	}
+
 	seq_id = *((u16 *)(skb->data + FEC_PTP_SEQ_ID_OFFS));
 	control = *((u8 *)(skb->data + FEC_PTP_CTRL_OFFS));
 	sp_id = skb->data + FEC_PTP_SPORT_ID_OFFS;
@@ -1122,8 +1170,12 @@ static void rtc_modify_frequency_compensation(
 	writel(freq_compensation, rtc->mem_map + PTP_TMR_ADD);
 }
 
-/* Set the BD to ptp */
-int fec_ptp_do_txstamp(struct sk_buff *skb)
+/*
+ * Set the BD to ptp.  The timer only stamps PTP event messages, so with
+ * SO_TIMESTAMPING on just the ones the socket asked a stamp for are
+ * marked.
+ */
+int fec_ptp_do_txstamp(struct fec_ptp_private *priv, struct sk_buff *skb)
 {
 	struct iphdr *iph;
 	struct udphdr *udph;
@@ -1135,13 +1187,78 @@ int fec_ptp_do_txstamp(struct sk_buff *skb)
 			return 0;
 
 		udph = udp_hdr(skb);
-		if (udph != NULL && ntohs(udph->dest) == 319)
-			return 1;
+		if (udph == NULL || ntohs(udph->dest) != 319)
+			return 0;
+
+		if (priv->hwts_tx_en) {
+			if (!skb_tx(skb)->hardware)
+				return 0;
+			skb_tx(skb)->in_progress = 1;
+		}
+		return 1;
 	}
 
 	return 0;
 }
 
+/*
+ * SIOCSHWTSTAMP.  Only PTP event messages over UDP are stamped, so the
+ * receive filters are widened to the L4 event filter of the version
+ * asked for.  Out-of-band the Rx stamp sits in a register rather than
+ * with the frame and cannot be attached to the skb, so only Tx
+ * stamping is offered there.  While enabled, the private timestamp
+ * queues behind /dev/ptp are no longer filled.
+ */
+int fec_ptp_hwtstamp_ioctl(struct fec_ptp_private *priv, struct ifreq *ifr)
+{
+	struct hwtstamp_config config;
+	u8 tx_en, rx_en = 1;
+
+	if (copy_from_user(&config, ifr->ifr_data, sizeof(config)))
+		return -EFAULT;
+
+	/* reserved for future extensions */
+	if (config.flags)
+		return -EINVAL;
+
+	switch (config.tx_type) {
+	case HWTSTAMP_TX_OFF:
+		tx_en = 0;
+		break;
+	case HWTSTAMP_TX_ON:
+		tx_en = 1;
+		break;
+	default:
+		return -ERANGE;
+	}
+
+	switch (config.rx_filter) {
+	case HWTSTAMP_FILTER_NONE:
+		rx_en = 0;
+		break;
+#ifdef CONFIG_IN_BAND
+	case HWTSTAMP_FILTER_PTP_V1_L4_EVENT:
+	case HWTSTAMP_FILTER_PTP_V1_L4_SYNC:
+	case HWTSTAMP_FILTER_PTP_V1_L4_DELAY_REQ:
+		config.rx_filter = HWTSTAMP_FILTER_PTP_V1_L4_EVENT;
+		break;
+	case HWTSTAMP_FILTER_PTP_V2_L4_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_L4_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_L4_DELAY_REQ:
+		config.rx_filter = HWTSTAMP_FILTER_PTP_V2_L4_EVENT;
+		break;
+#endif
+	default:
+		return -ERANGE;
+	}
+
+	priv->hwts_tx_en = tx_en;
+	priv->hwts_rx_en = rx_en;
+
+	return copy_to_user(ifr->ifr_data, &config, sizeof(config)) ?
+		-EFAULT : 0;
+}
+
 static int fec_get_tx_timestamp(struct fec_ptp_private *priv,
 				 struct ptp_ts_data *pts,
 				 struct ptp_time *tx_time)
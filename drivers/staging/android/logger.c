@@ -25,6 +25,9 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/io.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,17 +36,21 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Positions in the log ('w_pos', 'head' and each reader's 'r_pos') are byte
+ * counts that only ever grow; logger_offset() turns them into an index into
+ * the ring. Writers are serialized by 'mutex'. Readers take no log-wide lock:
+ * they copy an entry out and then check that 'head' has not moved past it,
+ * which tells them a writer lapped them while they were copying.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex serializing writers */
+	size_t			w_pos;	/* end of the last complete entry */
+	size_t			head;	/* oldest entry; new readers start here */
 	size_t			size;	/* size of the log */
 };
 
@@ -51,12 +58,13 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by reader->mutex.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes reads on this file */
+	size_t			r_pos;	/* current read position */
+	int			batch;	/* read() returns as many entries as fit */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -89,7 +97,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Readers must check with reader_lapped() that the result is still valid.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,16 +116,47 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * reader_start - returns where 'reader' has to continue reading: its own
+ * position, or the oldest entry if a writer lapped it.
+ */
+static size_t reader_start(struct logger_log *log,
+			   struct logger_reader *reader)
+{
+	size_t head = ACCESS_ONCE(log->head);
+
+	if ((long) (reader->r_pos - head) < 0)
+		return head;
+	return reader->r_pos;
+}
+
+/*
+ * reader_lapped - did a writer overwrite the entry at 'pos' since we started
+ * looking at it? Call after reading the entry from the ring.
+ */
+static int reader_lapped(struct logger_log *log, size_t pos)
+{
+	smp_rmb();
+	return (long) (pos - ACCESS_ONCE(log->head)) < 0;
+}
+
+/*
+ * reader_empty - is there nothing left for 'reader' to read?
+ */
+static int reader_empty(struct logger_log *log, struct logger_reader *reader)
+{
+	return reader_start(log, reader) == ACCESS_ONCE(log->w_pos);
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes starting at 'pos' from
+ * 'log' into the user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * The caller must check reader_lapped() afterwards.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t pos,
+				   char __user *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
 	/*
@@ -125,8 +164,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,11 +176,50 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * read_one_entry - copy the entry at the reader's position to 'buf' and move
+ * the reader past it.
+ *
+ * Returns the length of the entry, 0 if there is nothing to read, or -EINVAL
+ * if the entry does not fit in 'count' bytes.
+ */
+static ssize_t read_one_entry(struct logger_log *log,
+			      struct logger_reader *reader,
+			      char __user *buf, size_t count)
+{
+	size_t r_pos;
+	ssize_t ret;
+
+retry:
+	r_pos = reader_start(log, reader);
+	if (r_pos == ACCESS_ONCE(log->w_pos))
+		return 0;
+
+	/* pairs with the smp_wmb() before a writer publishes w_pos */
+	smp_rmb();
+
+	/* get the size of the next entry */
+	ret = get_entry_len(log, logger_offset(r_pos));
+	if (reader_lapped(log, r_pos))
+		goto retry;
+	if (count < ret)
+		return -EINVAL;
+
+	/* get exactly one entry from the log */
+	ret = do_read_log_to_user(log, r_pos, buf, ret);
+	if (ret < 0)
+		return ret;
+	if (reader_lapped(log, r_pos))
+		goto retry;
+
+	reader->r_pos = r_pos + ret;
+
+	return ret;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -149,7 +227,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or as many whole entries as
+ * 	  fit in the buffer after LOGGER_SET_BATCH_READ
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -159,16 +238,16 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
-	ssize_t ret;
+	ssize_t ret, nr;
 	DEFINE_WAIT(wait);
 
+	mutex_lock(&reader->mutex);
+
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = reader_empty(log, reader);
 		if (!ret)
 			break;
 
@@ -182,137 +261,113 @@ start:
 			break;
 		}
 
+		mutex_unlock(&reader->mutex);
 		schedule();
+		mutex_lock(&reader->mutex);
 	}
 
 	finish_wait(&log->wq, &wait);
 	if (ret)
-		return ret;
-
-	mutex_lock(&log->mutex);
+		goto out;
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
+	do {
+		nr = read_one_entry(log, reader, buf + ret, count - ret);
+		if (nr <= 0)
+			break;
+		ret += nr;
+	} while (reader->batch);
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+	if (!ret) {
+		/* a flush can leave a lapped reader with nothing to read */
+		if (!nr)
+			goto start;
+		ret = nr;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * get_next_entry - return the position of the first valid entry at least
+ * 'len' bytes after 'pos'.
  *
  * Caller must hold log->mutex.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static size_t get_next_entry(struct logger_log *log, size_t pos, size_t len)
 {
 	size_t count = 0;
 
 	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
+		size_t nr = get_entry_len(log, logger_offset(pos));
+		pos += nr;
 		count += nr;
 	} while (count < len);
 
-	return off;
-}
-
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
-
-	return 0;
+	return pos;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * fix_up_head - pull the start head forward to the first entry that
+ * survives writing 'len' more bytes. Readers behind the head notice on
+ * their own; we never have to look at them.
  *
  * The caller needs to hold log->mutex.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void fix_up_head(struct logger_log *log, size_t len)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	size_t new = log->w_pos + len;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
-
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	if (new - log->head > log->size) {
+		log->head = get_next_entry(log, log->head,
+					   new - log->size - log->head);
+		/* readers must see the new head before the data it covers */
+		smp_wmb();
+	}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at position 'pos'
  *
  * The caller needs to hold log->mutex.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t pos,
+			 const void *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * the log 'log' at position 'pos'
  *
  * The caller needs to hold log->mutex.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t pos,
 				      const void __user *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
@@ -320,14 +375,17 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is only published by moving w_pos once it is complete, so
+ * readers never see a partial entry and a failed copy needs no rollback.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t pos;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -345,14 +403,16 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	mutex_lock(&log->mutex);
 
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Pull the head forward to the first readable entry after (what will
+	 * be) the new write position. We do this now because if we partially
+	 * fail, we can end up with clobbered log entries that encroach on
+	 * readable buffer.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	fix_up_head(log, sizeof(struct logger_entry) + header.len);
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	pos = log->w_pos;
+	do_write_log(log, pos, &header, sizeof(struct logger_entry));
+	pos += sizeof(struct logger_entry);
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -362,21 +422,27 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, pos, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
 			mutex_unlock(&log->mutex);
 			return nr;
 		}
 
 		iov++;
+		pos += nr;
 		ret += nr;
 	}
 
+	/* publish the entry only once all of it is in the ring */
+	smp_wmb();
+	log->w_pos = pos;
+
 	mutex_unlock(&log->mutex);
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
 	return ret;
 }
@@ -409,12 +475,9 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_pos = ACCESS_ONCE(log->head);
+		reader->batch = 0;
 
 		file->private_data = reader;
 	} else
@@ -432,13 +495,68 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
 		kfree(reader);
 	}
 
 	return 0;
 }
 
+/*
+ * set_cursor - move 'reader' forward to 'new_pos', which must be the start
+ * of an entry between its position and w_pos. Anything else would make
+ * read() take payload bytes for an entry header.
+ *
+ * Called with reader->mutex held.
+ */
+static long set_cursor(struct logger_log *log, struct logger_reader *reader,
+		       __u32 new_pos)
+{
+	size_t r_pos, pos, end;
+
+retry:
+	r_pos = reader_start(log, reader);
+	/* only move forward, and never past the last entry */
+	if ((__u32) (new_pos - r_pos) > ACCESS_ONCE(log->w_pos) - r_pos)
+		return -EINVAL;
+	end = r_pos + (__u32) (new_pos - r_pos);
+
+	/* pairs with the smp_wmb() before a writer publishes w_pos */
+	smp_rmb();
+	pos = r_pos;
+	while ((long) (end - pos) > 0)
+		pos += get_entry_len(log, logger_offset(pos));
+	if (reader_lapped(log, r_pos))
+		goto retry;
+	if (pos != end)
+		return -EINVAL;
+
+	reader->r_pos = end;
+	return 0;
+}
+
+/*
+ * logger_mmap - map the log read-only into a reader's address space
+ *
+ * Readers walk the mapping with the positions from LOGGER_GET_CURSOR and
+ * hand back how far they got with LOGGER_SET_CURSOR, which saves copying
+ * every entry through read().
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EACCES;
+	if (vma->vm_pgoff || size > PAGE_ALIGN(log->size))
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, log->buffer, 0);
+}
+
 /*
  * logger_poll - the log's poll file operation, for poll/select/epoll
  *
@@ -462,10 +580,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (!reader_empty(log, reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
@@ -474,10 +590,11 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_cursor cursor;
+	size_t r_pos;
+	__u32 new_pos;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -488,10 +605,17 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		r_pos = reader_start(log, reader);
+		smp_rmb();
+		/*
+		 * A flush or a writer making room can move head, and so
+		 * r_pos, past the w_pos we read; that log is empty.
+		 */
+		ret = (long) (ACCESS_ONCE(log->w_pos) - r_pos);
+		if (ret < 0)
+			ret = 0;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,25 +623,71 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		mutex_lock(&reader->mutex);
+		do {
+			r_pos = reader_start(log, reader);
+			if (r_pos == ACCESS_ONCE(log->w_pos)) {
+				ret = 0;
+				break;
+			}
+			smp_rmb();
+			ret = get_entry_len(log, logger_offset(r_pos));
+		} while (reader_lapped(log, r_pos));
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
+		break;
+	case LOGGER_GET_CURSOR:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		cursor.w_pos = ACCESS_ONCE(log->w_pos);
+		cursor.r_pos = reader_start(log, reader);
+		cursor.head = ACCESS_ONCE(log->head);
+		mutex_unlock(&reader->mutex);
+		/* pairs with the smp_wmb() before a writer publishes w_pos */
+		smp_rmb();
+		ret = 0;
+		if (copy_to_user((void __user *) arg, &cursor, sizeof(cursor)))
+			ret = -EFAULT;
+		break;
+	case LOGGER_SET_CURSOR:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		if (get_user(new_pos, (__u32 __user *) arg)) {
+			ret = -EFAULT;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		ret = set_cursor(log, reader, new_pos);
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* every reader is now behind the head and skips to w_pos */
+		mutex_lock(&log->mutex);
+		log->head = log->w_pos;
+		mutex_unlock(&log->mutex);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -526,6 +696,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -535,12 +706,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer is allocated by init_log()
+ * with vmalloc_user() so that readers can mmap() it.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -548,9 +718,8 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
+	.w_pos = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -577,10 +746,19 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->buffer = vmalloc_user(log->size);
+	if (unlikely(!log->buffer)) {
+		printk(KERN_ERR "logger: failed to allocate log '%s'!\n",
+		       log->misc.name);
+		return -ENOMEM;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->buffer);
+		log->buffer = NULL;
 		return ret;
 	}
 
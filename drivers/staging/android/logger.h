@@ -30,6 +30,21 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_cursor - positions in the log, for readers that mmap() it
+ *
+ * Positions are free-running byte counts; an entry at position 'pos' starts
+ * at offset (pos & (buffer size - 1)) of the mapping. Entries in [head, w_pos)
+ * are valid, but a writer may overwrite the oldest of them at any time, so
+ * after copying an entry out of the mapping a reader must fetch the cursor
+ * again and discard the copy if 'head' has moved past it.
+ */
+struct logger_cursor {
+	__u32		head;	/* oldest entry still in the log */
+	__u32		w_pos;	/* end of the newest entry */
+	__u32		r_pos;	/* this reader's position */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +60,8 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* many per read() */
+#define LOGGER_GET_CURSOR	_IOR(__LOGGERIO, 6, struct logger_cursor)
+#define LOGGER_SET_CURSOR	_IOW(__LOGGERIO, 7, __u32) /* r_pos to an entry */
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,19 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * A process is sized by its resident plus swapped-out pages. When memory is
+ * low, up to max_kills processes are killed in one pass, highest oom_adj and
+ * largest first, until the pages they free should lift free memory back
+ * above the minfree level that triggered. No new pass starts until those
+ * processes are gone, or a second has passed.
+ *
+ * To let user-space shed memory before anything gets killed, write a comma
+ * separated list of page counts in ascending order to
+ * /sys/module/lowmemorykiller/parameters/notify_minfree, usually above the
+ * minfree values. /dev/lowmem_notify then becomes readable whenever free
+ * memory drops below another of these thresholds, and read() returns an int:
+ * the number of thresholds that free memory is currently below.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  * Copyright (C) 2011 Freescale Semiconductor, Inc.
  *
@@ -36,6 +49,14 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/vmstat.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -52,8 +73,21 @@ static size_t lowmem_minfree[6] = {
 	16 * 1024,	/* 64MB */
 };
 static int lowmem_minfree_size = 4;
+static size_t lowmem_notify_minfree[6];
+static int lowmem_notify_minfree_size;
+
+#define LOWMEM_MAX_KILLS	8
 
-static struct task_struct *lowmem_deathpending;
+static int lowmem_max_kills = 4;
+
+/*
+ * Processes we have sent SIGKILL and are waiting on. The pointers are only
+ * compared against tasks being freed, never dereferenced.
+ */
+static struct task_struct *lowmem_deathpending[LOWMEM_MAX_KILLS];
+static int lowmem_nr_deathpending;
+static unsigned long lowmem_deathpending_timeout;
+static DEFINE_SPINLOCK(lowmem_deathpending_lock);
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -72,35 +106,230 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
-	if (task == lowmem_deathpending) {
-		lowmem_deathpending = NULL;
-		task_free_unregister(&task_nb);
+	unsigned long flags;
+	int i;
+
+	if (!ACCESS_ONCE(lowmem_nr_deathpending))
+		return NOTIFY_OK;
+
+	spin_lock_irqsave(&lowmem_deathpending_lock, flags);
+	for (i = 0; i < LOWMEM_MAX_KILLS; i++) {
+		if (lowmem_deathpending[i] == task) {
+			lowmem_deathpending[i] = NULL;
+			lowmem_nr_deathpending--;
+			break;
+		}
 	}
+	spin_unlock_irqrestore(&lowmem_deathpending_lock, flags);
 	return NOTIFY_OK;
 }
 
+/*
+ * If we already have deaths outstanding, bail out right away, indicating to
+ * vmscan that we have nothing further to offer on this pass. A victim that
+ * takes longer than a second to die is given up on so that we can pick
+ * another one.
+ */
+static int lowmem_death_pending(void)
+{
+	unsigned long flags;
+	int pending;
+
+	spin_lock_irqsave(&lowmem_deathpending_lock, flags);
+	pending = lowmem_nr_deathpending;
+	if (pending && time_after(jiffies, lowmem_deathpending_timeout)) {
+		memset(lowmem_deathpending, 0, sizeof(lowmem_deathpending));
+		lowmem_nr_deathpending = 0;
+		pending = 0;
+	}
+	spin_unlock_irqrestore(&lowmem_deathpending_lock, flags);
+
+	return pending;
+}
+
+static void lowmem_add_deathpending(struct task_struct *task)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&lowmem_deathpending_lock, flags);
+	for (i = 0; i < LOWMEM_MAX_KILLS; i++) {
+		if (!lowmem_deathpending[i]) {
+			lowmem_deathpending[i] = task;
+			lowmem_nr_deathpending++;
+			break;
+		}
+	}
+	lowmem_deathpending_timeout = jiffies + HZ;
+	spin_unlock_irqrestore(&lowmem_deathpending_lock, flags);
+}
+
+/*
+ * Pressure notification. lowmem_notify_level is the number of notify_minfree
+ * thresholds that both free and file pages were below when last looked at;
+ * every rise bumps lowmem_notify_seq and wakes up pollers. The shrinker
+ * raises the level. While it is above zero, lowmem_notify_work looks again
+ * every second, so the level drops once reclaim has stopped and the next
+ * pressure episode is reported.
+ */
+static int lowmem_notify_level;
+static unsigned int lowmem_notify_seq;
+static DEFINE_SPINLOCK(lowmem_notify_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_notify_wq);
+static struct delayed_work lowmem_notify_work;
+
+static int lowmem_notify_get_level(int other_free, int other_file)
+{
+	int level = 0;
+	int i;
+
+	for (i = lowmem_notify_minfree_size - 1; i >= 0; i--) {
+		if (other_free < lowmem_notify_minfree[i] &&
+		    other_file < lowmem_notify_minfree[i])
+			level++;
+	}
+	return level;
+}
+
+static void lowmem_notify_update(int other_free, int other_file)
+{
+	int level = lowmem_notify_get_level(other_free, other_file);
+	unsigned long flags;
+	int old;
+
+	spin_lock_irqsave(&lowmem_notify_lock, flags);
+	old = lowmem_notify_level;
+	lowmem_notify_level = level;
+	if (level > old)
+		lowmem_notify_seq++;
+	spin_unlock_irqrestore(&lowmem_notify_lock, flags);
+
+	if (level > old)
+		wake_up_interruptible(&lowmem_notify_wq);
+	if (level)
+		schedule_delayed_work(&lowmem_notify_work, HZ);
+}
+
+static void lowmem_notify_recheck(struct work_struct *work)
+{
+	lowmem_notify_update(global_page_state(NR_FREE_PAGES),
+			     global_page_state(NR_FILE_PAGES));
+}
+
+static int lowmem_notify_open(struct inode *inode, struct file *file)
+{
+	/* only pressure rising after open() is reported */
+	file->private_data = (void *)(unsigned long)
+		ACCESS_ONCE(lowmem_notify_seq);
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t lowmem_notify_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *pos)
+{
+	unsigned int seen = (unsigned long) file->private_data;
+	unsigned int seq;
+	int level;
+	int ret;
+
+	if (count < sizeof(level))
+		return -EINVAL;
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (ACCESS_ONCE(lowmem_notify_seq) == seen)
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(lowmem_notify_wq,
+				ACCESS_ONCE(lowmem_notify_seq) != seen);
+		if (ret)
+			return ret;
+	}
+
+	seq = ACCESS_ONCE(lowmem_notify_seq);
+	smp_rmb();
+	level = lowmem_notify_get_level(global_page_state(NR_FREE_PAGES),
+					global_page_state(NR_FILE_PAGES));
+	if (copy_to_user(buf, &level, sizeof(level)))
+		return -EFAULT;
+	file->private_data = (void *)(unsigned long) seq;
+
+	return sizeof(level);
+}
+
+static unsigned int lowmem_notify_poll(struct file *file, poll_table *wait)
+{
+	unsigned int seen = (unsigned long) file->private_data;
+
+	poll_wait(file, &lowmem_notify_wq, wait);
+	if (ACCESS_ONCE(lowmem_notify_seq) != seen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_notify_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_notify_open,
+	.read = lowmem_notify_read,
+	.poll = lowmem_notify_poll,
+};
+
+static struct miscdevice lowmem_notify_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_notify",
+	.fops = &lowmem_notify_fops,
+};
+
+struct lowmem_victim {
+	struct task_struct *task;
+	int oom_adj;
+	int tasksize;
+};
+
+/*
+ * Insert a candidate into 'v', which holds the best 'nr' candidates so far
+ * ordered by oom_adj and then size, both descending.
+ */
+static int lowmem_add_victim(struct lowmem_victim *v, int nr, int max,
+			     struct task_struct *p, int oom_adj, int tasksize)
+{
+	int i;
+
+	for (i = nr; i > 0; i--) {
+		if (v[i - 1].oom_adj > oom_adj ||
+		    (v[i - 1].oom_adj == oom_adj &&
+		     v[i - 1].tasksize >= tasksize))
+			break;
+		if (i < max)
+			v[i] = v[i - 1];
+	}
+	if (i == max)
+		return nr;
+
+	v[i].task = p;
+	v[i].oom_adj = oom_adj;
+	v[i].tasksize = tasksize;
+	return nr < max ? nr + 1 : nr;
+}
+
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
-	struct task_struct *selected = NULL;
+	struct lowmem_victim victims[LOWMEM_MAX_KILLS];
+	int nr_victims = 0;
+	int max_kills;
 	int rem = 0;
 	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int target = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
+	ktime_t start;
+
+	lowmem_notify_update(other_free, other_file);
 
-	/*
-	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
-	 */
-	if (lowmem_deathpending)
+	if (lowmem_death_pending())
 		return 0;
 
 	if (lowmem_adj_size < array_size)
@@ -111,6 +340,7 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
 			min_adj = lowmem_adj[i];
+			target = lowmem_minfree[i] - other_free;
 			break;
 		}
 	}
@@ -127,14 +357,18 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
+	max_kills = clamp(lowmem_max_kills, 1, LOWMEM_MAX_KILLS);
+	start = ktime_get();
+
+	rcu_read_lock();
 	for_each_process(p) {
 		struct mm_struct *mm;
 		struct signal_struct *sig;
 		int oom_adj;
 
+		if (p->flags & PF_EXITING)
+			continue;
 		task_lock(p);
 		mm = p->mm;
 		sig = p->signal;
@@ -147,35 +381,35 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			task_unlock(p);
 			continue;
 		}
-		tasksize = get_mm_rss(mm);
+		tasksize = get_mm_rss(mm) + get_mm_counter(mm, MM_SWAPENTS);
 		task_unlock(p);
 		if (tasksize <= 0)
 			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+		nr_victims = lowmem_add_victim(victims, nr_victims, max_kills,
+					       p, oom_adj, tasksize);
+		lowmem_print(3, "candidate %d (%s), adj %d, size %d\n",
 			     p->pid, p->comm, oom_adj, tasksize);
 	}
-	if (selected) {
+	for (i = 0; i < nr_victims && target > 0; i++) {
+		struct lowmem_victim *v = &victims[i];
+
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		task_free_register(&task_nb);
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
+			     v->task->pid, v->task->comm,
+			     v->oom_adj, v->tasksize);
+		lowmem_add_deathpending(v->task);
+		force_sig(SIGKILL, v->task);
+		target -= v->tasksize;
+		rem -= v->tasksize;
 	}
+	rcu_read_unlock();
+
+	count_vm_event(LMK_SCAN);
+	count_vm_events(LMK_KILL, i);
+	count_vm_events(LMK_SCAN_USEC,
+			ktime_us_delta(ktime_get(), start));
+
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -186,6 +420,14 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	INIT_DELAYED_WORK_DEFERRABLE(&lowmem_notify_work,
+				     lowmem_notify_recheck);
+	ret = misc_register(&lowmem_notify_dev);
+	if (ret)
+		return ret;
+	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -193,6 +435,9 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_notify_work);
+	task_free_unregister(&task_nb);
+	misc_deregister(&lowmem_notify_dev);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -200,6 +445,9 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
+module_param_array_named(notify_minfree, lowmem_notify_minfree, uint,
+			 &lowmem_notify_minfree_size, S_IRUGO | S_IWUSR);
+module_param_named(max_kills, lowmem_max_kills, int, S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
@@ -32,10 +32,21 @@
 
 #include <linux/usb/android_composite.h>
 
-#define BULK_BUFFER_SIZE           4096
+/* default and largest size of a bulk request */
+#define BULK_BUFFER_SIZE           16384
+#define BULK_BUFFER_MAX            65536
 
-/* number of tx requests to allocate */
-#define TX_REQ_MAX 4
+/* default number of tx requests to allocate, and the limit */
+#define TX_REQ_DEFAULT 8
+#define REQ_MAX 32
+
+static unsigned int buf_size = BULK_BUFFER_SIZE;
+module_param(buf_size, uint, S_IRUGO);
+MODULE_PARM_DESC(buf_size, "Size of each bulk request in bytes");
+
+static unsigned int tx_reqs = TX_REQ_DEFAULT;
+module_param(tx_reqs, uint, S_IRUGO);
+MODULE_PARM_DESC(tx_reqs, "Number of IN requests");
 
 static const char shortname[] = "android_adb";
 
@@ -54,12 +65,19 @@ struct adb_dev {
 	atomic_t write_excl;
 	atomic_t open_excl;
 
+	/* request size and count, fixed at bind time */
+	int buf_size;
+	int tx_reqs;
+
 	struct list_head tx_idle;
+	/* the OUT request; once done, unread data starts at rx_offset */
+	struct usb_request *rx_req;
+	int rx_queued;
+	int rx_done;
+	int rx_offset;
 
 	wait_queue_head_t read_wq;
 	wait_queue_head_t write_wq;
-	struct usb_request *rx_req;
-	int rx_done;
 };
 
 static struct usb_interface_descriptor adb_interface_desc = {
@@ -211,13 +229,48 @@ static void adb_complete_out(struct usb_ep *ep, struct usb_request *req)
 {
 	struct adb_dev *dev = _adb_dev;
 
-	dev->rx_done = 1;
 	if (req->status != 0)
 		dev->error = 1;
+	else
+		dev->rx_done = 1;
+	dev->rx_queued = 0;
 
 	wake_up(&dev->read_wq);
 }
 
+/*
+ * Queue the OUT request for a read() of @count bytes.  The host ends a
+ * transfer with a short packet only when it is not a multiple of
+ * maxpacket, so the request is sized to the read rounded up to maxpacket
+ * rather than to the whole buffer: an exactly sized adb payload must
+ * complete it.  For the same reason OUT requests are not queued ahead of
+ * read(): a request queued before the size of the next payload is known
+ * may never complete, so there is only ever the one.
+ */
+static int adb_queue_rx(struct adb_dev *dev, size_t count)
+{
+	struct usb_request *req = dev->rx_req;
+	int ret;
+
+	if (dev->rx_queued || dev->rx_done)
+		return 0;
+
+	req->length = roundup(count, dev->ep_out->maxpacket);
+	if (req->length > dev->buf_size)
+		req->length = dev->buf_size;
+	dev->rx_offset = 0;
+	dev->rx_queued = 1;
+	ret = usb_ep_queue(dev->ep_out, req, GFP_ATOMIC);
+	if (ret < 0) {
+		DBG(dev->cdev, "adb_read: failed to queue req %p (%d)\n",
+			req, ret);
+		dev->rx_queued = 0;
+		return ret;
+	}
+	DBG(dev->cdev, "rx %p queue %d\n", req, req->length);
+	return 0;
+}
+
 static int create_bulk_endpoints(struct adb_dev *dev,
 				struct usb_endpoint_descriptor *in_desc,
 				struct usb_endpoint_descriptor *out_desc)
@@ -248,14 +301,14 @@ static int create_bulk_endpoints(struct adb_dev *dev,
 	dev->ep_out = ep;
 
 	/* now allocate requests for our endpoints */
-	req = adb_request_new(dev->ep_out, BULK_BUFFER_SIZE);
+	req = adb_request_new(dev->ep_out, dev->buf_size);
 	if (!req)
 		goto fail;
 	req->complete = adb_complete_out;
 	dev->rx_req = req;
 
-	for (i = 0; i < TX_REQ_MAX; i++) {
-		req = adb_request_new(dev->ep_in, BULK_BUFFER_SIZE);
+	for (i = 0; i < dev->tx_reqs; i++) {
+		req = adb_request_new(dev->ep_in, dev->buf_size);
 		if (!req)
 			goto fail;
 		req->complete = adb_complete_in;
@@ -274,15 +327,12 @@ static ssize_t adb_read(struct file *fp, char __user *buf,
 {
 	struct adb_dev *dev = fp->private_data;
 	struct usb_composite_dev *cdev = dev->cdev;
-	struct usb_request *req;
+	struct usb_request *req = dev->rx_req;
 	int r = count, xfer;
 	int ret;
 
 	DBG(cdev, "adb_read(%d)\n", count);
 
-	if (count > BULK_BUFFER_SIZE)
-		return -EINVAL;
-
 	if (_lock(&dev->read_excl))
 		return -EBUSY;
 
@@ -302,38 +352,45 @@ static ssize_t adb_read(struct file *fp, char __user *buf,
 	}
 
 requeue_req:
-	/* queue a request */
-	req = dev->rx_req;
-	req->length = count;
-	dev->rx_done = 0;
-	ret = usb_ep_queue(dev->ep_out, req, GFP_ATOMIC);
-	if (ret < 0) {
-		DBG(cdev, "adb_read: failed to queue req %p (%d)\n", req, ret);
+	if (adb_queue_rx(dev, count) < 0) {
 		r = -EIO;
 		dev->error = 1;
 		goto done;
-	} else {
-		DBG(cdev, "rx %p queue\n", req);
 	}
 
 	/* wait for a request to complete */
-	ret = wait_event_interruptible(dev->read_wq, dev->rx_done);
+	ret = wait_event_interruptible(dev->read_wq,
+			dev->rx_done || dev->error);
 	if (ret < 0) {
 		dev->error = 1;
 		r = ret;
 		goto done;
 	}
-	if (!dev->error) {
-		/* If we got a 0-len packet, throw it back and try again. */
-		if (req->actual == 0)
-			goto requeue_req;
-
-		DBG(cdev, "rx %p %d\n", req, req->actual);
-		xfer = (req->actual < count) ? req->actual : count;
-		if (copy_to_user(buf, req->buf, xfer))
-			r = -EFAULT;
-	} else
+	if (dev->error) {
 		r = -EIO;
+		goto done;
+	}
+
+	/* If we got a 0-len packet, throw it back and try again. */
+	if (req->actual == 0) {
+		dev->rx_done = 0;
+		goto requeue_req;
+	}
+
+	DBG(cdev, "rx %p %d\n", req, req->actual);
+	xfer = req->actual - dev->rx_offset;
+	if (xfer > count)
+		xfer = count;
+	if (copy_to_user(buf, req->buf + dev->rx_offset, xfer)) {
+		r = -EFAULT;
+		goto done;
+	}
+	r = xfer;
+
+	/* the rest of the transfer is left for the next read() */
+	dev->rx_offset += xfer;
+	if (dev->rx_offset == req->actual)
+		dev->rx_done = 0;
 
 done:
 	_unlock(&dev->read_excl);
@@ -373,8 +430,8 @@ static ssize_t adb_write(struct file *fp, const char __user *buf,
 		}
 
 		if (req != 0) {
-			if (count > BULK_BUFFER_SIZE)
-				xfer = BULK_BUFFER_SIZE;
+			if (count > dev->buf_size)
+				xfer = dev->buf_size;
 			else
 				xfer = count;
 			if (copy_from_user(req->buf, buf, xfer)) {
@@ -573,6 +630,9 @@ static void adb_function_disable(struct usb_function *f)
 	usb_ep_disable(dev->ep_in);
 	usb_ep_disable(dev->ep_out);
 
+	/* data from before the disconnect is stale */
+	dev->rx_done = 0;
+
 	/* readers may be blocked waiting for us to go online */
 	wake_up(&dev->read_wq);
 
@@ -599,6 +659,9 @@ static int adb_bind_config(struct usb_configuration *c)
 
 	INIT_LIST_HEAD(&dev->tx_idle);
 
+	dev->buf_size = clamp_t(int, buf_size, 512, BULK_BUFFER_MAX) & ~511;
+	dev->tx_reqs = clamp_t(int, tx_reqs, 1, REQ_MAX);
+
 	dev->cdev = c->cdev;
 	dev->function.name = "adb";
 	dev->function.descriptors = fs_adb_descs;
@@ -106,6 +106,13 @@
  *				to work correctly.  You should set it
  *				to true.
  *
+ *	num_buffers	Number of I/O buffers, between 2 and 32.  Zero
+ *				selects the default of 2.
+ *	buflen		Size of each I/O buffer in bytes, rounded
+ *				down to a multiple of the page size and
+ *				at most 128K.  Zero selects the default
+ *				of 16K.
+ *
  * If "removable" is not set for a LUN then a backing file must be
  * specified.  If it is set, then NULL filename means the LUN's medium
  * is not loaded (an empty string as "filename" in the fsg_config
@@ -133,6 +140,8 @@
  *				USB device controller (usually true),
  *				boolean to permit the driver to halt
  *				bulk endpoints.
+ *	buffers=N	Default N = 2, number of I/O buffers.
+ *	buflen=N	Default N = 16384, size of each I/O buffer.
  *
  * The module parameters may be prefixed with some string.  You need
  * to consult gadget's documentation or source to verify whether it is
@@ -142,8 +151,8 @@
  *
  *
  * Requirements are modest; only a bulk-in and a bulk-out endpoint are
- * needed.  The memory requirement amounts to two 16K buffers, size
- * configurable by a parameter.  Support is included for both
+ * needed.  The memory requirement amounts to two 16K buffers, number
+ * and size configurable by parameters.  Support is included for both
  * full-speed and high-speed operation.
  *
  * Note that the driver is slightly non-portable in that it assumes a
@@ -235,6 +244,17 @@
  * (again possibly by USB I/O, during which it is marked BUSY) and
  * finally marked EMPTY again (possibly by a completion routine).
  *
+ * File I/O for READ and WRITE commands does not run in the main thread.
+ * Each buffer head can be handed to a per-instance workqueue, which
+ * performs the vfs_read() or vfs_write() and wakes the main thread up
+ * when it is done (the buffer head is BUSY and its io_busy flag is set
+ * meanwhile).  A READ hands every EMPTY buffer ahead of the one being
+ * sent to the workqueue, and a WRITE hands over each buffer as soon as
+ * the host has filled it and keeps more bulk-out requests queued while
+ * the data are written.  Results are always collected in ring order, so
+ * the sense data and residue come out exactly as with synchronous I/O.
+ * Whoever resets the buffer states must first flush the workqueue.
+ *
  * A module parameter tells the driver to avoid stalling the bulk
  * endpoints wherever the transport specification allows.  This is
  * necessary for some UDCs like the SuperH, which cannot reliably clear a
@@ -283,12 +303,14 @@
 #include <linux/kref.h>
 #include <linux/kthread.h>
 #include <linux/limits.h>
+#include <linux/mm.h>
 #include <linux/rwsem.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/freezer.h>
 #include <linux/utsname.h>
+#include <linux/workqueue.h>
 
 #include <linux/usb/ch9.h>
 #include <linux/usb/gadget.h>
@@ -313,9 +335,14 @@ static const char fsg_string_interface[] = "Mass Storage";
 #define FSG_NO_DEVICE_STRINGS    1
 #define FSG_NO_OTG               1
 #define FSG_NO_INTR_EP           1
+#define FSG_BUFFHD_ASYNC_IO      1
 
 #include "storage_common.c"
 
+/* Bounds for the configurable buffer ring */
+#define FSG_MAX_BUFFERS		32
+#define FSG_MAX_BUFLEN		((u32)131072)
+
 
 /*-------------------------------------------------------------------------*/
 
@@ -341,7 +368,14 @@ struct fsg_common {
 
 	struct fsg_buffhd	*next_buffhd_to_fill;
 	struct fsg_buffhd	*next_buffhd_to_drain;
-	struct fsg_buffhd	buffhds[FSG_NUM_BUFFERS];
+	struct fsg_buffhd	*buffhds;
+	unsigned int		num_buffers;
+	u32			buflen;
+
+	/* Backing file reads and writes are carried out here */
+	struct workqueue_struct	*io_wq;
+	/* A write of the current command failed, skip the queued ones */
+	int			io_write_failed;
 
 	int			cmnd_size;
 	u8			cmnd[MAX_COMMAND_SIZE];
@@ -413,6 +447,11 @@ struct fsg_config {
 
 	char			can_stall;
 
+	/* Size of the buffer ring; zero selects FSG_NUM_BUFFERS
+	 * buffers of FSG_BUFLEN bytes. */
+	unsigned int		num_buffers;
+	unsigned int		buflen;
+
 #ifdef CONFIG_USB_ANDROID_MASS_STORAGE
 	struct platform_device *pdev;
 #endif
@@ -720,14 +759,93 @@ static int sleep_thread(struct fsg_common *common)
 
 /*-------------------------------------------------------------------------*/
 
+/* Backing file I/O, run on the common->io_wq workqueue */
+static void fsg_io_work(struct work_struct *work)
+{
+	struct fsg_buffhd	*bh = container_of(work, struct fsg_buffhd,
+						   io_work);
+	struct fsg_common	*common = bh->common;
+	loff_t			file_offset_tmp = bh->io_offset;
+	mm_segment_t		old_fs;
+	ssize_t			nio;
+
+	/* Once a write has failed, nothing behind it may reach the
+	 * medium: the host is told the data stopped at the first error. */
+	old_fs = get_fs();
+	set_fs(get_ds());
+	if (bh->io_write && common->io_write_failed)
+		nio = -EIO;
+	else if (bh->io_write)
+		nio = vfs_write(bh->io_filp, (char __user *) bh->buf,
+				bh->io_length, &file_offset_tmp);
+	else
+		nio = vfs_read(bh->io_filp, (char __user *) bh->buf,
+			       bh->io_length, &file_offset_tmp);
+	set_fs(old_fs);
+	fput(bh->io_filp);
+	bh->io_result = nio;
+
+	/* Hold the lock while we update the buffer state */
+	smp_wmb();
+	spin_lock_irq(&common->lock);
+	if (bh->io_write && nio < (ssize_t) bh->io_length)
+		common->io_write_failed = 1;
+	bh->io_busy = 0;
+	wakeup_thread(common);
+	spin_unlock_irq(&common->lock);
+}
+
+static void fsg_io_submit(struct fsg_common *common, struct fsg_buffhd *bh,
+			  struct fsg_lun *curlun, loff_t file_offset,
+			  unsigned int amount, int write)
+{
+	/* The LUN may be ejected before the work item has run */
+	get_file(curlun->filp);
+	bh->io_filp = curlun->filp;
+	bh->io_offset = file_offset;
+	bh->io_length = amount;
+	bh->io_write = write;
+	bh->io_busy = 1;
+	bh->state = BUF_STATE_BUSY;
+	queue_work(common->io_wq, &bh->io_work);
+}
+
+/* Wait for the workqueue to finish, then forget the results held in
+ * the count buffers starting at bh. */
+static void fsg_io_cancel(struct fsg_common *common, struct fsg_buffhd *bh,
+			  unsigned int count)
+{
+	flush_workqueue(common->io_wq);
+	for (; count > 0; --count, bh = bh->next)
+		bh->state = BUF_STATE_EMPTY;
+}
+
+/* Start reading the whole transfer into the page cache so that more
+ * than one buffer's worth of I/O is outstanding on the device. */
+static void fsg_lun_readahead(struct fsg_lun *curlun, loff_t file_offset,
+			      u32 amount)
+{
+	struct file	*filp = curlun->filp;
+	pgoff_t		first, last;
+
+	if (file_offset >= curlun->file_length)
+		return;
+	amount = min((loff_t) amount, curlun->file_length - file_offset);
+	first = file_offset >> PAGE_CACHE_SHIFT;
+	last = (file_offset + amount - 1) >> PAGE_CACHE_SHIFT;
+	page_cache_sync_readahead(filp->f_mapping, &filp->f_ra, filp,
+				  first, last - first + 1);
+}
+
 static int do_read(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
 	u32			lba;
-	struct fsg_buffhd	*bh;
+	struct fsg_buffhd	*bh, *next_to_read;
 	int			rc;
-	u32			amount_left;
-	loff_t			file_offset, file_offset_tmp;
+	unsigned int		io_pending;
+	u32			amount_left, read_left;
+	loff_t			file_offset, read_offset;
 	unsigned int		amount;
 	unsigned int		partial_page;
 	ssize_t			nread;
@@ -751,42 +869,54 @@ static int do_read(struct fsg_common *common)
 		curlun->sense_data = SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
 		return -EINVAL;
 	}
-	file_offset = ((loff_t) lba) << 9;
+	file_offset = read_offset = ((loff_t) lba) << 9;
 
 	/* Carry out the file reads */
-	amount_left = common->data_size_from_cmnd;
+	amount_left = read_left = common->data_size_from_cmnd;
 	if (unlikely(amount_left == 0))
 		return -EIO;		/* No default reply */
 
+	if (amount_left > common->buflen)
+		fsg_lun_readahead(curlun, file_offset, amount_left);
+
+	next_to_read = common->next_buffhd_to_fill;
+	io_pending = 0;
 	for (;;) {
 
-		/* Figure out how much we need to read:
+		/* Hand every free buffer to the I/O workqueue.
+		 * Figure out how much we need to read:
 		 * Try to read the remaining amount.
 		 * But don't read more than the buffer size.
 		 * And don't try to read past the end of the file.
 		 * Finally, if we're not at a page boundary, don't read past
 		 *	the next page.
 		 * If this means reading 0 then we were asked to read past
-		 *	the end of file. */
-		amount = min(amount_left, FSG_BUFLEN);
-		amount = min((loff_t) amount,
-				curlun->file_length - file_offset);
-		partial_page = file_offset & (PAGE_CACHE_SIZE - 1);
-		if (partial_page > 0)
-			amount = min(amount, (unsigned int) PAGE_CACHE_SIZE -
+		 *	the end of file; that is reported below once every
+		 *	buffer in front of it has been sent. */
+		while (read_left > 0 && next_to_read->state == BUF_STATE_EMPTY) {
+			amount = min(read_left, common->buflen);
+			amount = min((loff_t) amount,
+					curlun->file_length - read_offset);
+			partial_page = read_offset & (PAGE_CACHE_SIZE - 1);
+			if (partial_page > 0)
+				amount = min(amount,
+					(unsigned int) PAGE_CACHE_SIZE -
 					partial_page);
+			if (amount == 0)
+				break;
 
-		/* Wait for the next buffer to become available */
-		bh = common->next_buffhd_to_fill;
-		while (bh->state != BUF_STATE_EMPTY) {
-			rc = sleep_thread(common);
-			if (rc)
-				return rc;
+			fsg_io_submit(common, next_to_read, curlun,
+				      read_offset, amount, 0);
+			read_offset += amount;
+			read_left -= amount;
+			next_to_read = next_to_read->next;
+			++io_pending;
 		}
 
 		/* If we were asked to read past the end of file,
 		 * end with an empty buffer. */
-		if (amount == 0) {
+		bh = common->next_buffhd_to_fill;
+		if (io_pending == 0 && bh->state == BUF_STATE_EMPTY) {
 			curlun->sense_data =
 					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
 			curlun->sense_data_info = file_offset >> 9;
@@ -796,16 +926,20 @@ static int do_read(struct fsg_common *common)
 			break;
 		}
 
-		/* Perform the read */
-		file_offset_tmp = file_offset;
-		nread = vfs_read(curlun->filp,
-				(char __user *) bh->buf,
-				amount, &file_offset_tmp);
+		/* Wait for the next buffer's read to complete */
+		if (io_pending == 0 || bh->io_busy) {
+			rc = sleep_thread(common);
+			if (rc)
+				return rc;
+			continue;
+		}
+		smp_rmb();
+		--io_pending;
+		amount = bh->io_length;
+		nread = bh->io_result;
 		VLDBG(curlun, "file read %u @ %llu -> %d\n", amount,
 				(unsigned long long) file_offset,
 				(int) nread);
-		if (signal_pending(current))
-			return -EINTR;
 
 		if (nread < 0) {
 			LDBG(curlun, "error in file read: %d\n",
@@ -822,11 +956,13 @@ static int do_read(struct fsg_common *common)
 		bh->inreq->length = nread;
 		bh->state = BUF_STATE_FULL;
 
-		/* If an error occurred, report it and its position */
+		/* If an error occurred, report it and its position, and
+		 * drop whatever was read beyond it */
 		if (nread < amount) {
 			curlun->sense_data = SS_UNRECOVERED_READ_ERROR;
 			curlun->sense_data_info = file_offset >> 9;
 			curlun->info_valid = 1;
+			fsg_io_cancel(common, bh->next, io_pending);
 			break;
 		}
 
@@ -853,10 +989,12 @@ static int do_write(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
 	u32			lba;
-	struct fsg_buffhd	*bh;
-	int			get_some_more;
+	struct fsg_buffhd	*bh, *next_to_retire;
+	int			get_some_more, draining_stopped;
+	int			transfer_failed;
+	unsigned int		io_pending;
 	u32			amount_left_to_req, amount_left_to_write;
-	loff_t			usb_offset, file_offset, file_offset_tmp;
+	loff_t			usb_offset, drain_offset, file_offset;
 	unsigned int		amount;
 	unsigned int		partial_page;
 	ssize_t			nwritten;
@@ -900,9 +1038,14 @@ static int do_write(struct fsg_common *common)
 
 	/* Carry out the file writes */
 	get_some_more = 1;
-	file_offset = usb_offset = ((loff_t) lba) << 9;
+	draining_stopped = 0;
+	transfer_failed = 0;
+	io_pending = 0;
+	common->io_write_failed = 0;
+	file_offset = usb_offset = drain_offset = ((loff_t) lba) << 9;
 	amount_left_to_req = common->data_size_from_cmnd;
 	amount_left_to_write = common->data_size_from_cmnd;
+	next_to_retire = common->next_buffhd_to_drain;
 
 	while (amount_left_to_write > 0) {
 
@@ -919,7 +1062,7 @@ static int do_write(struct fsg_common *common)
 			 * If this means getting 0, then we were asked
 			 *	to write past the end of file.
 			 * Finally, round down to a block boundary. */
-			amount = min(amount_left_to_req, FSG_BUFLEN);
+			amount = min(amount_left_to_req, common->buflen);
 			amount = min((loff_t) amount, curlun->file_length -
 					usb_offset);
 			partial_page = usb_offset & (PAGE_CACHE_SIZE - 1);
@@ -965,42 +1108,19 @@ static int do_write(struct fsg_common *common)
 			continue;
 		}
 
-		/* Write the received data to the backing file */
-		bh = common->next_buffhd_to_drain;
-		if (bh->state == BUF_STATE_EMPTY && !get_some_more)
-			break;			/* We stopped early */
-		if (bh->state == BUF_STATE_FULL) {
+		/* Collect the oldest write the I/O workqueue has finished */
+		bh = next_to_retire;
+		if (io_pending > 0 && !bh->io_busy) {
 			smp_rmb();
-			common->next_buffhd_to_drain = bh->next;
+			next_to_retire = bh->next;
+			--io_pending;
 			bh->state = BUF_STATE_EMPTY;
 
-			/* Did something go wrong with the transfer? */
-			if (bh->outreq->status != 0) {
-				curlun->sense_data = SS_COMMUNICATION_FAILURE;
-				curlun->sense_data_info = file_offset >> 9;
-				curlun->info_valid = 1;
-				break;
-			}
-
-			amount = bh->outreq->actual;
-			if (curlun->file_length - file_offset < amount) {
-				LERROR(curlun,
-	"write %u @ %llu beyond end %llu\n",
-	amount, (unsigned long long) file_offset,
-	(unsigned long long) curlun->file_length);
-				amount = curlun->file_length - file_offset;
-			}
-
-			/* Perform the write */
-			file_offset_tmp = file_offset;
-			nwritten = vfs_write(curlun->filp,
-					(char __user *) bh->buf,
-					amount, &file_offset_tmp);
+			amount = bh->io_length;
+			nwritten = bh->io_result;
 			VLDBG(curlun, "file write %u @ %llu -> %d\n", amount,
 					(unsigned long long) file_offset,
 					(int) nwritten);
-			if (signal_pending(current))
-				return -EINTR;		/* Interrupted! */
 
 			if (nwritten < 0) {
 				LDBG(curlun, "error in file write: %d\n",
@@ -1021,6 +1141,8 @@ static int do_write(struct fsg_common *common)
 				curlun->sense_data = SS_WRITE_ERROR;
 				curlun->sense_data_info = file_offset >> 9;
 				curlun->info_valid = 1;
+				fsg_io_cancel(common, next_to_retire,
+					      io_pending);
 				break;
 			}
 
@@ -1032,6 +1154,52 @@ static int do_write(struct fsg_common *common)
 			continue;
 		}
 
+		/* Hand the received data to the I/O workqueue */
+		bh = common->next_buffhd_to_drain;
+		if (bh->state == BUF_STATE_FULL && !draining_stopped) {
+			smp_rmb();
+			common->next_buffhd_to_drain = bh->next;
+
+			/* Did something go wrong with the transfer?  Let the
+			 * writes in front of it finish first. */
+			if (bh->outreq->status != 0) {
+				bh->state = BUF_STATE_EMPTY;
+				transfer_failed = 1;
+				draining_stopped = 1;
+				continue;
+			}
+
+			amount = bh->outreq->actual;
+			if (curlun->file_length - drain_offset < amount) {
+				LERROR(curlun,
+	"write %u @ %llu beyond end %llu\n",
+	amount, (unsigned long long) drain_offset,
+	(unsigned long long) curlun->file_length);
+				amount = curlun->file_length - drain_offset;
+			}
+
+			/* Nothing after a short packet belongs to us */
+			if (bh->outreq->actual != bh->outreq->length)
+				draining_stopped = 1;
+
+			fsg_io_submit(common, bh, curlun, drain_offset,
+				      amount, 1);
+			drain_offset += amount;
+			++io_pending;
+			continue;
+		}
+
+		if (io_pending == 0) {
+			if (transfer_failed) {
+				curlun->sense_data = SS_COMMUNICATION_FAILURE;
+				curlun->sense_data_info = file_offset >> 9;
+				curlun->info_valid = 1;
+				break;
+			}
+			if (bh->state == BUF_STATE_EMPTY && !get_some_more)
+				break;			/* We stopped early */
+		}
+
 		/* Wait for something to happen */
 		rc = sleep_thread(common);
 		if (rc)
@@ -1122,7 +1290,7 @@ static int do_verify(struct fsg_common *common)
 		 * And don't try to read past the end of the file.
 		 * If this means reading 0 then we were asked to read
 		 * past the end of file. */
-		amount = min(amount_left, FSG_BUFLEN);
+		amount = min(amount_left, common->buflen);
 		amount = min((loff_t) amount,
 				curlun->file_length - file_offset);
 		if (amount == 0) {
@@ -1569,7 +1737,7 @@ static int pad_with_zeros(struct fsg_dev *fsg)
 				return rc;
 		}
 
-		nsend = min(fsg->common->usb_amount_left, FSG_BUFLEN);
+		nsend = min(fsg->common->usb_amount_left, fsg->common->buflen);
 		memset(bh->buf + nkeep, 0, nsend - nkeep);
 		bh->inreq->length = nsend;
 		bh->inreq->zero = 0;
@@ -1612,7 +1780,7 @@ static int throw_away_data(struct fsg_common *common)
 		bh = common->next_buffhd_to_fill;
 		if (bh->state == BUF_STATE_EMPTY
 		 && common->usb_amount_left > 0) {
-			amount = min(common->usb_amount_left, FSG_BUFLEN);
+			amount = min(common->usb_amount_left, common->buflen);
 
 			/* amount is always divisible by 512, hence by
 			 * the bulk-out maxpacket size */
@@ -2332,7 +2500,7 @@ reset:
 	if (common->fsg) {
 		fsg = common->fsg;
 
-		for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		for (i = 0; i < common->num_buffers; ++i) {
 			struct fsg_buffhd *bh = &common->buffhds[i];
 
 			if (bh->inreq) {
@@ -2384,7 +2552,7 @@ reset:
 	clear_bit(IGNORE_BULK_OUT, &fsg->atomic_bitflags);
 
 	/* Allocate the requests */
-	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+	for (i = 0; i < common->num_buffers; ++i) {
 		struct fsg_buffhd	*bh = &common->buffhds[i];
 
 		rc = alloc_request(common, fsg->bulk_in, &bh->inreq);
@@ -2456,9 +2624,12 @@ static void handle_exception(struct fsg_common *common)
 		}
 	}
 
+	/* Let the backing file I/O finish; it can't be interrupted */
+	flush_workqueue(common->io_wq);
+
 	/* Cancel all the pending transfers */
 	if (likely(common->fsg)) {
-		for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		for (i = 0; i < common->num_buffers; ++i) {
 			bh = &common->buffhds[i];
 			if (bh->inreq_busy)
 				usb_ep_dequeue(common->fsg->bulk_in, bh->inreq);
@@ -2470,7 +2641,7 @@ static void handle_exception(struct fsg_common *common)
 		/* Wait until everything is idle */
 		for (;;) {
 			int num_active = 0;
-			for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+			for (i = 0; i < common->num_buffers; ++i) {
 				bh = &common->buffhds[i];
 				num_active += bh->inreq_busy + bh->outreq_busy;
 			}
@@ -2491,7 +2662,7 @@ static void handle_exception(struct fsg_common *common)
 	 * state, and the exception.  Then invoke the handler. */
 	spin_lock_irq(&common->lock);
 
-	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+	for (i = 0; i < common->num_buffers; ++i) {
 		bh = &common->buffhds[i];
 		bh->state = BUF_STATE_EMPTY;
 	}
@@ -2703,7 +2874,7 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 			return ERR_PTR(-ENOMEM);
 		common->free_storage_on_release = 1;
 	} else {
-		memset(common, 0, sizeof common);
+		memset(common, 0, sizeof *common);
 		common->free_storage_on_release = 0;
 	}
 
@@ -2781,21 +2952,40 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 
 
 	/* Data buffers cyclic list */
-	bh = common->buffhds;
-	i = FSG_NUM_BUFFERS;
+	common->num_buffers = clamp(cfg->num_buffers ?: FSG_NUM_BUFFERS,
+				    2u, (unsigned)FSG_MAX_BUFFERS);
+	common->buflen = clamp((u32)cfg->buflen ?: FSG_BUFLEN,
+			       (u32)PAGE_CACHE_SIZE, FSG_MAX_BUFLEN);
+	common->buflen &= ~(PAGE_CACHE_SIZE - 1);
+
+	bh = kzalloc(common->num_buffers * sizeof *bh, GFP_KERNEL);
+	if (unlikely(!bh)) {
+		rc = -ENOMEM;
+		goto error_release;
+	}
+	common->buffhds = bh;
+	i = common->num_buffers;
 	goto buffhds_first_it;
 	do {
 		bh->next = bh + 1;
 		++bh;
 buffhds_first_it:
-		bh->buf = kmalloc(FSG_BUFLEN, GFP_KERNEL);
+		bh->buf = kmalloc(common->buflen, GFP_KERNEL);
 		if (unlikely(!bh->buf)) {
 			rc = -ENOMEM;
 			goto error_release;
 		}
+		bh->common = common;
+		INIT_WORK(&bh->io_work, fsg_io_work);
 	} while (--i);
 	bh->next = common->buffhds;
 
+	common->io_wq = create_singlethread_workqueue("file-storage-io");
+	if (unlikely(!common->io_wq)) {
+		rc = -ENOMEM;
+		goto error_release;
+	}
+
 
 	/* Prepare inquiryString */
 	if (cfg->release != 0xffff) {
@@ -2850,6 +3040,8 @@ buffhds_first_it:
 	/* Information */
 	INFO(common, FSG_DRIVER_DESC ", version: " FSG_DRIVER_VERSION "\n");
 	INFO(common, "Number of LUNs=%d\n", common->nluns);
+	INFO(common, "Number of buffers=%u, buffer length=%u\n",
+	     common->num_buffers, common->buflen);
 
 	pathbuf = kmalloc(PATH_MAX, GFP_KERNEL);
 	for (i = 0, nluns = common->nluns, curlun = common->luns;
@@ -2919,12 +3111,16 @@ static void fsg_common_release(struct kref *ref)
 		kfree(common->luns);
 	}
 
-	{
+	if (common->io_wq)
+		destroy_workqueue(common->io_wq);
+
+	if (likely(common->buffhds)) {
 		struct fsg_buffhd *bh = common->buffhds;
-		unsigned i = FSG_NUM_BUFFERS;
+		unsigned i = common->num_buffers;
 		do {
 			kfree(bh->buf);
 		} while (++bh, --i);
+		kfree(common->buffhds);
 	}
 
 	if (common->free_storage_on_release)
@@ -3066,6 +3262,8 @@ struct fsg_module_parameters {
 	unsigned int	file_count, ro_count, removable_count, cdrom_count;
 	unsigned int	luns;	/* nluns */
 	int		stall;	/* can_stall */
+	unsigned int	buffers;	/* num_buffers */
+	unsigned int	buflen;
 };
 
 
@@ -3092,7 +3290,11 @@ struct fsg_module_parameters {
 	_FSG_MODULE_PARAM(prefix, params, luns, uint,			\
 			  "number of LUNs");				\
 	_FSG_MODULE_PARAM(prefix, params, stall, bool,			\
-			  "false to prevent bulk stalls")
+			  "false to prevent bulk stalls");		\
+	_FSG_MODULE_PARAM(prefix, params, buffers, uint,		\
+			  "number of I/O buffers");			\
+	_FSG_MODULE_PARAM(prefix, params, buflen, uint,			\
+			  "size of each I/O buffer")
 
 
 static void
@@ -3129,6 +3331,8 @@ fsg_config_from_params(struct fsg_config *cfg,
 
 	/* Finalise */
 	cfg->can_stall = params->stall;
+	cfg->num_buffers = params->buffers;
+	cfg->buflen = params->buflen;
 }
 
 static inline struct fsg_common *
@@ -3150,6 +3354,11 @@ fsg_common_from_params(struct fsg_common *common,
 
 static struct fsg_config fsg_cfg;
 
+module_param_named(buffers, fsg_cfg.num_buffers, uint, S_IRUGO);
+MODULE_PARM_DESC(buffers, "number of I/O buffers");
+module_param_named(buflen, fsg_cfg.buflen, uint, S_IRUGO);
+MODULE_PARM_DESC(buflen, "size of each I/O buffer");
+
 static int fsg_probe(struct platform_device *pdev)
 {
 	struct usb_mass_storage_platform_data *pdata = pdev->dev.platform_data;
@@ -87,6 +87,56 @@ static void fsl_ep_fifo_flush(struct usb_ep *_ep);
 /********************************************************************
  *	Internal Used Function
 ********************************************************************/
+/*-----------------------------------------------------------------
+ * fsl_alloc_dtd() - take a dTD from the endpoint's own pool, or
+ *	from the global dma_pool if that is exhausted
+ * called with spinlock held
+ *--------------------------------------------------------------*/
+static struct ep_td_struct *fsl_alloc_dtd(struct fsl_ep *ep, dma_addr_t *dma)
+{
+	struct ep_td_struct *dtd = ep->td_free;
+
+	if (likely(dtd)) {
+		ep->td_free = dtd->next_td_virt;
+		*dma = dtd->td_dma;
+		return dtd;
+	}
+
+	ep->udc->td_pool_misses++;
+	dtd = dma_pool_alloc(ep->udc->td_pool, GFP_ATOMIC, dma);
+	if (dtd)
+		dtd->td_dma = *dma;
+	return dtd;
+}
+
+static void fsl_free_dtd(struct fsl_ep *ep, struct ep_td_struct *dtd)
+{
+	u8 *p = (u8 *)dtd;
+
+	if (p >= ep->td_pool_base
+			&& p < ep->td_pool_base + DTD_POOL_SIZE * DTD_POOL_STRIDE) {
+		dtd->next_td_virt = ep->td_free;
+		ep->td_free = dtd;
+	} else
+		dma_pool_free(ep->udc->td_pool, dtd, dtd->td_dma);
+}
+
+/* Carve the endpoint's slice of the preallocated dTD memory */
+static void fsl_ep_init_dtd_pool(struct fsl_ep *ep, u8 *base, dma_addr_t dma)
+{
+	struct ep_td_struct *dtd;
+	int i;
+
+	ep->td_pool_base = base;
+	ep->td_free = NULL;
+	for (i = DTD_POOL_SIZE - 1; i >= 0; i--) {
+		dtd = (struct ep_td_struct *)(base + i * DTD_POOL_STRIDE);
+		dtd->td_dma = dma + i * DTD_POOL_STRIDE;
+		dtd->next_td_virt = ep->td_free;
+		ep->td_free = dtd;
+	}
+}
+
 /*-----------------------------------------------------------------
  * done() - retire a request; caller blocked irqs
  * @status : request status to be set, only works when
@@ -94,12 +144,10 @@ static void fsl_ep_fifo_flush(struct usb_ep *_ep);
  *--------------------------------------------------------------*/
 static void done(struct fsl_ep *ep, struct fsl_req *req, int status)
 {
-	struct fsl_udc *udc = NULL;
 	unsigned char stopped = ep->stopped;
 	struct ep_td_struct *curr_td, *next_td;
 	int j;
 
-	udc = (struct fsl_udc *)ep->udc;
 	/* Removed the req from fsl_ep->queue */
 	list_del_init(&req->queue);
 
@@ -116,7 +164,7 @@ static void done(struct fsl_ep *ep, struct fsl_req *req, int status)
 		if (j != req->dtd_count - 1) {
 			next_td = curr_td->next_td_virt;
 		}
-		dma_pool_free(udc->td_pool, curr_td, curr_td->td_dma);
+		fsl_free_dtd(ep, curr_td);
 	}
 
 	if (req->mapped) {
@@ -682,11 +730,10 @@ static struct ep_td_struct *fsl_build_dtd(struct fsl_req *req, unsigned *length,
 	*length = min(req->req.length - req->req.actual,
 			(unsigned)EP_MAX_LENGTH_TRANSFER);
 
-	dtd = dma_pool_alloc(udc_controller->td_pool, GFP_KERNEL, dma);
+	dtd = fsl_alloc_dtd(req->ep, dma);
 	if (dtd == NULL)
 		return dtd;
 
-	dtd->td_dma = *dma;
 	/* Clear reserved field */
 	swap_temp = cpu_to_le32(dtd->size_ioc_sts);
 	swap_temp &= ~DTD_RESERVED_FIELDS;
@@ -742,8 +789,15 @@ static int fsl_req_to_dtd(struct fsl_req *req)
 
 	do {
 		dtd = fsl_build_dtd(req, &count, &dma, &is_last);
-		if (dtd == NULL)
+		if (dtd == NULL) {
+			/* Give back what was built so far */
+			for (dtd = req->head; req->dtd_count; req->dtd_count--) {
+				last_dtd = dtd->next_td_virt;
+				fsl_free_dtd(req->ep, dtd);
+				dtd = last_dtd;
+			}
 			return -ENOMEM;
+		}
 
 		if (is_first) {
 			is_first = 0;
@@ -889,7 +943,8 @@ static int fsl_ep_dequeue(struct usb_ep *_ep, struct usb_request *_req)
 					queue);
 
 			/* Point the QH to the first TD of next request */
-			fsl_writel((u32) next_req->head, &qh->curr_dtd_ptr);
+			fsl_writel((u32) next_req->head->td_dma,
+					&qh->curr_dtd_ptr);
 		}
 
 		/* The request hasn't been processed, patch up the TD chain */
@@ -1505,7 +1560,7 @@ static int process_ep_req(struct fsl_udc *udc, int pipe,
 static void dtd_complete_irq(struct fsl_udc *udc)
 {
 	u32 bit_pos;
-	int i, ep_num, direction, bit_mask, status;
+	int i, bit, ep_num, direction, status;
 	struct fsl_ep *curr_ep;
 	struct fsl_req *curr_req, *temp_req;
 
@@ -1513,17 +1568,17 @@ static void dtd_complete_irq(struct fsl_udc *udc)
 	bit_pos = fsl_readl(&dr_regs->endptcomplete);
 	fsl_writel(bit_pos, &dr_regs->endptcomplete);
 
-	if (!bit_pos)
-		return;
-
-	for (i = 0; i < udc->max_ep * 2; i++) {
-		ep_num = i >> 1;
-		direction = i % 2;
+	/* Only visit the endpoints that reported a completion:
+	 * bits 0-15 are receive, bits 16-31 transmit */
+	while (bit_pos) {
+		bit = __ffs(bit_pos);
+		bit_pos &= ~(1 << bit);
 
-		bit_mask = 1 << (ep_num + 16 * direction);
-
-		if (!(bit_pos & bit_mask))
+		ep_num = bit & 0xf;
+		direction = bit >> 4;
+		if (ep_num >= udc->max_ep / 2)
 			continue;
+		i = ep_num * 2 + direction;
 
 		curr_ep = get_ep_by_pipe(udc, i);
 
@@ -2065,6 +2120,11 @@ static int fsl_proc_read(char *page, char **start, off_t off, int count,
 #endif
 
 	/* ------fsl_udc, fsl_ep, fsl_request structure information ----- */
+	t = scnprintf(next, size, "dTDs allocated outside the endpoint "
+			"pools: %lu\n\n", udc->td_pool_misses);
+	size -= t;
+	next += t;
+
 	ep = &udc->eps[0];
 	t = scnprintf(next, size, "For %s Maxpkt is 0x%x index is 0x%x\n",
 			ep->ep.name, ep_maxpacket(ep), ep_index(ep));
@@ -2373,9 +2433,30 @@ static int __devinit fsl_udc_probe(struct platform_device *pdev)
 		ret = -ENOMEM;
 		goto err_unregister;
 	}
+
+	/* and a preallocated slice of dTDs for each endpoint, so that
+	 * queueing a request does not have to go to the dma_pool */
+	udc_controller->td_prealloc_size = PAGE_ALIGN(udc_controller->max_ep
+			* DTD_POOL_SIZE * DTD_POOL_STRIDE);
+	udc_controller->td_prealloc = dma_alloc_coherent(&pdev->dev,
+			udc_controller->td_prealloc_size,
+			&udc_controller->td_prealloc_dma, GFP_KERNEL);
+	if (udc_controller->td_prealloc == NULL) {
+		ret = -ENOMEM;
+		goto err_free_pool;
+	}
+	for (i = 0; i < udc_controller->max_ep; i++)
+		fsl_ep_init_dtd_pool(&udc_controller->eps[i],
+			(u8 *)udc_controller->td_prealloc
+				+ i * DTD_POOL_SIZE * DTD_POOL_STRIDE,
+			udc_controller->td_prealloc_dma
+				+ i * DTD_POOL_SIZE * DTD_POOL_STRIDE);
+
 	create_proc_file();
 	return 0;
 
+err_free_pool:
+	dma_pool_destroy(udc_controller->td_pool);
 err_unregister:
 	device_unregister(&udc_controller->gadget.dev);
 err_free_irq:
@@ -2415,6 +2496,9 @@ static int __exit fsl_udc_remove(struct platform_device *pdev)
 	kfree(udc_controller->status_req);
 	kfree(udc_controller->eps);
 
+	dma_free_coherent(&pdev->dev, udc_controller->td_prealloc_size,
+			udc_controller->td_prealloc,
+			udc_controller->td_prealloc_dma);
 	dma_pool_destroy(udc_controller->td_pool);
 	free_irq(udc_controller->irq, udc_controller);
 	iounmap(dr_regs);
@@ -419,6 +419,12 @@ struct ep_td_struct {
                                                DTD_STATUS_TRANSACTION_ERR)
 /* Alignment requirements; must be a power of two */
 #define DTD_ALIGNMENT				0x20
+
+/* Each endpoint owns a preallocated pool of dTDs; the dma_pool is only
+ * used once it runs dry */
+#define DTD_POOL_SIZE			32
+#define DTD_POOL_STRIDE			ALIGN(sizeof(struct ep_td_struct), \
+					      DTD_ALIGNMENT)
 #define QH_ALIGNMENT				2048
 
 /* Controller dma boundary */
@@ -453,6 +459,9 @@ struct fsl_ep {
 
 	char name[14];
 	unsigned stopped:1;
+
+	struct ep_td_struct *td_free;	/* unused dTDs of the pool */
+	u8 *td_pool_base;		/* the pool, DTD_POOL_SIZE dTDs */
 };
 
 #define EP_DIR_IN	1
@@ -477,6 +486,10 @@ struct fsl_udc {
 	struct ep_queue_head *ep_qh;	/* Endpoints Queue-Head */
 	struct fsl_req *status_req;	/* ep0 status request */
 	struct dma_pool *td_pool;	/* dma pool for DTD */
+	void *td_prealloc;		/* per-endpoint dTD pools */
+	dma_addr_t td_prealloc_dma;
+	size_t td_prealloc_size;
+	unsigned long td_pool_misses;	/* dTDs taken from td_pool */
 	enum fsl_usb2_phy_modes phy_mode;
 
 	size_t ep_qh_size;		/* size after alignment adjustment*/
@@ -51,6 +51,11 @@
  * When FSG_BUFFHD_STATIC_BUFFER is defined when this file is included
  * the fsg_buffhd structure's buf field will be an array of FSG_BUFLEN
  * characters rather then a pointer to void.
+ *
+ * When FSG_BUFFHD_ASYNC_IO is defined the fsg_buffhd structure
+ * carries the state of a backing file read or write handed off to
+ * another thread, so that the data in the buffer can be moved to or
+ * from storage while other buffers are being transferred over USB.
  */
 
 
@@ -322,6 +327,17 @@ struct fsg_buffhd {
 	int				inreq_busy;
 	struct usb_request		*outreq;
 	int				outreq_busy;
+
+#ifdef FSG_BUFFHD_ASYNC_IO
+	struct work_struct		io_work;
+	struct fsg_common		*common;
+	struct file			*io_filp;
+	loff_t				io_offset;
+	unsigned int			io_length;
+	ssize_t				io_result;
+	int				io_write;
+	int				io_busy;
+#endif
 };
 
 enum fsg_state {
@@ -34,6 +34,24 @@
  */
 #define PMEM_GET_TOTAL_SIZE	_IOW(PMEM_IOCTL_MAGIC, 7, unsigned int)
 #define PMEM_CACHE_FLUSH	_IOW(PMEM_IOCTL_MAGIC, 8, unsigned int)
+/* Chooses how the allocation of this file is mapped into user space, pass
+ * one of the PMEM_MAP_ATTR values below. Must be set before mmap. Cached
+ * mappings are only available on regions the kernel maps cached.
+ */
+#define PMEM_SET_MAP_ATTR	_IOW(PMEM_IOCTL_MAGIC, 9, unsigned int)
+/* Cache maintenance on part of the allocation, pass a pmem_region with the
+ * offset and length within the allocation. Clean writes dirty lines back so
+ * a device sees CPU writes; invalidate drops lines so the CPU sees device
+ * writes; clean_inv does both.
+ */
+#define PMEM_CACHE_CLEAN	_IOW(PMEM_IOCTL_MAGIC, 10, unsigned int)
+#define PMEM_CACHE_INV		_IOW(PMEM_IOCTL_MAGIC, 11, unsigned int)
+#define PMEM_CACHE_CLEAN_INV	_IOW(PMEM_IOCTL_MAGIC, 12, unsigned int)
+
+#define PMEM_MAP_ATTR_DEFAULT		0 /* as configured for the region */
+#define PMEM_MAP_ATTR_CACHED		1
+#define PMEM_MAP_ATTR_WRITECOMBINE	2
+#define PMEM_MAP_ATTR_UNCACHED		3
 
 struct android_pmem_platform_data {
 	const char *name;
@@ -526,6 +526,9 @@ struct ldb_platform_data {
 	bool iram_enable;
 	int  iram_size;
 	void (*reset) (void);
+	/* buffer pool reserved by the board at boot, none if size is 0 */
+	unsigned long pool_base;
+	unsigned long pool_size;
 };
 
 struct mxc_esai_platform_data {
@@ -1240,6 +1240,35 @@ typedef struct _ipu_csc_update {
 	int **param;
 } ipu_csc_update;
 
+/*
+ * Memory to memory conversion task, see IPU_QUEUE_TASK.  A zero stride
+ * means a packed line of width pixels; a zero crop size selects the
+ * whole frame.
+ */
+typedef struct _ipu_task_frame {
+	dma_addr_t paddr;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixel_fmt;
+	uint32_t crop_x;
+	uint32_t crop_y;
+	uint32_t crop_w;
+	uint32_t crop_h;
+} ipu_task_frame;
+
+typedef struct _ipu_task {
+	uint32_t id;		/* returned in ipu_task_result */
+	ipu_task_frame input;
+	ipu_task_frame output;
+	ipu_rotate_mode_t rotate;
+} ipu_task;
+
+typedef struct _ipu_task_result {
+	uint32_t id;
+	int32_t status;		/* 0 or negative error code */
+} ipu_task_result;
+
 /* IOCTL commands */
 
 #define IPU_INIT_CHANNEL              _IOW('I', 0x1, ipu_channel_parm)
@@ -1284,6 +1313,8 @@ typedef struct _ipu_csc_update {
 #define IPU_UPDATE_BUF_OFFSET         _IOW('I', 0x28, ipu_buf_offset_parm)
 #define IPU_CSC_UPDATE                _IOW('I', 0x29, ipu_csc_update)
 #define IPU_SELECT_MULTI_VDI_BUFFER   _IOW('I', 0x2A, uint32_t)
+#define IPU_QUEUE_TASK                _IOW('I', 0x2B, ipu_task)
+#define IPU_DEQUEUE_TASK              _IOR('I', 0x2C, ipu_task_result)
 
 int ipu_calc_stripes_sizes(const unsigned int input_frame_width,
 				unsigned int output_frame_width,
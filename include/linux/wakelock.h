@@ -17,6 +17,7 @@
 #define _LINUX_WAKELOCK_H
 
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/ktime.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
@@ -35,6 +36,7 @@ enum {
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
 	struct list_head    link;
+	struct rb_node      node;
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
@@ -52,6 +54,24 @@ struct wake_lock {
 #endif
 };
 
+/* Record format of /proc/wakelock_stats, one per wake lock. Times are in ns.
+ * The fields match the columns of /proc/wakelocks.
+ */
+#define WAKE_LOCK_STAT_NAME_LEN	64
+
+struct wake_lock_stat_record {
+	char		name[WAKE_LOCK_STAT_NAME_LEN];
+	__s32		count;
+	__s32		expire_count;
+	__s32		wakeup_count;
+	__s32		active;
+	__s64		active_since;
+	__s64		total_time;
+	__s64		sleep_time;
+	__s64		max_time;
+	__s64		last_change;
+};
+
 #ifdef CONFIG_HAS_WAKELOCK
 
 void wake_lock_init(struct wake_lock *lock, int type, const char *name);
@@ -776,6 +776,12 @@ static const char * const vmstat_text[] = {
 
 	"pgrotated",
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	"lmk_scans",
+	"lmk_kills",
+	"lmk_scan_usecs",
+#endif
+
 #ifdef CONFIG_COMPACTION
 	"compact_blocks_moved",
 	"compact_pages_moved",
@@ -0,0 +1,358 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o ashmem-stress ashmem-stress.c -lpthread */
+
+/*
+ * ashmem-stress.c -- ashmem pin/unpin throughput under reclaim
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Worker threads each own an ashmem area and unpin and pin random ranges
+ * of it, while a purge thread runs the ashmem shrinker over all areas
+ * with ASHMEM_PURGE_ALL_CACHES.  Purged ranges are written again after
+ * they are pinned, so the shrinker always has pages to reclaim.  The
+ * pin/unpin rate and latency are printed, with the purge rate and how
+ * many pins found their range purged.
+ *
+ * Reclaim should not stall pin/unpin on areas it is not working on:
+ * compare a run with -P 0 (no purging) against one with purging.  The
+ * purge ioctl needs CAP_SYS_ADMIN, e.g.
+ *
+ *	# ashmem-stress -w 8 -t 10
+ *	# ashmem-stress -w 8 -t 10 -P 0
+ *
+ *	-w N	worker threads, one area each (default 4)
+ *	-p N	pages per area (default 256)
+ *	-t N	seconds to run (default 5)
+ *	-P N	microseconds between purges, 0 for none (default 1000)
+ *
+ * With -f the program instead measures how range tracking scales: one
+ * area of N pages is cut into N/2 unpinned ranges by unpinning every
+ * other page, then single pages are pinned, unpinned and queried with
+ * ASHMEM_GET_PIN_STATUS at random for -t seconds and the mean time of
+ * each call is printed.  With a tree the times should grow with log N,
+ * with a list linearly in N, e.g.
+ *
+ *	# for n in 256 4096 65536; do ashmem-stress -f $n -t 2; done
+ *
+ *	-f N	fragment an area of N pages (N >= 2)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <linux/types.h>
+#include "../../include/linux/ashmem.h"
+
+#define PAGE		4096
+#define MAX_THREADS	64
+#define HIST_BUCKETS	24	/* log2 of the latency in us */
+
+struct worker {
+	pthread_t thread;
+	unsigned long ops;
+	unsigned long purged;
+	uint64_t lat_max;
+	unsigned long hist[HIST_BUCKETS];
+};
+
+static int nworkers = 4;
+static int pages = 256;
+static int seconds = 5;
+static int purge_us = 1000;
+static int frag_pages;
+
+static volatile int stop;
+static struct worker workers[MAX_THREADS];
+static unsigned long purges;
+static uint64_t purge_max;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "ashmem-stress: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static int ashmem_area(const char *name, size_t size, char **map)
+{
+	char buf[ASHMEM_NAME_LEN];
+	int fd;
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0)
+		die("open /dev/ashmem");
+	snprintf(buf, sizeof(buf), "%s", name);
+	if (ioctl(fd, ASHMEM_SET_NAME, buf) < 0)
+		die("ASHMEM_SET_NAME");
+	if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0)
+		die("ASHMEM_SET_SIZE");
+	*map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*map == MAP_FAILED)
+		die("mmap ashmem");
+	memset(*map, 0x5a, size);
+	return fd;
+}
+
+static void account(struct worker *w, uint64_t dt)
+{
+	int b;
+
+	w->ops++;
+	if (dt > w->lat_max)
+		w->lat_max = dt;
+	for (b = 0; b < HIST_BUCKETS - 1 && (dt >> 10) >> b; b++)
+		;
+	w->hist[b]++;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int seed = w - workers;
+	struct ashmem_pin pin;
+	char name[32], *map;
+	uint64_t t0;
+	int fd, ret, n;
+
+	snprintf(name, sizeof(name), "ashmem-stress-%d", (int)(w - workers));
+	fd = ashmem_area(name, (size_t)pages * PAGE, &map);
+
+	while (!stop) {
+		n = 1 + rand_r(&seed) % 16;
+		if (n > pages)
+			n = pages;
+		pin.offset = (rand_r(&seed) % (pages - n + 1)) * PAGE;
+		pin.len = n * PAGE;
+
+		t0 = now_ns();
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0)
+			die("ASHMEM_UNPIN");
+		account(w, now_ns() - t0);
+
+		/* leave the range to the shrinker for a moment */
+		sched_yield();
+
+		t0 = now_ns();
+		ret = ioctl(fd, ASHMEM_PIN, &pin);
+		if (ret < 0)
+			die("ASHMEM_PIN");
+		account(w, now_ns() - t0);
+
+		if (ret == ASHMEM_WAS_PURGED) {
+			w->purged++;
+			memset(map + pin.offset, 0x5a, pin.len);
+		}
+	}
+
+	munmap(map, (size_t)pages * PAGE);
+	close(fd);
+	return NULL;
+}
+
+static void *purge_fn(void *arg)
+{
+	uint64_t t0, dt;
+	int fd;
+
+	(void)arg;
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0)
+		die("open /dev/ashmem");
+
+	while (!stop) {
+		t0 = now_ns();
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0)
+			die("ASHMEM_PURGE_ALL_CACHES");
+		dt = now_ns() - t0;
+		purges++;
+		if (dt > purge_max)
+			purge_max = dt;
+		usleep(purge_us);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void timed_ioctl(int fd, int req, struct ashmem_pin *pin,
+			uint64_t *sum, unsigned long *calls)
+{
+	uint64_t t0 = now_ns();
+
+	if (ioctl(fd, req, pin) < 0)
+		die("ioctl");
+	*sum += now_ns() - t0;
+	(*calls)++;
+}
+
+/*
+ * Pins, unpins and queries single pages of an area kept at frag_pages/2
+ * unpinned ranges: even pages are unpinned, odd pages pinned.  Pinning
+ * an even page and unpinning it again leaves the range count unchanged.
+ */
+static void run_fragment(void)
+{
+	unsigned long pin_calls = 0, unpin_calls = 0, status_calls = 0;
+	uint64_t pin_sum = 0, unpin_sum = 0, status_sum = 0;
+	unsigned int seed = 1;
+	struct ashmem_pin pin;
+	uint64_t end;
+	char *map;
+	int fd, i;
+
+	fd = ashmem_area("ashmem-stress-frag", (size_t)frag_pages * PAGE,
+			 &map);
+	pin.len = PAGE;
+	for (i = 0; i + 1 < frag_pages; i += 2) {
+		pin.offset = i * PAGE;
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0)
+			die("ASHMEM_UNPIN");
+	}
+
+	end = now_ns() + seconds * 1000000000ULL;
+	while (now_ns() < end) {
+		pin.offset = (rand_r(&seed) % (frag_pages / 2)) * 2 * PAGE;
+		timed_ioctl(fd, ASHMEM_PIN, &pin, &pin_sum, &pin_calls);
+		timed_ioctl(fd, ASHMEM_UNPIN, &pin, &unpin_sum, &unpin_calls);
+		pin.offset += PAGE;
+		timed_ioctl(fd, ASHMEM_GET_PIN_STATUS, &pin, &status_sum,
+			    &status_calls);
+	}
+
+	printf("%d pages, %d unpinned ranges, %.0f calls/s\n", frag_pages,
+	       frag_pages / 2, (pin_calls + unpin_calls + status_calls) /
+	       (double)seconds);
+	printf("mean us: pin %.2f  unpin %.2f  pin status %.2f\n",
+	       pin_sum / 1000.0 / pin_calls, unpin_sum / 1000.0 / unpin_calls,
+	       status_sum / 1000.0 / status_calls);
+
+	munmap(map, (size_t)frag_pages * PAGE);
+	close(fd);
+}
+
+static double hist_pct(unsigned long *hist, unsigned long n, double p)
+{
+	unsigned long want = p * n, sum = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		sum += hist[b];
+		if (sum > want)
+			break;
+	}
+	/* upper bound of the bucket, in us */
+	return (1 << b) * 1.024;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long hist[HIST_BUCKETS] = { 0 };
+	unsigned long ops = 0, purged = 0;
+	uint64_t lat_max = 0, t0, t1;
+	pthread_t purger;
+	double secs;
+	int opt, i, b;
+
+	while ((opt = getopt(argc, argv, "w:p:t:P:f:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nworkers = atoi(optarg);
+			break;
+		case 'p':
+			pages = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'P':
+			purge_us = atoi(optarg);
+			break;
+		case 'f':
+			frag_pages = atoi(optarg);
+			if (frag_pages < 2)
+				frag_pages = -1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-w workers] [-p pages] "
+				"[-t seconds] [-P purge_us] [-f pages]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+	if (nworkers < 1 || nworkers > MAX_THREADS || pages < 1 ||
+	    seconds < 1 || purge_us < 0 || frag_pages < 0) {
+		fprintf(stderr, "ashmem-stress: 1-%d workers, at least a page "
+			"and a second, -f needs two pages\n", MAX_THREADS);
+		return 2;
+	}
+
+	if (frag_pages) {
+		run_fragment();
+		return 0;
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < nworkers; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn,
+			       &workers[i]);
+	if (purge_us)
+		pthread_create(&purger, NULL, purge_fn, NULL);
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	t1 = now_ns();
+	if (purge_us)
+		pthread_join(purger, NULL);
+
+	for (i = 0; i < nworkers; i++) {
+		ops += workers[i].ops;
+		purged += workers[i].purged;
+		if (workers[i].lat_max > lat_max)
+			lat_max = workers[i].lat_max;
+		for (b = 0; b < HIST_BUCKETS; b++)
+			hist[b] += workers[i].hist[b];
+	}
+	secs = (t1 - t0) / 1e9;
+
+	printf("%d workers, %d pages each, %.2f s\n", nworkers, pages, secs);
+	printf("pin/unpin: %.0f/s, %lu pins found the range purged\n",
+	       ops / secs, purged);
+	if (ops)
+		printf("pin/unpin latency us: p50 <%.0f  p99 <%.0f  "
+		       "p99.9 <%.0f  max %.1f\n", hist_pct(hist, ops, 0.5),
+		       hist_pct(hist, ops, 0.99), hist_pct(hist, ops, 0.999),
+		       lat_max / 1000.0);
+	if (purge_us)
+		printf("purges: %.0f/s, max %.1f us\n", purges / secs,
+		       purge_max / 1000.0);
+	else
+		printf("purges: none\n");
+	return 0;
+}
@@ -0,0 +1,506 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o binder-stress binder-stress.c */
+
+/*
+ * binder-stress.c -- concurrent binder transaction throughput and latency
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Runs a number of client/server process pairs against /dev/binder.  Each
+ * client sends synchronous transactions to its own server, which echoes
+ * the payload back, so the pairs only meet in the driver.  At the end the
+ * transaction rate of all pairs together and the round trip latency
+ * percentiles are printed.
+ *
+ * With a list of sizes each transaction picks one at random, so the
+ * driver's buffer allocator sees mixed parcel sizes that keep moving onto
+ * pages that were not used a moment ago.  Every round trip allocates two
+ * buffers (the transaction and the reply); their rate is printed as well.
+ *
+ * The program needs /dev/binder for itself: it becomes the context
+ * manager, so stop servicemanager (and the Android runtime) first.  Run
+ * it on the kernel before and after a binder locking change with the same
+ * arguments and compare the numbers, e.g.
+ *
+ *	# stop; binder-stress -p 16 -n 20000 -s 256
+ *
+ *	-p N	number of client/server pairs (default 8)
+ *	-n N	transactions per client (default 10000)
+ *	-s N[,N...]	payload sizes in bytes (default 128)
+ *
+ * and for the allocator, e.g.
+ *
+ *	# binder-stress -p 4 -n 50000 -s 16,200,1500,4096,12000,40000
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../drivers/staging/android/binder.h"
+
+#define MAP_SIZE	((1024 * 1024) - 2 * 4096)
+#define MAX_PAYLOAD	(64 * 1024)
+
+/* manager transaction codes */
+#define CODE_REGISTER	1
+#define CODE_LOOKUP	2
+/* client to server */
+#define CODE_ECHO	3
+
+#define MAX_PAIRS	256
+#define MAX_SIZES	16
+
+struct bctx {
+	int fd;
+	void *map;
+};
+
+static int pairs = 8;
+static int iterations = 10000;
+static size_t sizes[MAX_SIZES] = { 128 };
+static int nsizes = 1;
+
+/* shared with the children */
+static uint64_t *latency;	/* pairs * iterations round trips, in ns */
+static volatile int *ready;	/* servers registered */
+
+static void die(const char *what)
+{
+	fprintf(stderr, "binder-stress[%d]: %s: %s\n", getpid(), what,
+		strerror(errno));
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void binder_open(struct bctx *b)
+{
+	struct binder_version vers;
+
+	b->fd = open("/dev/binder", O_RDWR);
+	if (b->fd < 0)
+		die("open /dev/binder");
+	if (ioctl(b->fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder-stress: protocol %ld, expected %d\n",
+			vers.protocol_version,
+			BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	b->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, b->fd, 0);
+	if (b->map == MAP_FAILED)
+		die("mmap /dev/binder");
+}
+
+static void binder_write(struct bctx *b, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	if (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0)
+		die("BINDER_WRITE_READ write");
+}
+
+/* Command stream builder */
+struct cmdbuf {
+	uint8_t data[512];
+	size_t len;
+};
+
+static void put(struct cmdbuf *c, uint32_t cmd, const void *arg, size_t len)
+{
+	memcpy(c->data + c->len, &cmd, sizeof(cmd));
+	c->len += sizeof(cmd);
+	if (len) {
+		memcpy(c->data + c->len, arg, len);
+		c->len += len;
+	}
+}
+
+static void put_free(struct cmdbuf *c, const void *buffer)
+{
+	put(c, BC_FREE_BUFFER, &buffer, sizeof(buffer));
+}
+
+static void put_txn(struct cmdbuf *c, uint32_t cmd, size_t handle,
+		    uint32_t code, const void *data, size_t size,
+		    const size_t *offs, size_t noffs)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = noffs * sizeof(size_t);
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offs;
+	put(c, cmd, &tr, sizeof(tr));
+}
+
+/*
+ * Reads until a transaction or a reply arrives, answering reference
+ * count requests on the way.  Returns BR_TRANSACTION or BR_REPLY with
+ * *tr filled in.
+ */
+static uint32_t binder_wait(struct bctx *b, struct binder_transaction_data *tr)
+{
+	static uint8_t rbuf[4096];
+	static size_t rpos, rlen;
+	struct binder_write_read bwr;
+	struct binder_ptr_cookie pc;
+	struct cmdbuf c;
+	uint32_t cmd;
+
+	for (;;) {
+		if (rpos == rlen) {
+			memset(&bwr, 0, sizeof(bwr));
+			bwr.read_size = sizeof(rbuf);
+			bwr.read_buffer = (unsigned long)rbuf;
+			if (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0) {
+				if (errno == EINTR)
+					continue;
+				die("BINDER_WRITE_READ read");
+			}
+			rpos = 0;
+			rlen = bwr.read_consumed;
+			continue;
+		}
+
+		memcpy(&cmd, rbuf + rpos, sizeof(cmd));
+		rpos += sizeof(cmd);
+		c.len = 0;
+
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_SPAWN_LOOPER:
+		case BR_TRANSACTION_COMPLETE:
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+			memcpy(&pc, rbuf + rpos, sizeof(pc));
+			rpos += sizeof(pc);
+			put(&c, cmd == BR_INCREFS ?
+			    BC_INCREFS_DONE : BC_ACQUIRE_DONE, &pc, sizeof(pc));
+			binder_write(b, c.data, c.len);
+			break;
+		case BR_RELEASE:
+		case BR_DECREFS:
+			rpos += sizeof(pc);
+			break;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, rbuf + rpos, sizeof(*tr));
+			rpos += sizeof(*tr);
+			return cmd;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			fprintf(stderr, "binder-stress[%d]: transaction failed "
+				"(%s)\n", getpid(), cmd == BR_DEAD_REPLY ?
+				"dead reply" : "failed reply");
+			exit(1);
+		default:
+			fprintf(stderr, "binder-stress[%d]: unexpected "
+				"command 0x%x\n", getpid(), cmd);
+			exit(1);
+		}
+	}
+}
+
+/*
+ * The context manager is a small name service: servers register their
+ * object under a pair number and clients look it up.
+ */
+static void run_manager(void)
+{
+	static long handles[MAX_PAIRS];
+	struct flat_binder_object obj;
+	struct binder_transaction_data tr;
+	struct cmdbuf c;
+	uint32_t idx;
+	size_t off = 0;
+	struct bctx b;
+	int desc;
+
+	binder_open(&b);
+	if (ioctl(b.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+	c.len = 0;
+	put(&c, BC_ENTER_LOOPER, NULL, 0);
+	binder_write(&b, c.data, c.len);
+
+	for (;;) {
+		if (binder_wait(&b, &tr) != BR_TRANSACTION)
+			continue;
+
+		c.len = 0;
+		if (tr.code == CODE_REGISTER) {
+			memcpy(&obj, tr.data.ptr.buffer, sizeof(obj));
+			memcpy(&idx, (const uint8_t *)tr.data.ptr.buffer +
+			       sizeof(obj), sizeof(idx));
+			handles[idx] = obj.handle;
+			desc = obj.handle;
+			/* keep the reference once the buffer is freed */
+			put(&c, BC_ACQUIRE, &desc, sizeof(desc));
+			put_free(&c, tr.data.ptr.buffer);
+			put_txn(&c, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+			__sync_fetch_and_add(ready, 1);
+		} else {
+			memcpy(&idx, tr.data.ptr.buffer, sizeof(idx));
+			memset(&obj, 0, sizeof(obj));
+			obj.type = BINDER_TYPE_HANDLE;
+			obj.handle = handles[idx];
+			put_free(&c, tr.data.ptr.buffer);
+			put_txn(&c, BC_REPLY, 0, 0, &obj, sizeof(obj),
+				&off, 1);
+		}
+		binder_write(&b, c.data, c.len);
+	}
+}
+
+static void run_server(uint32_t idx)
+{
+	static uint8_t echo[MAX_PAYLOAD];
+	struct {
+		struct flat_binder_object obj;
+		uint32_t idx;
+	} reg;
+	struct binder_transaction_data tr;
+	struct cmdbuf c;
+	size_t off = 0;
+	struct bctx b;
+
+	binder_open(&b);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.flags = 0x7f;
+	reg.obj.binder = &reg;
+	reg.obj.cookie = &reg;
+	reg.idx = idx;
+	c.len = 0;
+	put_txn(&c, BC_TRANSACTION, 0, CODE_REGISTER, &reg, sizeof(reg),
+		&off, 1);
+	binder_write(&b, c.data, c.len);
+	while (binder_wait(&b, &tr) != BR_REPLY)
+		;
+	c.len = 0;
+	put_free(&c, tr.data.ptr.buffer);
+	put(&c, BC_ENTER_LOOPER, NULL, 0);
+	binder_write(&b, c.data, c.len);
+
+	for (;;) {
+		if (binder_wait(&b, &tr) != BR_TRANSACTION)
+			continue;
+		memcpy(echo, tr.data.ptr.buffer, tr.data_size);
+		c.len = 0;
+		put_free(&c, tr.data.ptr.buffer);
+		put_txn(&c, BC_REPLY, 0, 0, echo, tr.data_size, NULL, 0);
+		binder_write(&b, c.data, c.len);
+	}
+}
+
+static void run_client(uint32_t idx)
+{
+	static uint8_t data[MAX_PAYLOAD];
+	struct flat_binder_object obj;
+	struct binder_transaction_data tr;
+	uint64_t *lat = latency + (size_t)idx * iterations;
+	struct cmdbuf c;
+	uint64_t t0;
+	struct bctx b;
+	unsigned int seed = idx;
+	size_t payload;
+	int handle;
+	int i;
+
+	binder_open(&b);
+
+	c.len = 0;
+	put_txn(&c, BC_TRANSACTION, 0, CODE_LOOKUP, &idx, sizeof(idx),
+		NULL, 0);
+	binder_write(&b, c.data, c.len);
+	while (binder_wait(&b, &tr) != BR_REPLY)
+		;
+	memcpy(&obj, tr.data.ptr.buffer, sizeof(obj));
+	handle = obj.handle;
+	c.len = 0;
+	put(&c, BC_ACQUIRE, &handle, sizeof(handle));
+	put_free(&c, tr.data.ptr.buffer);
+	binder_write(&b, c.data, c.len);
+
+	memset(data, idx, MAX_PAYLOAD);
+	for (i = 0; i < iterations; i++) {
+		payload = sizes[nsizes > 1 ? rand_r(&seed) % nsizes : 0];
+		t0 = now_ns();
+		c.len = 0;
+		put_txn(&c, BC_TRANSACTION, handle, CODE_ECHO, data, payload,
+			NULL, 0);
+		binder_write(&b, c.data, c.len);
+		while (binder_wait(&b, &tr) != BR_REPLY)
+			;
+		if (tr.data_size != payload)
+			fprintf(stderr, "binder-stress[%d]: reply of %zu "
+				"bytes, sent %zu\n", getpid(),
+				tr.data_size, payload);
+		c.len = 0;
+		put_free(&c, tr.data.ptr.buffer);
+		binder_write(&b, c.data, c.len);
+		lat[i] = now_ns() - t0;
+	}
+	exit(0);
+}
+
+static pid_t spawn(void (*fn)(uint32_t), uint32_t arg)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("fork");
+	if (pid == 0)
+		fn(arg);
+	return pid;
+}
+
+static void run_manager_arg(uint32_t unused)
+{
+	(void)unused;
+	run_manager();
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(const uint64_t *sorted, size_t n, double p)
+{
+	return sorted[(size_t)(p * (n - 1))] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+	pid_t manager, servers[MAX_PAIRS], clients[MAX_PAIRS];
+	char *tok, *save;
+	size_t total;
+	uint64_t t0, t1;
+	int opt, i, status, failed = 0;
+
+	while ((opt = getopt(argc, argv, "p:n:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			pairs = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			nsizes = 0;
+			for (tok = strtok_r(optarg, ",", &save);
+			     tok && nsizes < MAX_SIZES;
+			     tok = strtok_r(NULL, ",", &save))
+				sizes[nsizes++] = atoi(tok);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p pairs] [-n transactions]"
+				" [-s bytes[,bytes...]]\n", argv[0]);
+			return 2;
+		}
+	}
+	for (i = 0; i < nsizes; i++)
+		if (sizes[i] > MAX_PAYLOAD)
+			nsizes = 0;
+	if (pairs < 1 || pairs > MAX_PAIRS || iterations < 1 || !nsizes) {
+		fprintf(stderr, "binder-stress: 1-%d pairs, at least one "
+			"transaction, at most %d bytes\n", MAX_PAIRS,
+			MAX_PAYLOAD);
+		return 2;
+	}
+
+	total = (size_t)pairs * iterations;
+	latency = mmap(NULL, total * sizeof(*latency) + sizeof(int),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	if (latency == MAP_FAILED)
+		die("mmap");
+	ready = (volatile int *)(latency + total);
+
+	manager = spawn(run_manager_arg, 0);
+	for (i = 0; i < pairs; i++)
+		servers[i] = spawn(run_server, i);
+	while (*ready < pairs) {
+		if (waitpid(-1, &status, WNOHANG) > 0) {
+			fprintf(stderr, "binder-stress: setup failed\n");
+			for (i = 0; i < pairs; i++)
+				kill(servers[i], SIGTERM);
+			kill(manager, SIGTERM);
+			return 1;
+		}
+		usleep(1000);
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < pairs; i++)
+		clients[i] = spawn(run_client, i);
+	for (i = 0; i < pairs; i++) {
+		waitpid(clients[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	}
+	t1 = now_ns();
+
+	for (i = 0; i < pairs; i++)
+		kill(servers[i], SIGTERM);
+	kill(manager, SIGTERM);
+	while (wait(NULL) > 0)
+		;
+
+	if (failed) {
+		fprintf(stderr, "binder-stress: %d clients failed\n", failed);
+		return 1;
+	}
+
+	qsort(latency, total, sizeof(*latency), cmp_u64);
+	printf("%d pairs, %d transactions each, %.2f s, sizes", pairs,
+	       iterations, (t1 - t0) / 1e9);
+	for (i = 0; i < nsizes; i++)
+		printf(" %zu", sizes[i]);
+	printf("\nthroughput: %.0f transactions/s, %.0f buffer allocations/s\n",
+	       total / ((t1 - t0) / 1e9), 2 * total / ((t1 - t0) / 1e9));
+	printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  "
+	       "max %.1f\n", pct(latency, total, 0.5),
+	       pct(latency, total, 0.9), pct(latency, total, 0.99),
+	       pct(latency, total, 0.999), latency[total - 1] / 1000.0);
+	return 0;
+}
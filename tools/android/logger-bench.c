@@ -0,0 +1,298 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o logger-bench logger-bench.c -lpthread */
+
+/*
+ * logger-bench.c -- concurrent writers and readers on an Android log
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Writer threads log as fast as they can while reader threads drain the
+ * same log, for a fixed time.  For the writers the write rate and the
+ * writev() latency are printed, for each reader the entries it read and
+ * the entries it lost because the writers overran it.  A write should
+ * never wait for a reader, so the write latency must not grow with the
+ * number of readers: run it with -r 0 and with several readers and
+ * compare.
+ *
+ * Every message carries the writer number and a sequence number, which
+ * is how a reader counts the entries it missed.  The program writes real
+ * entries, so use a log nobody depends on, or expect logcat to be
+ * flooded, e.g.
+ *
+ *	# logger-bench -d /dev/log/radio -w 8 -r 3 -t 10
+ *
+ *	-d PATH	log device (default /dev/log/main)
+ *	-w N	writer threads (default 4)
+ *	-r N	reader threads (default 2)
+ *	-t N	seconds to run (default 5)
+ *	-l N	message length in bytes (default 64)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "../../drivers/staging/android/logger.h"
+
+#define MAX_THREADS	64
+#define TAG		"logger-bench"
+#define HIST_BUCKETS	24	/* log2 of the latency in us */
+
+struct writer {
+	pthread_t thread;
+	unsigned long writes;
+	unsigned long errors;
+	uint64_t lat_sum;
+	uint64_t lat_max;
+	unsigned long hist[HIST_BUCKETS];
+};
+
+struct reader {
+	pthread_t thread;
+	unsigned long entries;
+	unsigned long lost;
+	unsigned long foreign;
+	uint32_t next_seq[MAX_THREADS];
+};
+
+static const char *device = "/dev/log/main";
+static int nwriters = 4;
+static int nreaders = 2;
+static int seconds = 5;
+static int msglen = 64;
+
+static volatile int stop;
+static struct writer writers[MAX_THREADS];
+static struct reader readers[MAX_THREADS];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_log(int flags)
+{
+	int fd = open(device, flags);
+
+	if (fd < 0) {
+		fprintf(stderr, "logger-bench: %s: %s\n", device,
+			strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	int idx = w - writers;
+	char msg[LOGGER_ENTRY_MAX_PAYLOAD];
+	unsigned char prio = 3;		/* debug */
+	struct iovec vec[3];
+	uint64_t t0, dt;
+	uint32_t seq = 0;
+	int fd, n, b;
+
+	fd = open_log(O_WRONLY);
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = TAG;
+	vec[1].iov_len = sizeof(TAG);
+	vec[2].iov_base = msg;
+
+	memset(msg, 'x', sizeof(msg));
+	while (!stop) {
+		n = snprintf(msg, sizeof(msg), "%d %u ", idx, seq);
+		if (n < msglen) {
+			msg[n] = 'x';
+			n = msglen;
+		}
+		msg[n] = '\0';
+		vec[2].iov_len = n + 1;
+
+		t0 = now_ns();
+		if (writev(fd, vec, 3) < 0) {
+			w->errors++;
+			continue;
+		}
+		dt = now_ns() - t0;
+		msg[n] = 'x';
+
+		seq++;
+		w->writes++;
+		w->lat_sum += dt;
+		if (dt > w->lat_max)
+			w->lat_max = dt;
+		for (b = 0; b < HIST_BUCKETS - 1 && (dt >> 10) >> b; b++)
+			;
+		w->hist[b]++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *reader_fn(void *arg)
+{
+	struct reader *r = arg;
+	unsigned char buf[LOGGER_ENTRY_MAX_LEN + 1];
+	struct logger_entry *e = (struct logger_entry *)buf;
+	struct pollfd pfd;
+	const char *tag, *msg;
+	unsigned int idx, seq;
+	int fd, ret;
+
+	fd = open_log(O_RDONLY | O_NONBLOCK);
+	/* start from the end so old entries are not counted */
+	while (read(fd, buf, sizeof(buf) - 1) > 0)
+		;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop) {
+		ret = read(fd, buf, sizeof(buf) - 1);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				poll(&pfd, 1, 100);
+			continue;
+		}
+		buf[ret] = '\0';
+
+		/* payload: priority, tag, message */
+		tag = e->msg + 1;
+		if (strcmp(tag, TAG) != 0) {
+			r->foreign++;
+			continue;
+		}
+		msg = tag + sizeof(TAG);
+		if (sscanf(msg, "%u %u", &idx, &seq) != 2 ||
+		    idx >= MAX_THREADS)
+			continue;
+
+		r->entries++;
+		if (seq > r->next_seq[idx])
+			r->lost += seq - r->next_seq[idx];
+		r->next_seq[idx] = seq + 1;
+	}
+	close(fd);
+	return NULL;
+}
+
+static double hist_pct(unsigned long *hist, unsigned long n, double p)
+{
+	unsigned long want = p * n, sum = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		sum += hist[b];
+		if (sum > want)
+			break;
+	}
+	/* upper bound of the bucket, in us */
+	return (1 << b) * 1.024;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long hist[HIST_BUCKETS] = { 0 };
+	unsigned long writes = 0, errors = 0;
+	uint64_t lat_sum = 0, lat_max = 0, t0, t1;
+	double secs;
+	int opt, i, b;
+
+	while ((opt = getopt(argc, argv, "d:w:r:t:l:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'w':
+			nwriters = atoi(optarg);
+			break;
+		case 'r':
+			nreaders = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			msglen = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-w writers] "
+				"[-r readers] [-t seconds] [-l bytes]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+	if (nwriters < 1 || nwriters > MAX_THREADS || nreaders < 0 ||
+	    nreaders > MAX_THREADS || seconds < 1 || msglen < 16 ||
+	    msglen >= (int)(LOGGER_ENTRY_MAX_PAYLOAD - sizeof(TAG) - 1)) {
+		fprintf(stderr, "logger-bench: 1-%d writers, 0-%d readers, "
+			"at least a second, 16-%d byte messages\n",
+			MAX_THREADS, MAX_THREADS,
+			(int)(LOGGER_ENTRY_MAX_PAYLOAD - sizeof(TAG) - 2));
+		return 2;
+	}
+
+	for (i = 0; i < nreaders; i++)
+		pthread_create(&readers[i].thread, NULL, reader_fn,
+			       &readers[i]);
+	usleep(100000);
+
+	t0 = now_ns();
+	for (i = 0; i < nwriters; i++)
+		pthread_create(&writers[i].thread, NULL, writer_fn,
+			       &writers[i]);
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nwriters; i++)
+		pthread_join(writers[i].thread, NULL);
+	t1 = now_ns();
+	for (i = 0; i < nreaders; i++)
+		pthread_join(readers[i].thread, NULL);
+
+	for (i = 0; i < nwriters; i++) {
+		writes += writers[i].writes;
+		errors += writers[i].errors;
+		lat_sum += writers[i].lat_sum;
+		if (writers[i].lat_max > lat_max)
+			lat_max = writers[i].lat_max;
+		for (b = 0; b < HIST_BUCKETS; b++)
+			hist[b] += writers[i].hist[b];
+	}
+	secs = (t1 - t0) / 1e9;
+
+	printf("%s: %d writers, %d readers, %d byte messages, %.2f s\n",
+	       device, nwriters, nreaders, msglen, secs);
+	printf("writes: %.0f/s, %lu errors\n", writes / secs, errors);
+	if (writes)
+		printf("write latency us: mean %.1f  p99 <%.0f  p99.9 <%.0f  "
+		       "max %.1f\n", lat_sum / 1000.0 / writes,
+		       hist_pct(hist, writes, 0.99),
+		       hist_pct(hist, writes, 0.999), lat_max / 1000.0);
+	for (i = 0; i < nreaders; i++)
+		printf("reader %d: %.0f entries/s, %lu lost, %lu from other "
+		       "writers\n", i, readers[i].entries / secs,
+		       readers[i].lost, readers[i].foreign);
+	return 0;
+}
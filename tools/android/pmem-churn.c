@@ -0,0 +1,235 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o pmem-churn pmem-churn.c */
+
+/*
+ * pmem-churn.c -- pmem allocation failure rate and latency under churn
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Allocates and frees pmem buffers of random, mostly non power of two
+ * sizes, keeping up to -l of them alive, and prints how many allocations
+ * failed and how long they took.  Part of the allocations are mapped
+ * like a frame buffer would be; the others are made with PMEM_ALLOCATE
+ * and left idle and unmapped, which is what compaction may move.
+ *
+ * Run it on an otherwise idle region, once with compaction off and once
+ * with it on, and read the fragmentation statistics afterwards, e.g.
+ *
+ *	# echo 0 > /sys/module/pmem/parameters/compact
+ *	# pmem-churn -d /dev/pmem -n 20000 -M 9216
+ *	# echo 1 > /sys/module/pmem/parameters/compact
+ *	# pmem-churn -d /dev/pmem -n 20000 -M 9216
+ *	# cat /sys/kernel/debug/pmem
+ *
+ *	-d PATH	pmem device (default /dev/pmem)
+ *	-n N	allocate/free operations (default 10000)
+ *	-l N	most allocations alive at once (default 32)
+ *	-m N	smallest allocation in KiB (default 64)
+ *	-M N	largest allocation in KiB (default 8192)
+ *	-i N	percentage of allocations left idle and unmapped (default 50)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+
+/* from include/linux/android_pmem.h, which is not usable from userspace */
+#define PMEM_IOCTL_MAGIC	'p'
+#define PMEM_ALLOCATE		_IOW(PMEM_IOCTL_MAGIC, 5, unsigned int)
+
+#define PAGE		4096
+#define MAX_LIVE	1024
+#define HIST_BUCKETS	24	/* log2 of the latency in us */
+
+struct alloc {
+	int fd;
+	void *map;
+	size_t size;
+};
+
+static const char *device = "/dev/pmem";
+static int iterations = 10000;
+static int max_live = 32;
+static int min_kb = 64;
+static int max_kb = 8192;
+static int idle_pct = 50;
+
+static struct alloc live[MAX_LIVE];
+static int nlive;
+
+static unsigned long attempts, failures, frees;
+static unsigned long long bytes_failed;
+static uint64_t lat_sum, lat_max;
+static unsigned long hist[HIST_BUCKETS];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account(uint64_t dt)
+{
+	int b;
+
+	lat_sum += dt;
+	if (dt > lat_max)
+		lat_max = dt;
+	for (b = 0; b < HIST_BUCKETS - 1 && (dt >> 10) >> b; b++)
+		;
+	hist[b]++;
+}
+
+static void do_alloc(unsigned int *seed)
+{
+	struct alloc *a = &live[nlive];
+	int idle = (int)(rand_r(seed) % 100) < idle_pct;
+	uint64_t t0;
+	int ok;
+
+	a->size = (min_kb + rand_r(seed) % (max_kb - min_kb + 1)) * 1024UL;
+	a->size = (a->size + PAGE - 1) & ~(size_t)(PAGE - 1);
+	a->map = NULL;
+	a->fd = open(device, O_RDWR);
+	if (a->fd < 0) {
+		fprintf(stderr, "pmem-churn: %s: %s\n", device,
+			strerror(errno));
+		exit(1);
+	}
+
+	attempts++;
+	t0 = now_ns();
+	if (idle) {
+		ioctl(a->fd, PMEM_ALLOCATE, a->size);
+		account(now_ns() - t0);
+		/*
+		 * PMEM_ALLOCATE does not report a failed allocation, but a
+		 * second one is refused once the file has an allocation.
+		 * Asking for the size instead would mark the buffer as handed
+		 * out and keep compaction away from it.
+		 */
+		ok = ioctl(a->fd, PMEM_ALLOCATE, a->size) < 0 &&
+		     errno == EINVAL;
+	} else {
+		a->map = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, a->fd, 0);
+		account(now_ns() - t0);
+		ok = a->map != MAP_FAILED;
+		if (ok)
+			memset(a->map, 0, PAGE);
+		else
+			a->map = NULL;
+	}
+
+	if (!ok) {
+		failures++;
+		bytes_failed += a->size;
+		close(a->fd);
+		return;
+	}
+	nlive++;
+}
+
+static void do_free(unsigned int *seed)
+{
+	int i = rand_r(seed) % nlive;
+
+	if (live[i].map)
+		munmap(live[i].map, live[i].size);
+	close(live[i].fd);
+	live[i] = live[--nlive];
+	frees++;
+}
+
+static double hist_pct(double p)
+{
+	unsigned long want = p * attempts, sum = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		sum += hist[b];
+		if (sum > want)
+			break;
+	}
+	/* upper bound of the bucket, in us */
+	return (1 << b) * 1.024;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seed = 1;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:n:l:m:M:i:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'l':
+			max_live = atoi(optarg);
+			break;
+		case 'm':
+			min_kb = atoi(optarg);
+			break;
+		case 'M':
+			max_kb = atoi(optarg);
+			break;
+		case 'i':
+			idle_pct = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-n ops] "
+				"[-l live] [-m min_kb] [-M max_kb] "
+				"[-i idle_pct]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (iterations < 1 || max_live < 1 || max_live > MAX_LIVE ||
+	    min_kb < 4 || max_kb < min_kb || idle_pct < 0 || idle_pct > 100) {
+		fprintf(stderr, "pmem-churn: 1-%d live allocations, "
+			"4 <= min_kb <= max_kb, idle 0-100%%\n", MAX_LIVE);
+		return 2;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		if (nlive < max_live && (nlive == 0 || rand_r(&seed) % 2))
+			do_alloc(&seed);
+		else
+			do_free(&seed);
+	}
+	while (nlive)
+		do_free(&seed);
+
+	printf("%s: %lu allocations, %lu frees, %d-%d KiB, %d%% idle\n",
+	       device, attempts, frees, min_kb, max_kb, idle_pct);
+	printf("failed: %lu (%.2f%%), %llu KiB\n", failures,
+	       100.0 * failures / attempts, bytes_failed / 1024);
+	printf("allocation latency us: mean %.1f  p99 <%.0f  max %.1f\n",
+	       lat_sum / 1000.0 / attempts, hist_pct(0.99),
+	       lat_max / 1000.0);
+	return 0;
+}
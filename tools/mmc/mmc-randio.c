@@ -0,0 +1,263 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o mmc-randio mmc-randio.c -lpthread */
+
+/*
+ * mmc-randio.c -- random read/write IOPS of a block device
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * A small stand-in for fio on boards that do not have it: -j threads
+ * each issue O_DIRECT reads (and with -w, writes) of -b bytes at random
+ * aligned offsets for -t seconds, so up to -j requests are outstanding
+ * and the host driver can prepare one while another is on the bus.
+ * IOPS, throughput and latency percentiles are printed for reads and
+ * writes separately.
+ *
+ * Writes destroy the data in the tested range, so use a spare partition,
+ * and limit the range with -r to keep the card's own caching honest,
+ * e.g.
+ *
+ *	# mmc-randio -d /dev/mmcblk0 -j 4 -t 30
+ *	# mmc-randio -d /dev/mmcblk0p7 -j 4 -t 30 -w 30
+ *
+ *	-d PATH	block device or file (default /dev/mmcblk0)
+ *	-j N	threads, i.e. outstanding requests (default 1)
+ *	-b N	request size in bytes, a multiple of 512 (default 4096)
+ *	-t N	seconds to run (default 10)
+ *	-w N	percentage of writes (default 0)
+ *	-r N	only use the first N MiB (default the whole device)
+ */
+
+#define _GNU_SOURCE	/* O_DIRECT */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/fs.h>
+
+#define MAX_THREADS	64
+#define HIST_BUCKETS	24	/* log2 of the latency in us */
+
+struct iostat {
+	unsigned long ops;
+	uint64_t lat_sum;
+	uint64_t lat_max;
+	unsigned long hist[HIST_BUCKETS];
+};
+
+struct job {
+	pthread_t thread;
+	struct iostat rd, wr;
+};
+
+static const char *device = "/dev/mmcblk0";
+static int nthreads = 1;
+static int bs = 4096;
+static int seconds = 10;
+static int write_pct;
+static unsigned long long range;
+
+static int fd;
+static volatile int stop;
+static struct job jobs[MAX_THREADS];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "mmc-randio: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static void account(struct iostat *s, uint64_t dt)
+{
+	int b;
+
+	s->ops++;
+	s->lat_sum += dt;
+	if (dt > s->lat_max)
+		s->lat_max = dt;
+	for (b = 0; b < HIST_BUCKETS - 1 && (dt >> 10) >> b; b++)
+		;
+	s->hist[b]++;
+}
+
+static void *job_fn(void *arg)
+{
+	struct job *j = arg;
+	unsigned int seed = j - jobs + 1;
+	unsigned long long blocks = range / bs, blk;
+	uint64_t t0;
+	ssize_t ret;
+	int write;
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, bs))
+		die("posix_memalign");
+	memset(buf, 0x5a, bs);
+
+	while (!stop) {
+		blk = (((unsigned long long)rand_r(&seed) << 31) ^
+		       rand_r(&seed)) % blocks;
+		write = (int)(rand_r(&seed) % 100) < write_pct;
+
+		t0 = now_ns();
+		if (write)
+			ret = pwrite(fd, buf, bs, blk * bs);
+		else
+			ret = pread(fd, buf, bs, blk * bs);
+		if (ret != bs)
+			die(write ? "pwrite" : "pread");
+		account(write ? &j->wr : &j->rd, now_ns() - t0);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static double hist_pct(struct iostat *s, double p)
+{
+	unsigned long want = p * s->ops, sum = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		sum += s->hist[b];
+		if (sum > want)
+			break;
+	}
+	/* upper bound of the bucket, in us */
+	return (1 << b) * 1.024;
+}
+
+static void report(const char *what, struct iostat *s, double secs)
+{
+	if (!s->ops)
+		return;
+	printf("%s: %.0f IOPS, %.2f MB/s, latency us: mean %.0f  p50 <%.0f  "
+	       "p99 <%.0f  max %.0f\n", what, s->ops / secs,
+	       s->ops * (double)bs / secs / 1e6,
+	       s->lat_sum / 1000.0 / s->ops, hist_pct(s, 0.5),
+	       hist_pct(s, 0.99), s->lat_max / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+	struct iostat rd, wr;
+	unsigned long long size;
+	struct stat st;
+	uint64_t t0, t1;
+	double secs;
+	int opt, i, b;
+
+	while ((opt = getopt(argc, argv, "d:j:b:t:w:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'b':
+			bs = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			write_pct = atoi(optarg);
+			break;
+		case 'r':
+			range = strtoull(optarg, NULL, 0) << 20;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-j threads] "
+				"[-b bytes] [-t seconds] [-w write_pct] "
+				"[-r MiB]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (nthreads < 1 || nthreads > MAX_THREADS || bs < 512 ||
+	    bs % 512 || seconds < 1 || write_pct < 0 || write_pct > 100) {
+		fprintf(stderr, "mmc-randio: 1-%d threads, a multiple of 512 "
+			"bytes, at least a second, 0-100%% writes\n",
+			MAX_THREADS);
+		return 2;
+	}
+
+	fd = open(device, (write_pct ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0)
+		die(device);
+	if (fstat(fd, &st) < 0)
+		die(device);
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+			die("BLKGETSIZE64");
+	} else {
+		size = st.st_size;
+	}
+	if (!range || range > size)
+		range = size;
+	if (range < (unsigned long long)bs) {
+		fprintf(stderr, "mmc-randio: %s is smaller than a request\n",
+			device);
+		return 2;
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&jobs[i].thread, NULL, job_fn, &jobs[i]);
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(jobs[i].thread, NULL);
+	t1 = now_ns();
+
+	memset(&rd, 0, sizeof(rd));
+	memset(&wr, 0, sizeof(wr));
+	for (i = 0; i < nthreads; i++) {
+		rd.ops += jobs[i].rd.ops;
+		rd.lat_sum += jobs[i].rd.lat_sum;
+		if (jobs[i].rd.lat_max > rd.lat_max)
+			rd.lat_max = jobs[i].rd.lat_max;
+		wr.ops += jobs[i].wr.ops;
+		wr.lat_sum += jobs[i].wr.lat_sum;
+		if (jobs[i].wr.lat_max > wr.lat_max)
+			wr.lat_max = jobs[i].wr.lat_max;
+		for (b = 0; b < HIST_BUCKETS; b++) {
+			rd.hist[b] += jobs[i].rd.hist[b];
+			wr.hist[b] += jobs[i].wr.hist[b];
+		}
+	}
+	secs = (t1 - t0) / 1e9;
+
+	printf("%s: %d threads, %d byte requests over %llu MiB, %d%% writes, "
+	       "%.2f s\n", device, nthreads, bs, range >> 20, write_pct, secs);
+	report("read ", &rd, secs);
+	report("write", &wr, secs);
+	return 0;
+}
@@ -0,0 +1,279 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o fec-flood fec-flood.c */
+
+/*
+ * fec-flood.c -- Ethernet receive flood and interrupt/softirq load meter
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Two halves of one test.  On a host wired to the board, "send" floods
+ * the board's MAC address with raw frames of an experimental ethertype,
+ * which the board receives and then drops in the stack.  On the board,
+ * "watch" prints once a second how many packets the interface received
+ * and dropped and where the CPU time went: hard interrupts, softirqs
+ * (where NAPI polling runs), system, user and idle.
+ *
+ * With the receive path in hard interrupt context the board spends
+ * nearly all its time in "irq" under the flood and userspace stops;
+ * with NAPI the work moves to "soft" and user and idle time remain.
+ * Repeat with different coalescing settings (ethtool -C eth0 rx-usecs N
+ * rx-frames N) to see their effect, e.g.
+ *
+ *	host#  fec-flood send -i eth1 -d 00:04:9f:01:02:03 -t 30
+ *	board# fec-flood watch -i eth0 -t 30
+ *
+ *	-i IF	interface (default eth0)
+ *	-d MAC	destination, for send
+ *	-s N	frame size in bytes, 60-1514, for send (default 60)
+ *	-t N	seconds to run (default 10)
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#define ETH_P_FLOOD	0x88b5	/* IEEE local experimental */
+
+static const char *ifname = "eth0";
+static unsigned char dst[ETH_ALEN];
+static int have_dst;
+static int frame_size = 60;
+static int seconds = 10;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "fec-flood: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static int run_send(void)
+{
+	unsigned char frame[ETH_FRAME_LEN];
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+	unsigned long sent = 0, errors = 0;
+	double start, end;
+	int fd;
+
+	if (!have_dst) {
+		fprintf(stderr, "fec-flood: send needs -d MAC\n");
+		return 2;
+	}
+
+	fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_FLOOD));
+	if (fd < 0)
+		die("socket");
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+		die(ifname);
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = ifr.ifr_ifindex;
+	sll.sll_halen = ETH_ALEN;
+	memcpy(sll.sll_addr, dst, ETH_ALEN);
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
+		die(ifname);
+
+	memset(frame, 0xa5, sizeof(frame));
+	memcpy(frame, dst, ETH_ALEN);
+	memcpy(frame + ETH_ALEN, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	frame[12] = ETH_P_FLOOD >> 8;
+	frame[13] = ETH_P_FLOOD & 0xff;
+
+	start = now();
+	end = start + seconds;
+	while (now() < end) {
+		if (sendto(fd, frame, frame_size, 0, (struct sockaddr *)&sll,
+			   sizeof(sll)) < 0) {
+			if (errno != ENOBUFS && errno != EAGAIN)
+				die("sendto");
+			errors++;
+			continue;
+		}
+		sent++;
+	}
+
+	printf("sent %lu frames of %d bytes in %.2f s: %.0f pps, "
+	       "%lu send retries\n", sent, frame_size, now() - start,
+	       sent / (now() - start), errors);
+	return 0;
+}
+
+struct sample {
+	double t;
+	unsigned long long rx_packets, rx_dropped;
+	/* /proc/stat cpu line, in ticks */
+	unsigned long long user, nice, system, idle, iowait, irq, softirq;
+};
+
+static unsigned long long read_stat(const char *name)
+{
+	unsigned long long v = 0;
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+		 ifname, name);
+	f = fopen(path, "r");
+	if (!f)
+		die(path);
+	if (fscanf(f, "%llu", &v) != 1)
+		v = 0;
+	fclose(f);
+	return v;
+}
+
+static void take_sample(struct sample *s)
+{
+	FILE *f;
+
+	s->t = now();
+	s->rx_packets = read_stat("rx_packets");
+	s->rx_dropped = read_stat("rx_dropped") +
+			read_stat("rx_fifo_errors") +
+			read_stat("rx_missed_errors");
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		die("/proc/stat");
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu", &s->user,
+		   &s->nice, &s->system, &s->idle, &s->iowait, &s->irq,
+		   &s->softirq) != 7) {
+		fprintf(stderr, "fec-flood: cannot parse /proc/stat\n");
+		exit(1);
+	}
+	fclose(f);
+}
+
+static int run_watch(void)
+{
+	struct sample a, b, first;
+	unsigned long long ticks;
+	double pps, total_pps = 0;
+	int i;
+
+	printf("%10s %10s %6s %6s %6s %6s %6s\n", "rx pps", "drop/s",
+	       "%irq", "%soft", "%sys", "%usr", "%idle");
+	take_sample(&a);
+	first = a;
+	for (i = 0; i < seconds; i++) {
+		sleep(1);
+		take_sample(&b);
+		ticks = (b.user + b.nice + b.system + b.idle + b.iowait +
+			 b.irq + b.softirq) -
+			(a.user + a.nice + a.system + a.idle + a.iowait +
+			 a.irq + a.softirq);
+		if (!ticks)
+			ticks = 1;
+		pps = (b.rx_packets - a.rx_packets) / (b.t - a.t);
+		total_pps += pps;
+		printf("%10.0f %10.0f %6.1f %6.1f %6.1f %6.1f %6.1f\n", pps,
+		       (b.rx_dropped - a.rx_dropped) / (b.t - a.t),
+		       100.0 * (b.irq - a.irq) / ticks,
+		       100.0 * (b.softirq - a.softirq) / ticks,
+		       100.0 * (b.system - a.system) / ticks,
+		       100.0 * (b.user + b.nice - a.user - a.nice) / ticks,
+		       100.0 * (b.idle + b.iowait - a.idle - a.iowait) / ticks);
+		fflush(stdout);
+		a = b;
+	}
+
+	printf("%s: %llu packets in %.2f s, mean %.0f pps\n", ifname,
+	       b.rx_packets - first.rx_packets, b.t - first.t,
+	       total_pps / seconds);
+	return 0;
+}
+
+static int parse_mac(const char *s)
+{
+	unsigned int m[ETH_ALEN];
+	int i;
+
+	if (sscanf(s, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3],
+		   &m[4], &m[5]) != ETH_ALEN)
+		return -1;
+	for (i = 0; i < ETH_ALEN; i++)
+		dst[i] = m[i];
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode;
+	int opt;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s send|watch [-i iface] [-d mac] "
+			"[-s bytes] [-t seconds]\n", argv[0]);
+		return 2;
+	}
+	mode = argv[1];
+	optind = 2;
+
+	while ((opt = getopt(argc, argv, "i:d:s:t:")) != -1) {
+		switch (opt) {
+		case 'i':
+			ifname = optarg;
+			break;
+		case 'd':
+			if (parse_mac(optarg) < 0) {
+				fprintf(stderr, "fec-flood: bad MAC %s\n",
+					optarg);
+				return 2;
+			}
+			have_dst = 1;
+			break;
+		case 's':
+			frame_size = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (frame_size < ETH_ZLEN || frame_size > ETH_FRAME_LEN ||
+	    seconds < 1) {
+		fprintf(stderr, "fec-flood: frames of %d-%d bytes, at least "
+			"a second\n", ETH_ZLEN, ETH_FRAME_LEN);
+		return 2;
+	}
+
+	if (!strcmp(mode, "send"))
+		return run_send();
+	if (!strcmp(mode, "watch"))
+		return run_watch();
+	fprintf(stderr, "fec-flood: mode is send or watch\n");
+	return 2;
+}
@@ -0,0 +1,254 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o adb-loopback adb-loopback.c */
+
+/*
+ * adb-loopback.c -- sustained bulk throughput of the adb gadget function
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Measures what adb push and pull can get through f_adb, without adb's
+ * own protocol in the way.  The "gadget" half runs where the adb
+ * function is, in place of adbd, and reads from or writes to
+ * /dev/android_adb forever.  The "host" half finds the adb interface
+ * (class 0xff, subclass 0x42, protocol 1) through usbfs, streams bulk
+ * data to or from it for -t seconds and prints the rate in MB/s.
+ *
+ * Both halves must use the same -c: like adb, the host sends chunks
+ * without a zero length packet, and each chunk must fill one read() on
+ * the gadget side.  Keep -c at or below f_adb.buf_size and, for pushes,
+ * at or below 16384 (the usbfs limit of older hosts).
+ *
+ * With dummy_hcd as the gadget's controller both halves run on one
+ * machine; that kernel must also register the android_usb platform
+ * device, which normally comes from the board file.  Otherwise run the
+ * gadget half on the board and the host half on a Linux host connected
+ * by cable, e.g.
+ *
+ *	board# stop adbd; adb-loopback gadget push -c 16384 &
+ *	host#  adb-loopback host push -c 16384 -t 20
+ *
+ *	-c N	chunk size in bytes (default 16384)
+ *	-t N	seconds to run, host half only (default 10)
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usbdevice_fs.h>
+
+#define MAX_CHUNK	(64 * 1024)
+#define TIMEOUT_MS	5000
+
+static int chunk = 16384;
+static int seconds = 10;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "adb-loopback: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+/* Gadget half: stand in for adbd on /dev/android_adb */
+static int run_gadget(int push)
+{
+	static char buf[MAX_CHUNK];
+	ssize_t ret;
+	int fd;
+
+	fd = open("/dev/android_adb", O_RDWR);
+	if (fd < 0)
+		die("/dev/android_adb (is adbd still running?)");
+	memset(buf, 0xa5, sizeof(buf));
+
+	for (;;) {
+		if (push)
+			ret = read(fd, buf, chunk);
+		else
+			ret = write(fd, buf, chunk);
+		if (ret < 0 && errno != EINTR)
+			break;
+	}
+	die(push ? "read" : "write");
+	return 1;
+}
+
+/*
+ * Looks for the adb interface in one usbfs device.  Reading the file
+ * returns the device descriptor followed by the active configuration.
+ */
+static int find_adb(const char *path, int *intf, int *ep_in, int *ep_out)
+{
+	unsigned char desc[4096];
+	int fd, len, pos, in_adb = 0;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -1;
+	len = read(fd, desc, sizeof(desc));
+
+	*intf = *ep_in = *ep_out = -1;
+	for (pos = USB_DT_DEVICE_SIZE; pos + 2 <= len && desc[pos];
+	     pos += desc[pos]) {
+		if (desc[pos + 1] == USB_DT_INTERFACE && !in_adb) {
+			in_adb = desc[pos + 5] == 0xff && desc[pos + 6] == 0x42
+				 && desc[pos + 7] == 0x01;
+			if (in_adb)
+				*intf = desc[pos + 2];
+		} else if (desc[pos + 1] == USB_DT_INTERFACE) {
+			break;
+		} else if (desc[pos + 1] == USB_DT_ENDPOINT && in_adb &&
+			   (desc[pos + 3] & USB_ENDPOINT_XFERTYPE_MASK) ==
+			   USB_ENDPOINT_XFER_BULK) {
+			if (desc[pos + 2] & USB_DIR_IN)
+				*ep_in = desc[pos + 2];
+			else
+				*ep_out = desc[pos + 2];
+		}
+	}
+
+	if (*intf < 0 || *ep_in < 0 || *ep_out < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int open_adb(int *intf, int *ep_in, int *ep_out)
+{
+	char path[600];
+	struct dirent *bus, *dev;
+	DIR *bd, *dd;
+	int fd = -1;
+
+	bd = opendir("/dev/bus/usb");
+	if (!bd)
+		die("/dev/bus/usb");
+	while (fd < 0 && (bus = readdir(bd))) {
+		if (bus->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/dev/bus/usb/%s", bus->d_name);
+		dd = opendir(path);
+		if (!dd)
+			continue;
+		while (fd < 0 && (dev = readdir(dd))) {
+			if (dev->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "/dev/bus/usb/%s/%s",
+				 bus->d_name, dev->d_name);
+			fd = find_adb(path, intf, ep_in, ep_out);
+		}
+		closedir(dd);
+	}
+	closedir(bd);
+
+	if (fd < 0) {
+		fprintf(stderr, "adb-loopback: no adb interface found\n");
+		exit(1);
+	}
+	printf("%s: interface %d, in 0x%02x, out 0x%02x\n", path, *intf,
+	       *ep_in, *ep_out);
+	return fd;
+}
+
+/* Host half: stream bulk data through usbfs and time it */
+static int run_host(int push)
+{
+	static char buf[MAX_CHUNK];
+	struct usbdevfs_bulktransfer bulk;
+	unsigned long long bytes = 0;
+	int fd, intf, ep_in, ep_out, ret;
+	double start, end, t;
+
+	fd = open_adb(&intf, &ep_in, &ep_out);
+	if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &intf) < 0)
+		die("USBDEVFS_CLAIMINTERFACE (is the adb server running?)");
+
+	memset(buf, 0x5a, sizeof(buf));
+	bulk.ep = push ? ep_out : ep_in;
+	bulk.len = chunk;
+	bulk.timeout = TIMEOUT_MS;
+	bulk.data = buf;
+
+	start = now();
+	end = start + seconds;
+	while ((t = now()) < end) {
+		ret = ioctl(fd, USBDEVFS_BULK, &bulk);
+		if (ret < 0) {
+			if (errno == ETIMEDOUT)
+				fprintf(stderr, "adb-loopback: transfer timed "
+					"out; is the gadget half running with "
+					"the same -c?\n");
+			die("USBDEVFS_BULK");
+		}
+		bytes += ret;
+	}
+
+	ioctl(fd, USBDEVFS_RELEASEINTERFACE, &intf);
+	printf("%s: %llu bytes in %d byte chunks, %.2f s, %.2f MB/s\n",
+	       push ? "push" : "pull", bytes, chunk, t - start,
+	       bytes / (t - start) / 1e6);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int gadget, push, opt;
+
+	if (argc < 3 || (strcmp(argv[1], "gadget") &&
+			 strcmp(argv[1], "host")) ||
+	    (strcmp(argv[2], "push") && strcmp(argv[2], "pull"))) {
+		fprintf(stderr, "usage: %s gadget|host push|pull [-c bytes] "
+			"[-t seconds]\n", argv[0]);
+		return 2;
+	}
+	gadget = !strcmp(argv[1], "gadget");
+	push = !strcmp(argv[2], "push");
+	optind = 3;
+
+	while ((opt = getopt(argc, argv, "c:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			chunk = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (chunk < 1 || chunk > MAX_CHUNK || seconds < 1) {
+		fprintf(stderr, "adb-loopback: chunks of 1-%d bytes, at least "
+			"a second\n", MAX_CHUNK);
+		return 2;
+	}
+
+	return gadget ? run_gadget(push) : run_host(push);
+}
@@ -0,0 +1,212 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o msc-bench msc-bench.c */
+
+/*
+ * msc-bench.c -- SCSI READ(10)/WRITE(10) throughput of a USB disk
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Sends READ(10) or WRITE(10) commands straight to a disk with SG_IO, so
+ * that neither the page cache nor the block layer's merging and
+ * read-ahead on the host hide what the mass storage gadget does.  Runs
+ * for -t seconds, sequentially or at random block addresses, and prints
+ * MB/s, commands per second and the mean command time.
+ *
+ * The gadget can be tested on one machine with dummy_hcd: load it with
+ * g_mass_storage exporting a file on the storage under test, find the
+ * disk the host side created and run the benchmark against it.  Writes
+ * overwrite the backing file, e.g.
+ *
+ *	# modprobe dummy_hcd
+ *	# modprobe g_mass_storage file=/data/backing.img buffers=2
+ *	# msc-bench -d /dev/sdb -m seq
+ *	# msc-bench -d /dev/sdb -m rand -b 8 -w
+ *
+ * and again after reloading g_mass_storage with more or larger buffers
+ * (buffers=8 buflen=65536) to see how far the deeper pipeline gets.
+ *
+ *	-d PATH	disk (sd or sg device) of the gadget, required
+ *	-m MODE	seq or rand (default seq)
+ *	-b N	blocks per command (default 128)
+ *	-t N	seconds to run (default 10)
+ *	-w	WRITE(10) instead of READ(10)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <scsi/sg.h>
+
+#define READ_10			0x28
+#define WRITE_10		0x2a
+#define READ_CAPACITY_10	0x25
+#define TIMEOUT_MS		20000
+
+static const char *device;
+static int random_io;
+static int blocks = 128;
+static int seconds = 10;
+static int writing;
+
+static int fd;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "msc-bench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void scsi(unsigned char *cdb, int cdb_len, void *buf, int len, int dir)
+{
+	unsigned char sense[32];
+	sg_io_hdr_t io;
+
+	memset(&io, 0, sizeof(io));
+	io.interface_id = 'S';
+	io.cmdp = cdb;
+	io.cmd_len = cdb_len;
+	io.dxferp = buf;
+	io.dxfer_len = len;
+	io.dxfer_direction = dir;
+	io.sbp = sense;
+	io.mx_sb_len = sizeof(sense);
+	io.timeout = TIMEOUT_MS;
+
+	if (ioctl(fd, SG_IO, &io) < 0)
+		die("SG_IO");
+	if ((io.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+		fprintf(stderr, "msc-bench: command 0x%02x failed: status "
+			"0x%x host 0x%x driver 0x%x sense key 0x%x\n", cdb[0],
+			io.status, io.host_status, io.driver_status,
+			io.sb_len_wr > 2 ? sense[2] & 0x0f : 0);
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char cdb[10], cap[8];
+	uint32_t nblocks, bsize, lba = 0;
+	unsigned long commands = 0;
+	unsigned int seed = 1;
+	double start, end, t;
+	void *buf;
+	int opt, len;
+
+	while ((opt = getopt(argc, argv, "d:m:b:t:w")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'm':
+			random_io = !strcmp(optarg, "rand");
+			if (!random_io && strcmp(optarg, "seq"))
+				device = NULL;
+			break;
+		case 'b':
+			blocks = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			writing = 1;
+			break;
+		default:
+			device = NULL;
+			break;
+		}
+	}
+	if (!device || blocks < 1 || blocks > 0xffff || seconds < 1) {
+		fprintf(stderr, "usage: %s -d disk [-m seq|rand] [-b blocks] "
+			"[-t seconds] [-w]\n", argv[0]);
+		return 2;
+	}
+
+	fd = open(device, writing ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		die(device);
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = READ_CAPACITY_10;
+	scsi(cdb, 10, cap, sizeof(cap), SG_DXFER_FROM_DEV);
+	nblocks = get_be32(cap) + 1;
+	bsize = get_be32(cap + 4);
+	if (nblocks < (uint32_t)blocks) {
+		fprintf(stderr, "msc-bench: %s has only %u blocks\n", device,
+			nblocks);
+		return 2;
+	}
+
+	len = blocks * bsize;
+	buf = malloc(len);
+	if (!buf)
+		die("malloc");
+	memset(buf, 0x5a, len);
+
+	start = now();
+	end = start + seconds;
+	while ((t = now()) < end) {
+		if (random_io)
+			lba = rand_r(&seed) % (nblocks - blocks + 1);
+		else if (lba + blocks > nblocks)
+			lba = 0;
+
+		memset(cdb, 0, sizeof(cdb));
+		cdb[0] = writing ? WRITE_10 : READ_10;
+		put_be32(cdb + 2, lba);
+		cdb[7] = blocks >> 8;
+		cdb[8] = blocks;
+		scsi(cdb, 10, buf, len,
+		     writing ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV);
+
+		commands++;
+		lba += blocks;
+	}
+
+	printf("%s: %u blocks of %u bytes, %s %s of %d blocks, %.2f s\n",
+	       device, nblocks, bsize, random_io ? "random" : "sequential",
+	       writing ? "WRITE(10)" : "READ(10)", blocks, t - start);
+	printf("%.2f MB/s, %.0f commands/s, %.2f ms per command\n",
+	       commands * (double)len / (t - start) / 1e6,
+	       commands / (t - start), (t - start) * 1000 / commands);
+	return 0;
+}